@@ -0,0 +1,218 @@
+/* -*- Mode: C; c-basic-offset: 4 -*- */
+/*
+ * Copyright 2015 Vincent Rasneur <vrasneur@free.fr>
+ * All Rights Reserved.
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation, version 3.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ *   NON INFRINGEMENT.  See the GNU General Public License for
+ *   more details.
+ */
+
+#include "HTTPHeaders.h"
+
+#include "gcc_attributes.h"
+
+static PyObject *
+py_http_headers_new(PyTypeObject *type, GCC_UNUSED PyObject *args, GCC_UNUSED PyObject *kwds)
+{
+    PyObject *self = type->tp_alloc(type, 0);
+    if(self == NULL)
+    {
+	return NULL;
+    }
+
+    PyHTTPHeaders *headers = (PyHTTPHeaders *)self;
+
+    headers->headers = NULL;
+    memset(headers->digest, 0, sizeof(headers->digest));
+
+    return self;
+}
+
+// a line break would inject another header
+static int
+py_http_headers_check(char const *str)
+{
+    if(strpbrk(str, "\r\n") != NULL)
+    {
+	PyErr_SetString(PyExc_ValueError, "HTTP headers must not contain line breaks");
+
+	return -1;
+    }
+
+    return 0;
+}
+
+static int
+py_http_headers_add(PyHTTPHeaders *headers, sha256_ctx_t *ctx, char const *line)
+{
+    if(ci_headers_add(headers->headers, line) == NULL)
+    {
+	PyErr_NoMemory();
+
+	return -1;
+    }
+
+    // the lines are hashed with their trailing NUL as a separator
+    sha256_update(ctx, line, strlen(line) + 1);
+
+    return 0;
+}
+
+static int
+py_http_headers_init(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    PyHTTPHeaders *headers = (PyHTTPHeaders *)self;
+    char *line = NULL;
+    PyObject *fields = NULL;
+    PyObject *seq = NULL;
+    char *header = NULL;
+    sha256_ctx_t ctx;
+    int ret = -1;
+
+    static char *kwlist[] = { "line", "headers", NULL };
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "s|O:HTTPHeaders", kwlist, &line, &fields))
+    {
+	return -1;
+    }
+
+    if(headers->headers != NULL)
+    {
+	PyErr_SetString(PyExc_TypeError, "HTTP headers cannot be modified");
+
+	return -1;
+    }
+
+    if(py_http_headers_check(line) != 0)
+    {
+	return -1;
+    }
+
+    // a mapping gives its items, other objects must be (name, value) pairs
+    if(fields == NULL || fields == Py_None)
+    {
+	seq = PyList_New(0);
+    }
+    else if(PyDict_Check(fields))
+    {
+	seq = PyDict_Items(fields);
+    }
+    else
+    {
+	seq = PySequence_Fast(fields, "HTTP headers must be a dict or a sequence of (name, value) pairs");
+    }
+
+    if(seq == NULL)
+    {
+	return -1;
+    }
+
+    headers->headers = ci_headers_create();
+    if(headers->headers == NULL)
+    {
+	PyErr_NoMemory();
+
+	goto py_http_headers_init_error;
+    }
+
+    sha256_init(&ctx);
+
+    if(py_http_headers_add(headers, &ctx, line) != 0)
+    {
+	goto py_http_headers_init_error;
+    }
+
+    Py_ssize_t len = PySequence_Fast_GET_SIZE(seq);
+    for(Py_ssize_t idx = 0; idx < len; idx++)
+    {
+	char *name = NULL;
+	char *value = NULL;
+
+	if(!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq, idx), "ss;HTTP headers must be (name, value) pairs",
+			     &name, &value))
+	{
+	    goto py_http_headers_init_error;
+	}
+
+	if(py_http_headers_check(name) != 0 || py_http_headers_check(value) != 0)
+	{
+	    goto py_http_headers_init_error;
+	}
+
+	if(*name == '\0' || strchr(name, ':') != NULL)
+	{
+	    PyErr_Format(PyExc_ValueError, "Invalid HTTP header name '%s'", name);
+
+	    goto py_http_headers_init_error;
+	}
+
+	if(asprintf(&header, "%s: %s", name, value) < 0)
+	{
+	    header = NULL;
+	    PyErr_NoMemory();
+
+	    goto py_http_headers_init_error;
+	}
+
+	if(py_http_headers_add(headers, &ctx, header) != 0)
+	{
+	    goto py_http_headers_init_error;
+	}
+
+	free(header), header = NULL;
+    }
+
+    sha256_final(&ctx, headers->digest);
+
+    // the library packs the headers before sending them:
+    // do it now, so that concurrent requests never modify them
+    ci_headers_pack(headers->headers);
+
+    ret = 0;
+
+py_http_headers_init_error:
+
+    free(header), header = NULL;
+    Py_XDECREF(seq);
+
+    if(ret != 0 && headers->headers != NULL)
+    {
+	ci_headers_destroy(headers->headers), headers->headers = NULL;
+    }
+
+    return ret;
+}
+
+static void
+py_http_headers_dealloc(PyObject *self)
+{
+    PyHTTPHeaders *headers = (PyHTTPHeaders *)self;
+
+    if(headers->headers != NULL)
+    {
+	ci_headers_destroy(headers->headers), headers->headers = NULL;
+    }
+
+    Py_TYPE(headers)->tp_free(self);
+}
+
+PyTypeObject PyHTTPHeadersType =
+{
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "icapclient.HTTPHeaders",
+    sizeof(PyHTTPHeaders),
+    .tp_dealloc = py_http_headers_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "Encapsulated HTTP headers, reusable by many requests",
+    .tp_new = py_http_headers_new,
+    .tp_init = py_http_headers_init,
+    .tp_alloc = PyType_GenericAlloc,
+    .tp_free = PyObject_Del
+};
@@ -0,0 +1,37 @@
+/* -*- Mode: C; c-basic-offset: 4 -*- */
+/*
+ * Copyright 2015 Vincent Rasneur <vrasneur@free.fr>
+ * All Rights Reserved.
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation, version 3.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ *   NON INFRINGEMENT.  See the GNU General Public License for
+ *   more details.
+ */
+
+#ifndef PY_HTTP_HEADERS_H
+#define PY_HTTP_HEADERS_H
+
+#include "py_compat.h"
+
+#include "cicap_compat.h"
+#include "sha256.h"
+
+// encapsulated HTTP headers, built once and reused by many requests
+typedef struct
+{
+    PyObject_HEAD
+    // packed once, the library only reads it afterwards
+    ci_headers_list_t *headers;
+    // identifies the headers in the verdict cache
+    unsigned char digest[SHA256_DIGEST_SIZE];
+} PyHTTPHeaders;
+
+PyTypeObject PyHTTPHeadersType;
+
+#endif // PY_HTTP_HEADERS_H
@@ -0,0 +1,622 @@
+/* -*- Mode: C; c-basic-offset: 4 -*- */
+/*
+ * Copyright 2015 Vincent Rasneur <vrasneur@free.fr>
+ * All Rights Reserved.
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation, version 3.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ *   NON INFRINGEMENT.  See the GNU General Public License for
+ *   more details.
+ */
+
+#include "ICAPCluster.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gcc_attributes.h"
+#include "ICAPConnection.h"
+#include "ICAPResponse.h"
+#include "timeutil.h"
+
+// default values
+#define ICAP_DEFAULT_PORT 1344
+#define ICAP_DEFAULT_SERVICE "avscan"
+// in seconds
+#define ICAP_DEFAULT_TIMEOUT 300
+#define ICAP_CLUSTER_DEFAULT_MAX_FAILURES 3
+#define ICAP_CLUSTER_DEFAULT_BACKOFF 1.0
+#define ICAP_CLUSTER_DEFAULT_MAX_BACKOFF 60.0
+// the last latency weighs 1/4 in the average
+#define ICAP_CLUSTER_EWMA_WEIGHT 4
+
+// default exception
+extern PyObject *PyICAP_Exc;
+
+// 1 if the node failed the request, 0 if it succeeded, -1 if it is not involved
+static int
+py_cluster_node_failed(py_conn_job_t const *job)
+{
+    switch(job->error)
+    {
+    case PY_CONN_OK:
+	// the server is in trouble, but answered: the response is still returned
+	return (job->status >= 500) ? 1 : 0;
+    case PY_CONN_ERR_CONNECT:
+    case PY_CONN_ERR_CREATE:
+    case PY_CONN_ERR_OPTIONS:
+    case PY_CONN_ERR_SEND:
+	return 1;
+    default:
+	return -1;
+    }
+}
+
+// the mean latency of the measured nodes, 0 if none was measured yet
+static double
+py_cluster_mean_ewma(PyICAPCluster const *cluster)
+{
+    double total = 0;
+    int measured = 0;
+
+    for(int idx = 0; idx < cluster->nnodes; idx++)
+    {
+	if(cluster->nodes[idx].ewma != 0)
+	{
+	    total += cluster->nodes[idx].ewma;
+	    measured++;
+	}
+    }
+
+    return (measured > 0) ? total / measured : 0;
+}
+
+// the lower the better
+static double
+py_cluster_node_cost(PyICAPCluster const *cluster, py_cluster_node_t const *node, double mean_ewma)
+{
+    if(cluster->policy == PY_CLUSTER_EWMA)
+    {
+	// a node without latency yet is assumed average: it gets probed, but
+	// does not take all the requests while its first answer is pending
+	double ewma = (node->ewma != 0) ? node->ewma : mean_ewma;
+
+	// until a node is measured, only the outstanding requests count
+	if(ewma > 0)
+	{
+	    return ewma * (node->outstanding + 1);
+	}
+    }
+
+    return node->outstanding;
+}
+
+// must be called with the cluster lock held, returns -1 when all the nodes were tried
+static int
+py_cluster_pick(PyICAPCluster *cluster, char const *tried, int64_t now)
+{
+    int best = -1;
+    int fallback = -1;
+    double mean_ewma = (cluster->policy == PY_CLUSTER_EWMA) ? py_cluster_mean_ewma(cluster) : 0;
+
+    for(int count = 0; count < cluster->nnodes; count++)
+    {
+	int idx = (cluster->next + count) % cluster->nnodes;
+	py_cluster_node_t const *node = &cluster->nodes[idx];
+
+	if(tried[idx])
+	{
+	    continue;
+	}
+
+	if(node->down_until > now)
+	{
+	    // when all the nodes are down, try the one coming back first
+	    if(fallback < 0 || node->down_until < cluster->nodes[fallback].down_until)
+	    {
+		fallback = idx;
+	    }
+
+	    continue;
+	}
+
+	if(best < 0 || py_cluster_node_cost(cluster, node, mean_ewma) <
+	   py_cluster_node_cost(cluster, &cluster->nodes[best], mean_ewma))
+	{
+	    best = idx;
+	}
+    }
+
+    cluster->next++;
+
+    return (best >= 0) ? best : fallback;
+}
+
+// passive health check: too many consecutive failures exclude the node for a while
+static void
+py_cluster_record(PyICAPCluster *cluster, py_cluster_node_t *node, py_conn_job_t const *job)
+{
+    int failed = py_cluster_node_failed(job);
+    int64_t now = py_time_now_ns();
+
+    pthread_mutex_lock(&cluster->lock);
+
+    node->outstanding--;
+    node->requests++;
+
+    if(failed > 0)
+    {
+	node->errors++;
+	node->failures++;
+
+	if(node->failures >= cluster->max_failures)
+	{
+	    node->down_until = now + node->backoff;
+	    node->backoff *= 2;
+	    if(node->backoff > cluster->max_backoff)
+	    {
+		node->backoff = cluster->max_backoff;
+	    }
+	}
+    }
+    else if(failed == 0)
+    {
+	int64_t latency = job->stats.end - job->stats.start;
+
+	node->failures = 0;
+	node->down_until = 0;
+	node->backoff = cluster->min_backoff;
+	node->ewma = (node->ewma == 0) ? latency :
+	    node->ewma + (latency - node->ewma) / ICAP_CLUSTER_EWMA_WEIGHT;
+    }
+
+    pthread_mutex_unlock(&cluster->lock);
+}
+
+static PyObject *
+py_cluster_new(PyTypeObject *type, GCC_UNUSED PyObject *args, GCC_UNUSED PyObject *kwds)
+{
+    PyObject *self = type->tp_alloc(type, 0);
+    PyICAPCluster *cluster = (PyICAPCluster *)self;
+
+    if(self == NULL)
+    {
+	return NULL;
+    }
+
+    // should already be set to 0 by the alloc call
+    cluster->nodes = NULL;
+    cluster->nnodes = 0;
+    cluster->policy = PY_CLUSTER_LEAST_OUTSTANDING;
+    cluster->next = 0;
+    pthread_mutex_init(&cluster->lock, NULL);
+
+    return self;
+}
+
+static int
+py_cluster_parse_policy(char const *policy)
+{
+    if(strcmp(policy, "least_outstanding") == 0)
+    {
+	return PY_CLUSTER_LEAST_OUTSTANDING;
+    }
+
+    if(strcmp(policy, "ewma") == 0)
+    {
+	return PY_CLUSTER_EWMA;
+    }
+
+    PyErr_SetString(PyExc_ValueError, "Policy should be either 'least_outstanding' or 'ewma'");
+
+    return -1;
+}
+
+// a node is a "host" string or a (host, port) pair
+static int
+py_cluster_parse_node(PyObject *item, char **host, int *port)
+{
+    *port = ICAP_DEFAULT_PORT;
+
+    if(PY_TEXT_CHECK(item))
+    {
+	if(!PyArg_Parse(item, "s", host))
+	{
+	    return -1;
+	}
+    }
+    else if(!PyTuple_Check(item) || !PyArg_ParseTuple(item, "si", host, port))
+    {
+	PyErr_SetString(PyExc_TypeError, "ICAP cluster nodes must be hosts or (host, port) pairs");
+
+	return -1;
+    }
+
+    if(*port < 0 || *port > 0xffff)
+    {
+	PyErr_SetString(PyExc_OverflowError, "Port must be 0-65535");
+
+	return -1;
+    }
+
+    return 0;
+}
+
+static int
+py_cluster_init(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    PyICAPCluster *cluster = (PyICAPCluster *)self;
+    PyObject *nodes = NULL;
+    char *policy = "least_outstanding";
+    int max_size = 8;
+    int idle_timeout = 60;
+    int proto = AF_UNSPEC;
+    int max_failures = ICAP_CLUSTER_DEFAULT_MAX_FAILURES;
+    double backoff = ICAP_CLUSTER_DEFAULT_BACKOFF;
+    double max_backoff = ICAP_CLUSTER_DEFAULT_MAX_BACKOFF;
+
+    static char *kwlist[] = { "nodes", "policy", "max_size", "idle_timeout", "proto",
+			      "max_failures", "backoff", "max_backoff", NULL };
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "O|siiiidd", kwlist,
+				    &nodes, &policy, &max_size, &idle_timeout, &proto,
+				    &max_failures, &backoff, &max_backoff))
+    {
+	return -1;
+    }
+
+    int policy_value = py_cluster_parse_policy(policy);
+    if(policy_value < 0)
+    {
+	return -1;
+    }
+
+    if(proto != AF_UNSPEC && proto != AF_INET && proto != AF_INET6)
+    {
+	PyErr_SetString(PyExc_ValueError, "Proto must either be AF_UNSPEC, AF_INET or AF_INET6");
+
+	return -1;
+    }
+
+    if(max_size <= 0)
+    {
+	PyErr_SetString(PyExc_ValueError, "Pool size must have a positive value");
+
+	return -1;
+    }
+
+    if(idle_timeout < 0)
+    {
+	PyErr_SetString(PyExc_ValueError, "Idle timeout must have a positive value (or zero)");
+
+	return -1;
+    }
+
+    if(max_failures <= 0)
+    {
+	PyErr_SetString(PyExc_ValueError, "The maximum number of failures must have a positive value");
+
+	return -1;
+    }
+
+    if(backoff <= 0 || max_backoff < backoff)
+    {
+	PyErr_SetString(PyExc_ValueError, "Backoff must have a positive value, lower than the maximum backoff");
+
+	return -1;
+    }
+
+    if(cluster->nodes != NULL)
+    {
+	PyErr_SetString(PyICAP_Exc, "The ICAP cluster is already initialized");
+
+	return -1;
+    }
+
+    PyObject *seq = PySequence_Fast(nodes, "ICAP cluster nodes must be a sequence");
+    if(seq == NULL)
+    {
+	return -1;
+    }
+
+    Py_ssize_t count = PySequence_Fast_GET_SIZE(seq);
+    if(count <= 0 || count > INT_MAX)
+    {
+	PyErr_SetString(PyExc_ValueError, "ICAP cluster needs at least one node");
+
+	goto py_cluster_init_error;
+    }
+
+    cluster->nodes = calloc(count, sizeof(*cluster->nodes));
+    if(cluster->nodes == NULL)
+    {
+	PyErr_NoMemory();
+
+	goto py_cluster_init_error;
+    }
+
+    cluster->policy = policy_value;
+    cluster->max_failures = max_failures;
+    cluster->min_backoff = (int64_t)(backoff * 1e9);
+    cluster->max_backoff = (int64_t)(max_backoff * 1e9);
+
+    for(Py_ssize_t idx = 0; idx < count; idx++)
+    {
+	py_cluster_node_t *node = &cluster->nodes[idx];
+	char *host = NULL;
+	int port = 0;
+
+	if(py_cluster_parse_node(PySequence_Fast_GET_ITEM(seq, idx), &host, &port) != 0)
+	{
+	    goto py_cluster_init_error;
+	}
+
+	node->pool = py_pool_create(host, port, proto, max_size, idle_timeout);
+	if(node->pool == NULL)
+	{
+	    PyErr_NoMemory();
+
+	    goto py_cluster_init_error;
+	}
+
+	node->backoff = cluster->min_backoff;
+	cluster->nnodes++;
+    }
+
+py_cluster_init_error:
+
+    Py_DECREF(seq);
+
+    return PyErr_Occurred() ? -1 : 0;
+}
+
+static void
+py_cluster_dealloc(PyObject *self)
+{
+    PyICAPCluster *cluster = (PyICAPCluster *)self;
+
+    for(int idx = 0; idx < cluster->nnodes; idx++)
+    {
+	py_pool_destroy(cluster->nodes[idx].pool), cluster->nodes[idx].pool = NULL;
+    }
+
+    free(cluster->nodes), cluster->nodes = NULL;
+    cluster->nnodes = 0;
+    pthread_mutex_destroy(&cluster->lock);
+
+    Py_TYPE(cluster)->tp_free(self);
+}
+
+static PyObject *
+py_cluster_request(PyICAPCluster *cluster, PyObject *args, PyObject *kwds)
+{
+    char *type = NULL;
+    PyObject *source = NULL;
+    PyObject *data = NULL;
+    PyObject *sink = NULL;
+    PyObject *preview = NULL;
+    PyObject *req_headers = NULL;
+    PyObject *resp_headers = NULL;
+    PyObject *body = NULL;
+    PyObject *max_memory_content = NULL;
+    char *service = ICAP_DEFAULT_SERVICE;
+    char *url = "/";
+    int timeout = ICAP_DEFAULT_TIMEOUT;
+    int read_content = 1;
+    char *tried = NULL;
+    int nopool = 0;
+    py_conn_job_t job;
+    PyObject *resp = NULL;
+
+    static char *kwlist[] = { "type", "filename", "url", "service", "timeout", "read_content", "data", "sink",
+			      "preview", "req_headers", "resp_headers", "body", "max_memory_content",
+			      NULL };
+
+    py_conn_job_init(&job);
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "s|OssiiOOOOOOO:request", kwlist,
+				    &type, &source, &url, &service, &timeout, &read_content, &data, &sink,
+				    &preview, &req_headers, &resp_headers, &body, &max_memory_content))
+    {
+	goto py_cluster_request_error;
+    }
+
+    if(cluster->nodes == NULL)
+    {
+	PyErr_SetString(PyICAP_Exc, "The ICAP cluster is not initialized");
+
+	goto py_cluster_request_error;
+    }
+
+    job.service = service;
+    job.url = url;
+
+    if(py_conn_job_setup(&job, type, source, data, sink, timeout, read_content, preview) != 0 ||
+       py_conn_job_set_headers(&job, req_headers, resp_headers) != 0 ||
+       py_conn_job_set_body(&job, body, max_memory_content) != 0)
+    {
+	goto py_cluster_request_error;
+    }
+
+    tried = calloc(cluster->nnodes, 1);
+    if(tried == NULL)
+    {
+	PyErr_NoMemory();
+
+	goto py_cluster_request_error;
+    }
+
+    for(;;)
+    {
+	py_cluster_node_t *node = NULL;
+	ci_connection_t *sock = NULL;
+
+	pthread_mutex_lock(&cluster->lock);
+	int idx = py_cluster_pick(cluster, tried, py_time_now_ns());
+	if(idx >= 0)
+	{
+	    node = &cluster->nodes[idx];
+	    node->outstanding++;
+	    tried[idx] = 1;
+	}
+	pthread_mutex_unlock(&cluster->lock);
+
+	if(node == NULL)
+	{
+	    break;
+	}
+
+	job.host = node->pool->host;
+	job.port = node->pool->port;
+	job.proto = node->pool->proto;
+	job.error = PY_CONN_OK;
+
+	Py_BEGIN_ALLOW_THREADS
+	nopool = (py_pool_acquire(node->pool, (job.timeout > 0) ? job.timeout : -1, &sock) != 0);
+	if(!nopool)
+	{
+	    py_conn_job_run(&job, &sock);
+	    py_pool_release(node->pool, sock, job.keepalive);
+	}
+	Py_END_ALLOW_THREADS
+
+	if(nopool)
+	{
+	    pthread_mutex_lock(&cluster->lock);
+	    node->outstanding--;
+	    pthread_mutex_unlock(&cluster->lock);
+
+	    break;
+	}
+
+	py_cluster_record(cluster, node, &job);
+
+	// nothing was sent yet: another node can take the request
+	if(job.error != PY_CONN_ERR_CONNECT)
+	{
+	    break;
+	}
+    }
+
+    if(nopool)
+    {
+	PyErr_SetString(PyICAP_Exc, "No ICAP connection available in the pool");
+    }
+    else if(job.error != PY_CONN_OK)
+    {
+	py_conn_job_set_error(&job);
+    }
+    else
+    {
+	PyObject *content = NULL;
+
+	if(py_conn_job_finish(&job, &content) == 0)
+	{
+	    resp = py_resp_new(job.req, job.status, &job.stats, content);
+	    Py_XDECREF(content);
+	}
+
+	if(resp == NULL && !PyErr_Occurred())
+	{
+	    PyErr_SetString(PyICAP_Exc, "Cannot create the ICAP response object");
+	}
+    }
+
+py_cluster_request_error:
+
+    free(tried), tried = NULL;
+    py_conn_job_clear(&job);
+
+    return resp;
+}
+
+static PyObject *
+py_cluster_get_nodes(PyICAPCluster *cluster, GCC_UNUSED void *closure)
+{
+    PyObject *list = PyList_New(cluster->nnodes);
+    if(list == NULL)
+    {
+	return NULL;
+    }
+
+    for(int idx = 0; idx < cluster->nnodes; idx++)
+    {
+	py_cluster_node_t node;
+
+	pthread_mutex_lock(&cluster->lock);
+	node = cluster->nodes[idx];
+	pthread_mutex_unlock(&cluster->lock);
+
+	PyObject *latency = Py_None;
+	if(node.ewma != 0)
+	{
+	    latency = PyFloat_FromDouble(node.ewma / 1e9);
+	    if(latency == NULL)
+	    {
+		Py_DECREF(list);
+
+		return NULL;
+	    }
+	}
+	else
+	{
+	    Py_INCREF(latency);
+	}
+
+	PyObject *dict = Py_BuildValue("{s:s,s:i,s:i,s:N,s:i,s:O,s:L,s:L}",
+				       "host", node.pool->host,
+				       "port", node.pool->port,
+				       "outstanding", node.outstanding,
+				       "latency", latency,
+				       "failures", node.failures,
+				       "healthy", (node.down_until <= py_time_now_ns()) ? Py_True : Py_False,
+				       "requests", (long long)node.requests,
+				       "errors", (long long)node.errors);
+	if(dict == NULL)
+	{
+	    Py_DECREF(list);
+
+	    return NULL;
+	}
+
+	PyList_SET_ITEM(list, idx, dict);
+    }
+
+    return list;
+}
+
+static PyGetSetDef py_cluster_getset[] =
+{
+    { "nodes", (getter)py_cluster_get_nodes, NULL,
+      "the state of each node: load, smoothed latency in seconds and health", NULL },
+    { .name = NULL }
+};
+
+static struct PyMethodDef py_cluster_methods[] =
+{
+    { "request", (PyCFunction)py_cluster_request,
+      METH_VARARGS | METH_KEYWORDS, "send an ICAP request to the best node and get its response" },
+    { .ml_name = NULL }
+};
+
+PyTypeObject PyICAPClusterType =
+{
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "icapclient.ICAPCluster",
+    sizeof(PyICAPCluster),
+    .tp_dealloc = py_cluster_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "ICAP client-side load balancer",
+    .tp_getset = py_cluster_getset,
+    .tp_methods = py_cluster_methods,
+    .tp_new = py_cluster_new,
+    .tp_init = py_cluster_init,
+    .tp_alloc = PyType_GenericAlloc,
+    .tp_free = PyObject_Del
+};
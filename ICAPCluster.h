@@ -0,0 +1,68 @@
+/* -*- Mode: C; c-basic-offset: 4 -*- */
+/*
+ * Copyright 2015 Vincent Rasneur <vrasneur@free.fr>
+ * All Rights Reserved.
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation, version 3.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ *   NON INFRINGEMENT.  See the GNU General Public License for
+ *   more details.
+ */
+
+#ifndef PY_ICAP_CLUSTER_H
+#define PY_ICAP_CLUSTER_H
+
+#include "py_compat.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "ICAPConnectionPool.h"
+
+typedef enum
+{
+    PY_CLUSTER_LEAST_OUTSTANDING = 0,
+    PY_CLUSTER_EWMA
+} py_cluster_policy_t;
+
+typedef struct
+{
+    py_pool_t *pool;
+    // the requests running on this node
+    int outstanding;
+    // the smoothed request latency, in nanoseconds, 0 before the first request
+    int64_t ewma;
+    // the consecutive failures
+    int failures;
+    // the node is not used before this monotonic time, in nanoseconds
+    int64_t down_until;
+    // the next exclusion delay, in nanoseconds
+    int64_t backoff;
+    int64_t requests;
+    int64_t errors;
+} py_cluster_node_t;
+
+typedef struct
+{
+    PyObject_HEAD
+    py_cluster_node_t *nodes;
+    int nnodes;
+    py_cluster_policy_t policy;
+    int max_failures;
+    // in nanoseconds
+    int64_t min_backoff;
+    int64_t max_backoff;
+    // protects the node states, never held while waiting
+    pthread_mutex_t lock;
+    // spreads the ties between the nodes
+    unsigned int next;
+} PyICAPCluster;
+
+PyTypeObject PyICAPClusterType;
+
+#endif // PY_ICAP_CLUSTER_H
@@ -16,14 +16,28 @@
 
 #include "ICAPConnection.h"
 
-#include <cStringIO.h>
+#include <errno.h>
+#include <limits.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 
 #include "gcc_attributes.h"
 #include "cicap_compat.h"
+#include "options_cache.h"
 #include "ICAPResponse.h"
-
-// cStringIO module
-extern struct PycStringIO_CAPI *PycStringIO_ref;
+#include "ICAPContent.h"
+#include "ICAPConnectionPool.h"
+#include "ICAPExchange.h"
+#include "verdict_cache.h"
+#include "HTTPHeaders.h"
+#include "timeutil.h"
+#include "metrics.h"
+#include "resolver.h"
+#include "native_client.h"
 
 // default values
 #define ICAP_DEFAULT_PORT 1344
@@ -31,6 +45,15 @@ extern struct PycStringIO_CAPI *PycStringIO_ref;
 // in seconds
 #define ICAP_DEFAULT_TIMEOUT 300
 
+// the body chunks sent by the native writer, 0 lets the library send the body
+// (the native writer is opt-in until bench/run_bench.py shows it at parity)
+#define ICAP_DEFAULT_IO_BUFFER_SIZE 0
+#define ICAP_MAX_IO_BUFFER_SIZE (16 * 1024 * 1024)
+// the bigger response contents are moved to a temporary file
+#define ICAP_DEFAULT_MAX_MEMORY_CONTENT (32 * 1024 * 1024)
+// the size asked to the read method of a file object
+#define ICAP_STREAM_BLOCK_SIZE (256 * 1024)
+
 // default exception
 extern PyObject *PyICAP_Exc;
 
@@ -48,6 +71,10 @@ py_conn_new(PyTypeObject *type, GCC_UNUSED PyObject *args, GCC_UNUSED PyObject *
     conn->req = NULL;
     conn->req_status = 0;
     conn->content = NULL;
+    conn->response = NULL;
+    conn->keepalive = 0;
+    conn->busy = 0;
+    conn->pool = NULL;
 
     return self;
 }
@@ -58,7 +85,7 @@ py_conn_init(PyObject *self, PyObject *args, PyObject *kwds)
     PyICAPConnection *conn = (PyICAPConnection *)self;
     char *host = NULL;
     int port = ICAP_DEFAULT_PORT;
-    int proto = AF_INET;
+    int proto = AF_UNSPEC;
    
     static char *kwlist[] = { "host", "port", "proto", NULL };
 
@@ -74,9 +101,9 @@ py_conn_init(PyObject *self, PyObject *args, PyObject *kwds)
 	return -1;
     }       
 
-    if(proto != AF_INET && proto != AF_INET6)
+    if(proto != AF_UNSPEC && proto != AF_INET && proto != AF_INET6)
     {
-	PyErr_SetString(PyExc_ValueError, "Proto must either be AF_INET or AF_INET6");
+	PyErr_SetString(PyExc_ValueError, "Proto must either be AF_UNSPEC, AF_INET or AF_INET6");
 
 	return -1;
     }
@@ -98,6 +125,8 @@ py_conn_init(PyObject *self, PyObject *args, PyObject *kwds)
 static void
 py_conn_free_req(PyICAPConnection *conn)
 {
+    Py_CLEAR(conn->response);
+
     if(conn->req == NULL)
     {
 	return;
@@ -118,21 +147,79 @@ py_conn_free_req(PyICAPConnection *conn)
     }
 }
 
+void
+py_conn_destroy_connection(ci_connection_t *conn)
+{
+    close(conn->fd), conn->fd = -1;
+    free(conn);
+}
+
 static void
 py_conn_free_conn(PyICAPConnection *conn)
 {
+    conn->keepalive = 0;
+
     if(conn->conn == NULL)
     {
 	return;
     }
 
-    close(conn->conn->fd), conn->conn->fd = -1;
-    free(conn->conn), conn->conn = NULL;
+    py_conn_destroy_connection(conn->conn), conn->conn = NULL;
+}
+
+static int
+py_conn_check_busy(PyICAPConnection *conn)
+{
+    if(conn->busy)
+    {
+	PyErr_SetString(PyICAP_Exc, "The ICAP connection is already used by another thread");
+
+	return -1;
+    }
+
+    return 0;
+}
+
+// give the socket back to the pool
+PyObject *
+py_conn_release(PyICAPConnection *conn)
+{
+    PyICAPConnectionPool *pool = (PyICAPConnectionPool *)conn->pool;
+
+    // the socket is still used by a request of another thread
+    if(py_conn_check_busy(conn) != 0)
+    {
+	return NULL;
+    }
+
+    py_conn_free_req(conn);
+
+    if(pool != NULL)
+    {
+	py_pool_release(pool->pool, conn->conn, conn->keepalive);
+	conn->conn = NULL;
+	conn->keepalive = 0;
+	conn->pool = NULL;
+	Py_DECREF(pool);
+    }
+
+    Py_RETURN_NONE;
 }
 
 static PyObject *
 py_conn_close(PyICAPConnection *conn)
 {
+    if(py_conn_check_busy(conn) != 0)
+    {
+	return NULL;
+    }
+
+    // a pooled connection goes back to its pool
+    if(conn->pool != NULL)
+    {
+	return py_conn_release(conn);
+    }
+
     py_conn_free_req(conn);
     py_conn_free_conn(conn);
    
@@ -144,6 +231,12 @@ py_conn_dealloc(PyObject *self)
 {
     PyICAPConnection *conn = (PyICAPConnection *)self;
 
+    if(conn->pool != NULL)
+    {
+	PyObject *res = py_conn_release(conn);
+	Py_XDECREF(res);
+    }
+
     free(conn->host), conn->host = NULL;
     py_conn_free_req(conn);
     py_conn_free_conn(conn);
@@ -151,280 +244,2205 @@ py_conn_dealloc(PyObject *self)
     Py_TYPE(conn)->tp_free(self);
 }
 
-static PyObject *
-py_conn_connect(PyICAPConnection *conn)
+static int
+py_conn_open_connection(PyICAPConnection *conn)
 {
     if(conn->conn == NULL)
     {
-	conn->conn = ci_client_connect_to(conn->host, conn->port, conn->proto);
+	Py_BEGIN_ALLOW_THREADS
+	conn->conn = py_resolver_connect(conn->host, conn->port, conn->proto, ICAP_DEFAULT_TIMEOUT);
+	Py_END_ALLOW_THREADS
     }
    
     if(conn->conn == NULL)
     {
 	PyErr_Format(PyICAP_Exc, "Cannot connect to server '%s:%d'", conn->host, conn->port);
+	return -1;
+    }
+
+    return 0;
+}
+
+static PyObject *
+py_conn_connect(PyICAPConnection *conn)
+{
+    if(py_conn_check_busy(conn) != 0)
+    {
+	return NULL;
+    }
+
+    if(py_conn_open_connection(conn) != 0)
+    {
 	return NULL;
     }
 
     Py_RETURN_NONE;
 }
 
-static int
-py_conn_read(void *ctx, char *buf, int len)
+// the files of at least this size are mapped, 0 to always read them
+// protected by the GIL
+static Py_ssize_t py_conn_map_min_size = 0;
+
+void
+py_conn_set_map_min_size(Py_ssize_t min_size)
 {
-    int *fd = ctx;
-    int ret = read(*fd, buf, len);
-    return ret;
+    py_conn_map_min_size = min_size;
 }
 
-static int
-py_conn_write(void *ctx, char *buf, int len)
+// map a big regular file, to avoid a read syscall per chunk
+// opt-in: a file truncated while it is sent raises SIGBUS, where read() just ends early
+static void
+py_conn_map_input(py_conn_input_t *input)
 {
-    PyObject *sio = ctx;
-    int ret = len;
+    struct stat st;
 
-    if(sio != NULL)
+    if(py_conn_map_min_size == 0 || fstat(input->fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+       st.st_size < py_conn_map_min_size || (uintmax_t)st.st_size > PY_SSIZE_T_MAX)
     {
-	PyGILState_STATE gstate;
+	return;
+    }
 
-	// reacquire the GIL to execute the Python cStringIO code
-	gstate = PyGILState_Ensure();
-	ret = PycStringIO_ref->cwrite(sio, buf, len);
-	PyGILState_Release(gstate);
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, input->fd, 0);
+    if(map == MAP_FAILED)
+    {
+	// fall back to plain reads
+	return;
     }
 
-    return ret;
+    // the body is sent once, from the start to the end
+    (void)posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+
+    input->map = map;
+    input->map_len = st.st_size;
+    input->data = map;
+    input->len = st.st_size;
+
+    close(input->fd), input->fd = -1;
 }
 
-static ci_headers_list_t *
-py_conn_build_respmod_http_headers(void)
+// a descriptor of the caller, read from its current offset
+static int
+py_conn_open_input_fd(py_conn_input_t *input, PyObject *data)
 {
-    ci_headers_list_t *resp_headers = ci_headers_create();
-    if(resp_headers == NULL)
+    long fd = PyLong_AsLong(data);
+    if(fd == -1 && PyErr_Occurred())
     {
-	return NULL;
+	return -1;
     }
 
-    ci_headers_add(resp_headers, "HTTP/1.1 200 OK");
-    ci_headers_add(resp_headers, "Transfer-Encoding: chunked");
-   
-    return resp_headers;
+    if(fd < 0 || fd > INT_MAX)
+    {
+	PyErr_SetString(PyExc_ValueError, "Request file descriptor must have a positive value");
+
+	return -1;
+    }
+
+    input->fd = fd;
+    input->borrowed_fd = 1;
+    // pipes and sockets cannot be read again
+    input->start = lseek(input->fd, 0, SEEK_CUR);
+
+    return 0;
 }
 
-static ci_headers_list_t *
-py_conn_build_reqmod_http_headers(char const *url)
+// the chunks come from a file object or an iterator, read with the GIL
+static int
+py_conn_open_input_stream(py_conn_input_t *input, PyObject *data)
 {
-    char *line = NULL;
-    int ret = asprintf(&line, "POST %s HTTP/1.1", url);
-    if(ret <= -1 || line == NULL)
+    if(PyObject_HasAttrString(data, "read"))
     {
-	return NULL;
+	input->stream = PyObject_GetAttrString(data, "read");
+	input->stream_is_file = 1;
+
+	return (input->stream != NULL) ? 0 : -1;
     }
 
-    ci_headers_list_t *req_headers = ci_headers_create();
-    if(req_headers != NULL)
+    // a socket has no buffered data: its descriptor is read directly
+    if(PyObject_HasAttrString(data, "fileno"))
     {
-	ci_headers_add(req_headers, line);
-	ci_headers_add(req_headers, "Host: localhost");
-	ci_headers_add(req_headers, "Transfer-Encoding: chunked");
+	PyObject *fileno = PyObject_CallMethod(data, "fileno", NULL);
+	if(fileno == NULL)
+	{
+	    return -1;
+	}
+
+	int ret = py_conn_open_input_fd(input, fileno);
+	Py_DECREF(fileno);
+
+	return ret;
     }
-   
-    free(line), line = NULL;
-   
-    return req_headers;
-}
 
-static int
-py_conn_fill_server_options(ci_request_t *req, int timeout)
-{
-    int ret = CI_OK;
-    
-    Py_BEGIN_ALLOW_THREADS
-    ret = ci_client_get_server_options(req, timeout);
-    Py_END_ALLOW_THREADS
-    
-    if(ret != CI_ERROR)
+    input->stream = PyObject_GetIter(data);
+    if(input->stream == NULL)
     {
-	// save the retrieved  values;
-	int preview = req->preview;
-	int allow204 = req->allow204;
-#ifndef OLD_CICAP_VERSION
-	int allow206 = req->allow206;
-#endif
-	int keepalive = req->keepalive;
-	// reuse the old OPTIONS request
-	ci_client_request_reuse(req);
-	// copy the saved values
-	req->preview = preview;
-	req->allow204 = allow204;
-#ifndef OLD_CICAP_VERSION
-	req->allow206 = allow206;
-#endif
-	req->keepalive = keepalive;
+	PyErr_SetString(PyExc_TypeError, "Request data must support the buffer protocol, "
+			"or be a file descriptor, a file object or an iterable of chunks");
+
+	return -1;
     }
-    
-    return ret;
+
+    return 0;
 }
 
-static PyObject *
-py_conn_request(PyICAPConnection *conn, PyObject *args, PyObject *kwds)
+int
+py_conn_open_input(py_conn_input_t *input, char const *filename, PyObject *data)
 {
-    char *type = NULL;
-    char *filename = NULL;
-    char *service = ICAP_DEFAULT_SERVICE;
-    char *url = "/";
-    int timeout = ICAP_DEFAULT_TIMEOUT;
-    int read_content = 1;
-    int input_fd = -1;
-    ci_headers_list_t *req_headers = NULL;
-    ci_headers_list_t *resp_headers = NULL;
-   
-    static char *kwlist[] = { "type", "filename", "url", "service", "timeout", "read_content", NULL };
+    input->fd = -1;
+    input->borrowed_fd = 0;
+    input->start = 0;
+    input->stream = NULL;
+    input->stream_is_file = 0;
+    input->stream_eof = 0;
+    input->error_type = NULL;
+    input->error = NULL;
+    input->error_tb = NULL;
+    input->timeout = -1;
+    input->read_errno = 0;
+    input->view.obj = NULL;
+    input->map = NULL;
+    input->map_len = 0;
+    input->data = NULL;
+    input->len = 0;
+    input->pos = 0;
+    input->sent = 0;
+    input->preview = -1;
+    input->first_read = 0;
+    input->last_read = 0;
 
-    if(!PyArg_ParseTupleAndKeywords(args, kwds, "ss|ssii:request", kwlist,
-				    &type, &filename, &url, &service, &timeout, &read_content))
+    if(filename != NULL)
     {
-	goto py_conn_request_error;
-    }
+	input->fd = open(filename, O_RDONLY);
+	if(input->fd < 0)
+	{
+	    PyErr_SetFromErrnoWithFilename(PyExc_IOError, filename);
 
-    // validate the arguments
+	    return -1;
+	}
 
-    if(strcmp(type, "REQMOD") != 0 && strcmp(type, "RESPMOD") != 0)
-    {
-	PyErr_SetString(PyExc_ValueError, "Request type should be either 'REQMOD' or 'RESPMOD'");
+	py_conn_map_input(input);
 
-	goto py_conn_request_error;
+	return 0;
     }
-   
-    if(timeout < 0)
+
+    if(PyObject_CheckBuffer(data))
     {
-	PyErr_SetString(PyExc_ValueError, "Request timeout must have a positive value (or zero)");
- 
-	goto py_conn_request_error;
+	if(PyObject_GetBuffer(data, &input->view, PyBUF_SIMPLE) != 0)
+	{
+	    return -1;
+	}
+
+	input->data = input->view.buf;
+	input->len = input->view.len;
+
+	return 0;
     }
 
-    input_fd = open(filename, O_RDONLY);
-    if(input_fd < 0)
+#if PY_MAJOR_VERSION < 3
+    // objects like mmap only implement the old buffer protocol
+    void const *buf = NULL;
+    Py_ssize_t len = 0;
+
+    if(PyObject_AsReadBuffer(data, &buf, &len) == 0)
     {
-	PyErr_SetFromErrnoWithFilename(PyExc_IOError, filename);
-      
-	goto py_conn_request_error;
+	input->data = buf;
+	input->len = len;
+
+	return PyBuffer_FillInfo(&input->view, data, (void *)buf, len, 1, PyBUF_SIMPLE);
     }
+#endif
 
-    // connect to the server if not already connected
-    if(conn->conn == NULL)
+    if((PyInt_Check(data) || PyLong_Check(data)) && !PyBool_Check(data))
     {
-	PyObject *res = py_conn_connect(conn);
-	Py_XDECREF(res);
+	return py_conn_open_input_fd(input, data);
+    }
+
+    return py_conn_open_input_stream(input, data);
+}
 
-	if(PyErr_Occurred())
+static void
+py_conn_close_input(py_conn_input_t *input)
+{
+    if(input->fd >= 0)
+    {
+	if(!input->borrowed_fd)
 	{
-	    goto py_conn_request_error;
+	    close(input->fd);
 	}
+
+	input->fd = -1;
     }
-  
-    py_conn_free_req(conn);
-   
-    conn->req = ci_client_request(conn->conn, conn->host, service);
-    if(conn->req == NULL)
+
+    Py_CLEAR(input->stream);
+    Py_CLEAR(input->error_type);
+    Py_CLEAR(input->error);
+    Py_CLEAR(input->error_tb);
+
+    if(input->view.obj != NULL)
     {
-	PyErr_SetString(PyICAP_Exc, "Cannot create the ICAP request");
-      
-	goto py_conn_request_error;
+	PyBuffer_Release(&input->view);
     }
-   
-    int ret = py_conn_fill_server_options(conn->req, timeout);
-    if(ret == CI_ERROR)
+
+    if(input->map != NULL)
     {
-	PyErr_SetString(PyICAP_Exc, "Cannot send the ICAP OPTIONS request");
-      
-	goto py_conn_request_error;	
+	munmap(input->map, input->map_len), input->map = NULL;
     }
 
-    conn->req->type = (strcmp(type, "REQMOD") == 0) ? ICAP_REQMOD : ICAP_RESPMOD;
-    
-    req_headers = py_conn_build_reqmod_http_headers(url);
-    if(req_headers == NULL)
+    input->data = NULL;
+}
+
+// pin the next chunk of a Python stream, the GIL is only taken for that
+static int
+py_conn_next_chunk(py_conn_input_t *input)
+{
+    PyGILState_STATE gstate = PyGILState_Ensure();
+    int ret = 0;
+
+    if(input->view.obj != NULL)
     {
-	PyErr_SetString(PyICAP_Exc, "Cannot create the ICAP HTTP request headers");
-               
-	goto py_conn_request_error;
+	PyBuffer_Release(&input->view);
     }
 
-    if(conn->req->type == ICAP_RESPMOD)
+    input->data = NULL;
+    input->len = 0;
+    input->pos = 0;
+
+    // an iterator can yield empty chunks, an empty read is the end of a file
+    while(input->len == 0 && !input->stream_eof)
     {
-	resp_headers = py_conn_build_respmod_http_headers();
-	if(resp_headers == NULL)
+	PyObject *chunk = NULL;
+
+	if(input->stream_is_file)
 	{
-	    PyErr_SetString(PyICAP_Exc, "Cannot create the ICAP HTTP response headers");
-               
-	    goto py_conn_request_error;
+	    chunk = PyObject_CallFunction(input->stream, "n", (Py_ssize_t)ICAP_STREAM_BLOCK_SIZE);
+	}
+	else
+	{
+	    chunk = PyIter_Next(input->stream);
+	}
+
+	if(chunk == NULL)
+	{
+	    if(PyErr_Occurred())
+	    {
+		ret = -1;
+	    }
+
+	    input->stream_eof = 1;
+
+	    break;
+	}
+
+	int err = PyObject_GetBuffer(chunk, &input->view, PyBUF_SIMPLE);
+	Py_DECREF(chunk);
+
+	if(err != 0)
+	{
+	    ret = -1;
+
+	    break;
+	}
+
+	input->data = input->view.buf;
+	input->len = input->view.len;
+
+	if(input->len == 0)
+	{
+	    PyBuffer_Release(&input->view);
+	    input->stream_eof = input->stream_is_file;
 	}
     }
 
-    if(read_content)
+    // the exception is raised later, maybe from another thread, with its traceback
+    if(ret != 0)
     {
-	// inhibit an "unused" warning
-	(void)PycStringIO;
-	conn->content = PycStringIO_ref->NewOutput(128);
+	Py_CLEAR(input->error_type);
+	Py_CLEAR(input->error);
+	Py_CLEAR(input->error_tb);
+
+	PyErr_Fetch(&input->error_type, &input->error, &input->error_tb);
+	PyErr_NormalizeException(&input->error_type, &input->error, &input->error_tb);
     }
 
-    Py_BEGIN_ALLOW_THREADS
-    ret = ci_client_icapfilter(conn->req, timeout,
-#ifdef OLD_CICAP_VERSION
-			       (conn->req->type == ICAP_REQMOD) ? req_headers : resp_headers,
-#else
-			       req_headers, resp_headers,
-#endif
-			       &input_fd, py_conn_read,
-			       conn->content, py_conn_write);
-    Py_END_ALLOW_THREADS
-    if(ret == CI_ERROR)
+    PyGILState_Release(gstate);
+
+    return ret;
+}
+
+// a non-blocking descriptor has no data yet: wait for it, up to the request timeout
+static int
+py_conn_wait_input(py_conn_input_t const *input)
+{
+    struct pollfd pfd = { .fd = input->fd, .events = POLLIN, .revents = 0 };
+    int ret = 0;
+
+    do
     {
-	PyErr_SetString(PyICAP_Exc, "Cannot send the ICAP request");
-      
-	goto py_conn_request_error;
+	ret = poll(&pfd, 1, input->timeout);
     }
+    while(ret < 0 && errno == EINTR);
 
-    conn->req_status = ret;
+    if(ret == 0)
+    {
+	errno = ETIMEDOUT;
+    }
 
-py_conn_request_error:
+    return (ret > 0) ? 0 : -1;
+}
 
-    if(req_headers != NULL)
+int
+py_conn_read(void *ctx, char *buf, int len)
+{
+    py_conn_input_t *input = ctx;
+
+    input->last_read = py_time_now_ns();
+    if(input->first_read == 0)
     {
-	ci_headers_destroy(req_headers), req_headers = NULL;
+	input->first_read = input->last_read;
     }
 
-    if(resp_headers != NULL)
+    // never read past the preview before the server asks for the rest
+    if(input->sent < input->preview && len > input->preview - input->sent)
     {
-	ci_headers_destroy(resp_headers), resp_headers = NULL;
+	len = input->preview - input->sent;
     }
 
-    if(input_fd > 0)
+    if(input->fd >= 0)
     {
-	close(input_fd), input_fd = -1;
+	int ret = 0;
+
+	for(;;)
+	{
+	    ret = read(input->fd, buf, len);
+	    if(ret >= 0)
+	    {
+		break;
+	    }
+
+	    if(errno == EINTR)
+	    {
+		continue;
+	    }
+
+	    if((errno != EAGAIN && errno != EWOULDBLOCK) || py_conn_wait_input(input) != 0)
+	    {
+		input->read_errno = errno;
+
+		return CI_ERROR;
+	    }
+	}
+
+	if(ret > 0)
+	{
+	    input->sent += ret;
+	}
+
+	return ret;
     }
 
-    if(PyErr_Occurred())
+    if(input->stream != NULL && !input->stream_eof && input->pos == input->len &&
+       py_conn_next_chunk(input) != 0)
     {
-	py_conn_free_req(conn);   
+	return CI_ERROR;
+    }
 
-	return NULL;
+    // the GIL is not needed: the buffer cannot be resized while pinned
+    Py_ssize_t remaining = input->len - input->pos;
+    if(remaining < len)
+    {
+	len = remaining;
     }
-   
-    Py_RETURN_NONE;
+
+    memcpy(buf, input->data + input->pos, len);
+    input->pos += len;
+    input->sent += len;
+
+    return len;
 }
 
-static PyObject *
-py_conn_getresponse(PyICAPConnection *conn)
+// the size of the chunks written to a Python file object
+#define ICAP_SINK_BLOCK_SIZE 65536
+
+int
+py_conn_open_output(py_conn_output_t *output, PyObject *sink, int read_content)
 {
-    if(conn->req == NULL)
+    output->sink_fd = -1;
+
+    if(sink == NULL || sink == Py_None)
+    {
+	output->read_content = read_content;
+	output->buf.max_memory = ICAP_DEFAULT_MAX_MEMORY_CONTENT;
+
+	return 0;
+    }
+
+    if(PyInt_Check(sink) || PyLong_Check(sink))
+    {
+	long fd = PyLong_AsLong(sink);
+	if(fd == -1 && PyErr_Occurred())
+	{
+	    return -1;
+	}
+
+	if(fd < 0 || fd > INT_MAX)
+	{
+	    PyErr_SetString(PyExc_ValueError, "Sink file descriptor must have a positive value");
+
+	    return -1;
+	}
+
+	output->sink_fd = fd;
+    }
+    else if(PY_TEXT_CHECK(sink))
+    {
+	char *path = NULL;
+
+	if(!PyArg_Parse(sink, "s", &path))
+	{
+	    return -1;
+	}
+
+	output->sink_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if(output->sink_fd < 0)
+	{
+	    PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+
+	    return -1;
+	}
+
+	output->close_sink = 1;
+    }
+    else if(PyObject_HasAttrString(sink, "write"))
+    {
+	Py_INCREF(sink);
+	output->sink_obj = sink;
+    }
+    else
+    {
+	PyErr_SetString(PyExc_TypeError, "Sink must be a file descriptor, a path or a writable file object");
+
+	return -1;
+    }
+
+    return 0;
+}
+
+// must be called with the GIL held
+static int
+py_conn_flush_sink(py_conn_output_t *output)
+{
+    if(output->buf.size == 0)
+    {
+	return 0;
+    }
+
+    PyObject *res = PyObject_CallMethod(output->sink_obj, "write", PY_BYTES_FORMAT "#",
+					output->buf.data, (Py_ssize_t)output->buf.size);
+    output->buf.size = 0;
+
+    if(res == NULL)
+    {
+	output->pyerror = 1;
+
+	return -1;
+    }
+
+    Py_DECREF(res);
+
+    return 0;
+}
+
+// the exception is raised later, maybe from another thread, with its traceback
+static void
+py_conn_fetch_sink_error(py_conn_output_t *output)
+{
+    Py_CLEAR(output->error_type);
+    Py_CLEAR(output->error);
+    Py_CLEAR(output->error_tb);
+
+    PyErr_Fetch(&output->error_type, &output->error, &output->error_tb);
+    PyErr_NormalizeException(&output->error_type, &output->error, &output->error_tb);
+}
+
+static void
+py_conn_close_output(py_conn_output_t *output)
+{
+    if(output->close_sink)
+    {
+	close(output->sink_fd), output->sink_fd = -1;
+	output->close_sink = 0;
+    }
+
+    Py_CLEAR(output->sink_obj);
+    Py_CLEAR(output->error_type);
+    Py_CLEAR(output->error);
+    Py_CLEAR(output->error_tb);
+    py_content_reset(&output->buf);
+}
+
+static int
+py_conn_write_fd(py_conn_output_t *output, char const *buf, int len)
+{
+    int written = 0;
+
+    while(written < len)
+    {
+	ssize_t ret = write(output->sink_fd, buf + written, len - written);
+	if(ret < 0)
+	{
+	    if(errno == EINTR)
+	    {
+		continue;
+	    }
+
+	    output->write_errno = errno;
+
+	    return CI_ERROR;
+	}
+
+	written += ret;
+    }
+
+    return len;
+}
+
+// the Content-Length of the encapsulated HTTP message, -1 if unknown
+static long long
+py_conn_content_length(ci_request_t *req)
+{
+    ci_headers_list_t *headers = ci_http_response_headers(req);
+    if(headers == NULL)
+    {
+	headers = ci_http_request_headers(req);
+    }
+
+    char const *value = (headers != NULL) ? ci_headers_value(headers, "Content-Length") : NULL;
+    if(value == NULL)
+    {
+	return -1;
+    }
+
+    char *end = NULL;
+    errno = 0;
+    long long length = strtoll(value, &end, 10);
+
+    return (end != value && errno == 0 && length >= 0) ? length : -1;
+}
+
+int
+py_conn_write(void *ctx, char *buf, int len)
+{
+    py_conn_output_t *output = ctx;
+
+    if(output->first_write == 0)
+    {
+	output->first_write = py_time_now_ns();
+
+	// the headers are parsed: allocate the whole content at once
+	if(output->read_content && output->sink_obj == NULL && output->req != NULL)
+	{
+	    long long length = py_conn_content_length(output->req);
+
+	    if(length > 0 && (size_t)length == (unsigned long long)length &&
+	       py_content_reserve(&output->buf, length) != 0 && errno != ENOMEM)
+	    {
+		output->spill_errno = errno;
+
+		return CI_ERROR;
+	    }
+	}
+    }
+
+    output->received += len;
+
+    // the body is read to keep the socket usable, but nothing is kept
+    if(output->discard)
+    {
+	output->skipped += len;
+
+	return len;
+    }
+
+    // file descriptors are written without any Python call
+    if(output->sink_fd >= 0)
+    {
+	return py_conn_write_fd(output, buf, len);
+    }
+
+    if(output->sink_obj != NULL || output->read_content)
+    {
+	// no need for the GIL, the content is published after the request
+	if(py_content_append(&output->buf, buf, len) != 0)
+	{
+	    if(errno == ENOMEM)
+	    {
+		output->nomem = 1;
+	    }
+	    else
+	    {
+		output->spill_errno = errno;
+	    }
+
+	    return CI_ERROR;
+	}
+    }
+
+    // only reacquire the GIL when a whole block is ready for the Python sink
+    if(output->sink_obj != NULL && output->buf.size >= ICAP_SINK_BLOCK_SIZE)
+    {
+	PyGILState_STATE gstate = PyGILState_Ensure();
+	int ret = py_conn_flush_sink(output);
+	if(ret != 0)
+	{
+	    py_conn_fetch_sink_error(output);
+	}
+	PyGILState_Release(gstate);
+
+	if(ret != 0)
+	{
+	    return CI_ERROR;
+	}
+    }
+
+    return len;
+}
+
+static ci_headers_list_t *
+py_conn_build_respmod_http_headers(void)
+{
+    ci_headers_list_t *resp_headers = ci_headers_create();
+    if(resp_headers == NULL)
+    {
+	return NULL;
+    }
+
+    ci_headers_add(resp_headers, "HTTP/1.1 200 OK");
+    ci_headers_add(resp_headers, "Transfer-Encoding: chunked");
+   
+    return resp_headers;
+}
+
+static ci_headers_list_t *
+py_conn_build_reqmod_http_headers(char const *url)
+{
+    char *line = NULL;
+    int ret = asprintf(&line, "POST %s HTTP/1.1", url);
+    if(ret <= -1 || line == NULL)
+    {
+	return NULL;
+    }
+
+    ci_headers_list_t *req_headers = ci_headers_create();
+    if(req_headers != NULL)
+    {
+	ci_headers_add(req_headers, line);
+	ci_headers_add(req_headers, "Host: localhost");
+	ci_headers_add(req_headers, "Transfer-Encoding: chunked");
+    }
+   
+    free(line), line = NULL;
+   
+    return req_headers;
+}
+
+// the headers of the requests without templates for the default URL
+static pthread_once_t py_conn_default_headers_once = PTHREAD_ONCE_INIT;
+static ci_headers_list_t *py_conn_default_req_headers = NULL;
+static ci_headers_list_t *py_conn_default_resp_headers = NULL;
+
+static void
+py_conn_init_default_headers(void)
+{
+    py_conn_default_req_headers = py_conn_build_reqmod_http_headers("/");
+    py_conn_default_resp_headers = py_conn_build_respmod_http_headers();
+
+    // packed now, like the templates, so that the workers only read them
+    if(py_conn_default_req_headers != NULL)
+    {
+	ci_headers_pack(py_conn_default_req_headers);
+    }
+
+    if(py_conn_default_resp_headers != NULL)
+    {
+	ci_headers_pack(py_conn_default_resp_headers);
+    }
+}
+
+// the server options are still valid: skip the OPTIONS round trip
+// must be called without holding the GIL
+static int
+py_conn_apply_cached_options(py_conn_job_t *job)
+{
+    py_options_t opts;
+
+    if(!py_options_cache_get(job->host, job->port, job->service, &opts))
+    {
+	py_metrics_record_options(0);
+
+	return 0;
+    }
+
+    py_options_apply(&opts, job->req);
+    py_options_free(&opts);
+    py_metrics_record_options(1);
+
+    return 1;
+}
+
+// must be called without holding the GIL
+static void
+py_conn_save_server_options(py_conn_job_t *job)
+{
+    ci_request_t *req = job->req;
+    py_options_t opts;
+
+    // save the retrieved values
+    py_options_fill(&opts, req);
+    // reuse the old OPTIONS request
+    ci_client_request_reuse(req);
+    // copy the saved values
+    py_options_apply(&opts, req);
+    py_options_cache_put(job->host, job->port, job->service, &opts);
+    py_options_free(&opts);
+}
+
+// must be called without holding the GIL
+static int
+py_conn_fill_server_options(py_conn_job_t *job)
+{
+    if(py_conn_apply_cached_options(job))
+    {
+	return CI_OK;
+    }
+
+    int ret = ci_client_get_server_options(job->req, job->timeout);
+    if(ret != CI_ERROR)
+    {
+	py_conn_save_server_options(job);
+    }
+    
+    return ret;
+}
+
+void
+py_conn_job_init(py_conn_job_t *job)
+{
+    memset(job, 0, sizeof(*job));
+
+    job->input.fd = -1;
+    job->output.sink_fd = -1;
+    job->service = ICAP_DEFAULT_SERVICE;
+    job->url = "/";
+    job->type = ICAP_REQMOD;
+    job->timeout = ICAP_DEFAULT_TIMEOUT;
+    job->preview = -1;
+    job->io_buffer_size = ICAP_DEFAULT_IO_BUFFER_SIZE;
+    job->stats.preview = -1;
+}
+
+// the encapsulated HTTP headers of a request
+typedef struct
+{
+    ci_headers_list_t *req;
+    ci_headers_list_t *resp;
+    // the headers built for this request only
+    ci_headers_list_t *built_req;
+    ci_headers_list_t *built_resp;
+} py_conn_http_headers_t;
+
+static void
+py_conn_http_headers_clear(py_conn_http_headers_t *headers)
+{
+    if(headers->built_req != NULL)
+    {
+	ci_headers_destroy(headers->built_req), headers->built_req = NULL;
+    }
+
+    if(headers->built_resp != NULL)
+    {
+	ci_headers_destroy(headers->built_resp), headers->built_resp = NULL;
+    }
+}
+
+// set the request fields once the server options are known, and select its headers
+// must be called without holding the GIL
+static int
+py_conn_job_prepare(py_conn_job_t *job, py_conn_http_headers_t *headers)
+{
+    memset(headers, 0, sizeof(*headers));
+
+    pthread_once(&py_conn_default_headers_once, py_conn_init_default_headers);
+
+    job->req->type = job->type;
+
+    // the preview can only be shortened, the server may not accept more data
+    if(job->preview >= 0 && job->req->preview > job->preview)
+    {
+	job->req->preview = job->preview;
+    }
+
+    job->input.preview = job->req->preview;
+    job->input.timeout = (job->timeout > 0) ? job->timeout * 1000 : -1;
+    job->stats.preview = job->req->preview;
+
+    // let the server answer with the headers only, whatever it advertised
+    if(job->output.discard)
+    {
+	job->req->allow204 = 1;
+#ifndef OLD_CICAP_VERSION
+	job->req->allow206 = 1;
+#endif
+    }
+    
+    if(job->req_headers != NULL)
+    {
+	headers->req = ((PyHTTPHeaders *)job->req_headers)->headers;
+    }
+    else if(strcmp(job->url, "/") == 0 && py_conn_default_req_headers != NULL)
+    {
+	headers->req = py_conn_default_req_headers;
+    }
+    else
+    {
+	headers->req = headers->built_req = py_conn_build_reqmod_http_headers(job->url);
+	if(headers->req == NULL)
+	{
+	    job->error = PY_CONN_ERR_REQ_HEADERS;
+
+	    return -1;
+	}
+    }
+
+    if(job->type == ICAP_RESPMOD)
+    {
+	if(job->resp_headers != NULL)
+	{
+	    headers->resp = ((PyHTTPHeaders *)job->resp_headers)->headers;
+	}
+	else if(py_conn_default_resp_headers != NULL)
+	{
+	    headers->resp = py_conn_default_resp_headers;
+	}
+	else
+	{
+	    headers->resp = headers->built_resp = py_conn_build_respmod_http_headers();
+	    if(headers->resp == NULL)
+	    {
+		job->error = PY_CONN_ERR_RESP_HEADERS;
+
+		return -1;
+	    }
+	}
+    }
+
+    job->output.req = job->req;
+
+    return 0;
+}
+
+// measure the exchange and map its errors, ret is the ICAP status or CI_ERROR
+// must be called without holding the GIL
+static int
+py_conn_job_complete(py_conn_job_t *job, int ret, int send_errno)
+{
+    job->stats.end = py_time_now_ns();
+    // the upload ends with the last read, the download starts with the first write
+    job->stats.uploaded = (job->input.last_read != 0) ? job->input.last_read : job->stats.options;
+    job->stats.first_byte = (job->output.first_write != 0) ? job->output.first_write : job->stats.end;
+    job->stats.body_bytes_sent = job->input.sent;
+    job->stats.body_bytes_received = job->output.received;
+    job->stats.body_bytes_skipped = job->output.skipped;
+    job->stats.bytes_sent = job->req->bytes_out;
+    job->stats.bytes_received = job->req->bytes_in;
+    if(job->output.pyerror || job->input.error != NULL)
+    {
+	job->error = PY_CONN_ERR_PYTHON;
+    }
+    else if(job->output.nomem)
+    {
+	job->error = PY_CONN_ERR_NOMEM;
+    }
+    else if(job->output.spill_errno != 0)
+    {
+	job->error = PY_CONN_ERR_SPILL;
+    }
+    else if(job->input.read_errno != 0)
+    {
+	job->error = PY_CONN_ERR_READ;
+    }
+    else if(job->output.write_errno != 0)
+    {
+	job->error = PY_CONN_ERR_WRITE;
+    }
+    else if(ret == CI_ERROR)
+    {
+	job->error = PY_CONN_ERR_SEND;
+	job->send_errno = send_errno;
+    }
+
+    if(job->error != PY_CONN_OK)
+    {
+	return -1;
+    }
+
+    job->status = ret;
+
+    ci_headers_list_t *icap_headers = job->req->response_header;
+    char const *connection = NULL;
+    if(icap_headers != NULL)
+    {
+	// a new ISTag invalidates the cached server options
+	py_options_cache_check_istag(job->host, job->port, job->service,
+				     ci_headers_value(icap_headers, "ISTag"));
+	connection = ci_headers_value(icap_headers, "Connection");
+    }
+
+    // the socket can be reused if the server did not close the connection
+    job->keepalive = job->req->keepalive &&
+	(connection == NULL || strcasecmp(connection, "close") != 0);
+
+    return 0;
+}
+
+// a single exchange with the server, must be called without holding the GIL
+static int
+py_conn_job_attempt(py_conn_job_t *job, ci_connection_t **conn)
+{
+    py_conn_http_headers_t headers;
+
+    memset(&headers, 0, sizeof(headers));
+
+    job->stats.start = py_time_now_ns();
+
+    // connect to the server if not already connected
+    if(*conn == NULL)
+    {
+	*conn = py_resolver_connect(job->host, job->port, job->proto, job->timeout);
+	if(*conn == NULL)
+	{
+	    job->error = PY_CONN_ERR_CONNECT;
+
+	    goto py_conn_job_run_error;
+	}
+    }
+
+    job->stats.connected = py_time_now_ns();
+
+    job->req = ci_client_request(*conn, job->host, job->service);
+    if(job->req == NULL)
+    {
+	job->error = PY_CONN_ERR_CREATE;
+
+	goto py_conn_job_run_error;
+    }
+   
+    if(py_conn_fill_server_options(job) == CI_ERROR)
+    {
+	job->error = PY_CONN_ERR_OPTIONS;
+
+	goto py_conn_job_run_error;
+    }
+
+    job->stats.options = py_time_now_ns();
+
+    if(py_conn_job_prepare(job, &headers) != 0)
+    {
+	goto py_conn_job_run_error;
+    }
+
+    int ret = 0;
+    errno = 0;
+    if(job->io_buffer_size > 0)
+    {
+	ret = py_native_exchange(job, *conn, headers.req, headers.resp);
+    }
+    else
+    {
+	ret = ci_client_icapfilter(job->req, job->timeout,
+#ifdef OLD_CICAP_VERSION
+				   (job->type == ICAP_REQMOD) ? headers.req : headers.resp,
+#else
+				   headers.req, headers.resp,
+#endif
+				   &job->input, py_conn_read,
+				   &job->output, py_conn_write);
+    }
+
+    py_conn_job_complete(job, ret, errno);
+
+py_conn_job_run_error:
+
+    py_conn_http_headers_clear(&headers);
+
+    return (job->error == PY_CONN_OK) ? 0 : -1;
+}
+
+// an idle keep-alive socket has nothing to read, unless the server closed it
+static int
+py_conn_is_alive(ci_connection_t const *conn)
+{
+    char byte = 0;
+
+    ssize_t ret = recv(conn->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    if(ret < 0)
+    {
+	return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+    }
+
+    // either the end of the stream, or unexpected data left by the last response
+    return 0;
+}
+
+// send the body again from the start, when the source allows it
+static int
+py_conn_rewind_input(py_conn_input_t *input)
+{
+    // the chunks of a stream are already consumed
+    if(input->stream != NULL)
+    {
+	return -1;
+    }
+
+    if(input->fd >= 0 && (input->start < 0 || lseek(input->fd, input->start, SEEK_SET) != input->start))
+    {
+	return -1;
+    }
+
+    input->pos = 0;
+    input->sent = 0;
+    input->preview = -1;
+    input->first_read = 0;
+    input->last_read = 0;
+    input->read_errno = 0;
+
+    return 0;
+}
+
+// the server closed the socket: the end of the stream, or a reset
+static int
+py_conn_is_closed(ci_connection_t const *conn)
+{
+    char byte = 0;
+
+    ssize_t ret = recv(conn->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    return (ret == 0 || (ret < 0 && errno == ECONNRESET));
+}
+
+// the request failed before the server sent anything back, because the server
+// closed the socket: it can be sent again
+// a timeout is not retried, the server may have processed the request
+static int
+py_conn_job_can_retry(py_conn_job_t const *job, ci_connection_t const *conn)
+{
+    if(job->error != PY_CONN_ERR_OPTIONS && job->error != PY_CONN_ERR_SEND)
+    {
+	return 0;
+    }
+
+    if(job->output.received != 0 || (job->req != NULL && job->req->bytes_in != 0))
+    {
+	return 0;
+    }
+
+    if(job->send_errno == EPIPE || job->send_errno == ECONNRESET)
+    {
+	return 1;
+    }
+
+    return (conn != NULL && py_conn_is_closed(conn));
+}
+
+// the server may have closed the socket while it was idle,
+// returns whether the request is sent over a kept-alive socket
+static int
+py_conn_drop_stale(ci_connection_t **conn)
+{
+    if(*conn != NULL && !py_conn_is_alive(*conn))
+    {
+	py_conn_destroy_connection(*conn), *conn = NULL;
+	py_metrics_record_stale();
+    }
+
+    return (*conn != NULL);
+}
+
+// a reused socket can still break under the request: forget it to try once more on a new one
+static int
+py_conn_job_reset(py_conn_job_t *job, ci_connection_t **conn)
+{
+    if(!py_conn_job_can_retry(job, *conn) || py_conn_rewind_input(&job->input) != 0)
+    {
+	return -1;
+    }
+
+    if(job->req != NULL)
+    {
+	job->req->connection = NULL;
+	ci_request_destroy(job->req), job->req = NULL;
+    }
+
+    py_conn_destroy_connection(*conn), *conn = NULL;
+    py_metrics_record_retry();
+
+    job->error = PY_CONN_OK;
+    job->send_errno = 0;
+
+    return 0;
+}
+
+// send the request and read the response, must be called without holding the GIL
+int
+py_conn_job_run(py_conn_job_t *job, ci_connection_t **conn)
+{
+    int reused = py_conn_drop_stale(conn);
+
+    int ret = py_conn_job_attempt(job, conn);
+
+    if(ret != 0 && reused && py_conn_job_reset(job, conn) == 0)
+    {
+	reused = 0;
+	ret = py_conn_job_attempt(job, conn);
+    }
+
+    // only the last attempt is measured, the retries are counted apart
+    py_metrics_record_job(job, reused);
+
+    return ret;
+}
+
+// the first step of a request driven by an event loop, must be called without holding the GIL
+void
+py_conn_job_begin(py_conn_job_t *job, ci_connection_t **conn, py_conn_step_t *step)
+{
+    memset(step, 0, sizeof(*step));
+
+    step->state = PY_CONN_STEP_CONNECT;
+    step->reused = py_conn_drop_stale(conn);
+    job->stats.start = py_time_now_ns();
+}
+
+// start the request itself, once the server options are known
+static int
+py_conn_step_start(py_conn_job_t *job, ci_connection_t **conn, py_conn_step_t *step)
+{
+    py_conn_http_headers_t headers;
+
+    job->stats.options = py_time_now_ns();
+
+    if(py_conn_job_prepare(job, &headers) != 0)
+    {
+	py_conn_http_headers_clear(&headers);
+
+	return -1;
+    }
+
+    // the headers are copied
+    step->native = py_native_begin(job, *conn, headers.req, headers.resp);
+    py_conn_http_headers_clear(&headers);
+
+    if(step->native == NULL)
+    {
+	job->error = PY_CONN_ERR_NOMEM;
+
+	return -1;
+    }
+
+    step->state = PY_CONN_STEP_EXCHANGE;
+
+    return 0;
+}
+
+static int
+py_conn_step_connect(py_conn_job_t *job, ci_connection_t **conn, py_conn_step_t *step)
+{
+    if(*conn == NULL)
+    {
+	if(step->attempt == NULL)
+	{
+	    step->attempt = py_resolver_begin(job->host, job->port, job->proto);
+	    if(step->attempt == NULL)
+	    {
+		job->error = PY_CONN_ERR_CONNECT;
+
+		return -1;
+	    }
+	}
+
+	int ret = py_resolver_step(step->attempt, conn);
+	if(ret > 0)
+	{
+	    return PY_CONN_WANT_WRITE;
+	}
+
+	py_resolver_attempt_free(step->attempt), step->attempt = NULL;
+
+	if(ret < 0)
+	{
+	    job->error = PY_CONN_ERR_CONNECT;
+
+	    return -1;
+	}
+    }
+
+    job->stats.connected = py_time_now_ns();
+
+    job->req = ci_client_request(*conn, job->host, job->service);
+    if(job->req == NULL)
+    {
+	job->error = PY_CONN_ERR_CREATE;
+
+	return -1;
+    }
+
+    if(py_conn_apply_cached_options(job))
+    {
+	return py_conn_step_start(job, conn, step);
+    }
+
+    step->native = py_native_begin_options(job, *conn);
+    if(step->native == NULL)
+    {
+	job->error = PY_CONN_ERR_NOMEM;
+
+	return -1;
+    }
+
+    step->state = PY_CONN_STEP_OPTIONS;
+
+    return 0;
+}
+
+static int
+py_conn_step_options(py_conn_job_t *job, ci_connection_t **conn, py_conn_step_t *step)
+{
+    int want = py_native_step(step->native);
+    if(want > 0)
+    {
+	return want;
+    }
+
+    int ret = py_native_end(step->native);
+    step->native = NULL;
+
+    if(ret != 200)
+    {
+	job->error = PY_CONN_ERR_OPTIONS;
+	job->send_errno = (ret == CI_ERROR) ? errno : 0;
+
+	return -1;
+    }
+
+    py_conn_save_server_options(job);
+
+    return py_conn_step_start(job, conn, step);
+}
+
+static int
+py_conn_step_exchange(py_conn_job_t *job, py_conn_step_t *step)
+{
+    int want = py_native_step(step->native);
+    if(want > 0)
+    {
+	return want;
+    }
+
+    int ret = py_native_end(step->native);
+    step->native = NULL;
+
+    if(py_conn_job_complete(job, ret, errno) != 0)
+    {
+	return -1;
+    }
+
+    step->state = PY_CONN_STEP_OVER;
+
+    return 0;
+}
+
+// advance the request without blocking, must be called without holding the GIL
+int
+py_conn_job_step(py_conn_job_t *job, ci_connection_t **conn, py_conn_step_t *step)
+{
+    while(step->state != PY_CONN_STEP_OVER)
+    {
+	int want = 0;
+
+	switch(step->state)
+	{
+	case PY_CONN_STEP_CONNECT:
+	    want = py_conn_step_connect(job, conn, step);
+	    break;
+	case PY_CONN_STEP_OPTIONS:
+	    want = py_conn_step_options(job, conn, step);
+	    break;
+	case PY_CONN_STEP_EXCHANGE:
+	    want = py_conn_step_exchange(job, step);
+	    break;
+	case PY_CONN_STEP_OVER:
+	    break;
+	}
+
+	if(want > 0)
+	{
+	    return want;
+	}
+
+	if(want < 0)
+	{
+	    if(step->reused && py_conn_job_reset(job, conn) == 0)
+	    {
+		step->state = PY_CONN_STEP_CONNECT;
+		step->reused = 0;
+		job->stats.start = py_time_now_ns();
+
+		continue;
+	    }
+
+	    step->state = PY_CONN_STEP_OVER;
+	}
+
+	if(step->state == PY_CONN_STEP_OVER)
+	{
+	    // only the last attempt is measured, the retries are counted apart
+	    py_metrics_record_job(job, step->reused);
+	}
+    }
+
+    return 0;
+}
+
+// the socket to watch before the next step, -1 once the request is over
+int
+py_conn_job_fileno(ci_connection_t const *conn, py_conn_step_t const *step)
+{
+    if(step->attempt != NULL)
+    {
+	return py_resolver_attempt_fd(step->attempt);
+    }
+
+    return (step->state != PY_CONN_STEP_OVER && conn != NULL) ? conn->fd : -1;
+}
+
+// stop the request before its end, the socket cannot be reused
+void
+py_conn_job_abort(py_conn_job_t *job, ci_connection_t **conn, py_conn_step_t *step)
+{
+    if(step->attempt != NULL)
+    {
+	py_resolver_attempt_free(step->attempt), step->attempt = NULL;
+    }
+
+    if(step->native != NULL)
+    {
+	py_native_end(step->native), step->native = NULL;
+    }
+
+    if(step->state != PY_CONN_STEP_OVER && *conn != NULL)
+    {
+	py_conn_destroy_connection(*conn), *conn = NULL;
+    }
+
+    step->state = PY_CONN_STEP_OVER;
+    job->keepalive = 0;
+}
+
+// must be called with the GIL held
+void
+py_conn_job_set_error(py_conn_job_t const *job)
+{
+    switch(job->error)
+    {
+    case PY_CONN_OK:
+	break;
+    case PY_CONN_ERR_PYTHON:
+	if(job->input.error != NULL)
+	{
+	    // the job keeps its references, the exception can be raised again
+	    Py_XINCREF(job->input.error_type);
+	    Py_XINCREF(job->input.error);
+	    Py_XINCREF(job->input.error_tb);
+	    PyErr_Restore(job->input.error_type, job->input.error, job->input.error_tb);
+	}
+	else if(job->output.error != NULL)
+	{
+	    Py_XINCREF(job->output.error_type);
+	    Py_XINCREF(job->output.error);
+	    Py_XINCREF(job->output.error_tb);
+	    PyErr_Restore(job->output.error_type, job->output.error, job->output.error_tb);
+	}
+	break;
+    case PY_CONN_ERR_CONNECT:
+	PyErr_Format(PyICAP_Exc, "Cannot connect to server '%s:%d'", job->host, job->port);
+	break;
+    case PY_CONN_ERR_CREATE:
+	PyErr_SetString(PyICAP_Exc, "Cannot create the ICAP request");
+	break;
+    case PY_CONN_ERR_OPTIONS:
+	PyErr_SetString(PyICAP_Exc, "Cannot send the ICAP OPTIONS request");
+	break;
+    case PY_CONN_ERR_REQ_HEADERS:
+	PyErr_SetString(PyICAP_Exc, "Cannot create the ICAP HTTP request headers");
+	break;
+    case PY_CONN_ERR_RESP_HEADERS:
+	PyErr_SetString(PyICAP_Exc, "Cannot create the ICAP HTTP response headers");
+	break;
+    case PY_CONN_ERR_SEND:
+	PyErr_SetString(PyICAP_Exc, "Cannot send the ICAP request");
+	break;
+    case PY_CONN_ERR_NOMEM:
+	PyErr_NoMemory();
+	break;
+    case PY_CONN_ERR_SPILL:
+	errno = job->output.spill_errno;
+	PyErr_SetFromErrno(PyExc_IOError);
+	break;
+    case PY_CONN_ERR_READ:
+	errno = job->input.read_errno;
+	PyErr_SetFromErrno(PyExc_IOError);
+	break;
+    case PY_CONN_ERR_WRITE:
+	errno = job->output.write_errno;
+	PyErr_SetFromErrno(PyExc_IOError);
+	break;
+    }
+}
+
+// flush the sink or publish the content, must be called with the GIL held
+int
+py_conn_job_finish(py_conn_job_t *job, PyObject **content)
+{
+    py_conn_output_t *output = &job->output;
+
+    *content = NULL;
+
+    if(output->sink_obj != NULL && py_conn_flush_sink(output) != 0)
+    {
+	return -1;
+    }
+
+    if(output->read_content)
+    {
+	// publish the content only once, as a read-only buffer
+	*content = py_content_publish(&output->buf);
+	if(*content == NULL)
+	{
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+// must be called with the GIL held
+void
+py_conn_job_clear(py_conn_job_t *job)
+{
+    py_conn_close_input(&job->input);
+    py_conn_close_output(&job->output);
+    Py_CLEAR(job->req_headers);
+    Py_CLEAR(job->resp_headers);
+
+    if(job->req != NULL)
+    {
+	// the connection is not owned by the request
+	job->req->connection = NULL;
+	ci_request_destroy(job->req), job->req = NULL;
+    }
+}
+
+// None keeps the default headers
+static int
+py_conn_check_headers(PyObject *headers)
+{
+    if(headers == NULL || headers == Py_None)
+    {
+	return 0;
+    }
+
+    if(!PyObject_TypeCheck(headers, &PyHTTPHeadersType))
+    {
+	PyErr_SetString(PyExc_TypeError, "Request headers must be HTTPHeaders objects");
+
+	return -1;
+    }
+
+    if(((PyHTTPHeaders *)headers)->headers == NULL)
+    {
+	PyErr_SetString(PyExc_ValueError, "Request headers are not initialized");
+
+	return -1;
+    }
+
+    return 0;
+}
+
+// use prebuilt encapsulated HTTP headers
+int
+py_conn_job_set_headers(py_conn_job_t *job, PyObject *req_headers, PyObject *resp_headers)
+{
+    if(py_conn_check_headers(req_headers) != 0 || py_conn_check_headers(resp_headers) != 0)
+    {
+	return -1;
+    }
+
+    if(req_headers != NULL && req_headers != Py_None)
+    {
+	Py_INCREF(req_headers);
+	Py_XSETREF(job->req_headers, req_headers);
+    }
+
+    if(resp_headers != NULL && resp_headers != Py_None)
+    {
+	Py_INCREF(resp_headers);
+	Py_XSETREF(job->resp_headers, resp_headers);
+    }
+
+    return 0;
+}
+
+// the size above which a kept content goes to a temporary file, None for the default
+static int
+py_conn_job_set_max_memory(py_conn_job_t *job, PyObject *max_memory_content)
+{
+    if(max_memory_content == NULL || max_memory_content == Py_None)
+    {
+	return 0;
+    }
+
+    Py_ssize_t value = PyNumber_AsSsize_t(max_memory_content, PyExc_OverflowError);
+    if(value == -1 && PyErr_Occurred())
+    {
+	return -1;
+    }
+
+    if(value < 0)
+    {
+	PyErr_SetString(PyExc_ValueError, "Maximum memory content size must have a positive value (or zero)");
+
+	return -1;
+    }
+
+    // the staging buffer of a Python sink is flushed long before
+    if(job->output.sink_obj == NULL)
+    {
+	job->output.buf.max_memory = value;
+    }
+
+    return 0;
+}
+
+// "keep" (or None) stores the response body, "discard" only keeps the verdict
+int
+py_conn_job_set_body(py_conn_job_t *job, PyObject *body, PyObject *max_memory_content)
+{
+    char const *mode = "keep";
+
+    if(py_args_string(body, "Response body mode", &mode) != 0)
+    {
+	return -1;
+    }
+
+    if(strcmp(mode, "keep") == 0)
+    {
+	return py_conn_job_set_max_memory(job, max_memory_content);
+    }
+
+    if(strcmp(mode, "discard") != 0)
+    {
+	PyErr_SetString(PyExc_ValueError, "Response body mode should be either 'keep' or 'discard'");
+
+	return -1;
+    }
+
+    if(job->output.sink_fd >= 0 || job->output.sink_obj != NULL)
+    {
+	PyErr_SetString(PyExc_ValueError, "A discarded response body cannot be written to a sink");
+
+	return -1;
+    }
+
+    job->output.discard = 1;
+    job->output.read_content = 0;
+
+    return 0;
+}
+
+static int
+py_conn_parse_type(char const *type)
+{
+    if(strcmp(type, "REQMOD") == 0)
+    {
+	return ICAP_REQMOD;
+    }
+
+    if(strcmp(type, "RESPMOD") == 0)
+    {
+	return ICAP_RESPMOD;
+    }
+
+    PyErr_SetString(PyExc_ValueError, "Request type should be either 'REQMOD' or 'RESPMOD'");
+
+    return -1;
+}
+
+// check the request arguments, then open the body source and destination
+int
+py_conn_job_setup(py_conn_job_t *job, char const *type, PyObject *source, PyObject *data,
+		  PyObject *sink, int timeout, int read_content, PyObject *preview)
+{
+    char *filename = NULL;
+
+    // a string is a filename, other objects are scanned from memory or streamed
+    if(source != NULL && source != Py_None)
+    {
+	if(PY_TEXT_CHECK(source))
+	{
+	    if(!PyArg_Parse(source, "s", &filename))
+	    {
+		return -1;
+	    }
+	}
+	else if(data == NULL)
+	{
+	    data = source;
+	}
+	else
+	{
+	    PyErr_SetString(PyExc_TypeError, "Request needs either a filename or some data");
+
+	    return -1;
+	}
+    }
+
+    if((filename == NULL) == (data == NULL))
+    {
+	PyErr_SetString(PyExc_TypeError, "Request needs either a filename or some data");
+
+	return -1;
+    }
+
+    job->type = py_conn_parse_type(type);
+    if(job->type < 0)
+    {
+	return -1;
+    }
+   
+    if(timeout < 0)
+    {
+	PyErr_SetString(PyExc_ValueError, "Request timeout must have a positive value (or zero)");
+ 
+	return -1;
+    }
+
+    job->timeout = timeout;
+
+    // None keeps the preview size of the server
+    if(preview != NULL && preview != Py_None)
+    {
+	long value = PyInt_AsLong(preview);
+	if(value == -1 && PyErr_Occurred())
+	{
+	    return -1;
+	}
+
+	if(value < 0 || value > INT_MAX)
+	{
+	    PyErr_SetString(PyExc_ValueError, "Request preview must have a positive value (or zero)");
+
+	    return -1;
+	}
+
+	job->preview = value;
+    }
+
+    if(py_conn_open_input(&job->input, filename, data) != 0)
+    {
+	return -1;
+    }
+
+    return py_conn_open_output(&job->output, sink, read_content);
+}
+
+enum
+{
+    PY_CONN_ARG_TYPE,
+    PY_CONN_ARG_FILENAME,
+    PY_CONN_ARG_URL,
+    PY_CONN_ARG_SERVICE,
+    PY_CONN_ARG_TIMEOUT,
+    PY_CONN_ARG_READ_CONTENT,
+    PY_CONN_ARG_DATA,
+    PY_CONN_ARG_SINK,
+    PY_CONN_ARG_PREVIEW,
+    PY_CONN_ARG_REQ_HEADERS,
+    PY_CONN_ARG_RESP_HEADERS,
+    PY_CONN_ARG_IO_BUFFER_SIZE,
+    PY_CONN_ARG_BODY,
+    PY_CONN_ARG_MAX_MEMORY_CONTENT,
+    PY_CONN_ARG_COUNT
+};
+
+static char const *const py_conn_request_kwlist[] = { "type", "filename", "url", "service", "timeout",
+						       "read_content", "data", "sink", "preview", "req_headers",
+						       "resp_headers", "io_buffer_size", "body", "max_memory_content",
+						       NULL };
+
+// the arguments are converted by hand, without building a tuple and a dict for each request
+// the service and the URL are borrowed from the arguments
+static int
+py_conn_parse_request(PyICAPConnection *conn, py_conn_job_t *job, char const *fname, PY_FAST_ARGS)
+{
+    PyObject *values[PY_CONN_ARG_COUNT];
+    char const *type = NULL;
+    char const *service = ICAP_DEFAULT_SERVICE;
+    char const *url = "/";
+    int timeout = ICAP_DEFAULT_TIMEOUT;
+    int read_content = 1;
+    int io_buffer_size = ICAP_DEFAULT_IO_BUFFER_SIZE;
+
+    if(py_args_parse(fname, py_conn_request_kwlist, 1, values) != 0
+       || py_args_string(values[PY_CONN_ARG_TYPE], "type", &type) != 0
+       || py_args_string(values[PY_CONN_ARG_URL], "url", &url) != 0
+       || py_args_string(values[PY_CONN_ARG_SERVICE], "service", &service) != 0
+       || py_args_int(values[PY_CONN_ARG_TIMEOUT], "timeout", &timeout) != 0
+       || py_args_int(values[PY_CONN_ARG_READ_CONTENT], "read_content", &read_content) != 0
+       || py_args_int(values[PY_CONN_ARG_IO_BUFFER_SIZE], "io_buffer_size", &io_buffer_size) != 0)
+    {
+	return -1;
+    }
+
+    if(type == NULL)
+    {
+	PyErr_SetString(PyExc_TypeError, "Request type should be either 'REQMOD' or 'RESPMOD'");
+
+	return -1;
+    }
+
+    PyObject *source = values[PY_CONN_ARG_FILENAME];
+    PyObject *data = values[PY_CONN_ARG_DATA];
+    PyObject *sink = values[PY_CONN_ARG_SINK];
+    PyObject *preview = values[PY_CONN_ARG_PREVIEW];
+    PyObject *req_headers = values[PY_CONN_ARG_REQ_HEADERS];
+    PyObject *resp_headers = values[PY_CONN_ARG_RESP_HEADERS];
+
+    if(io_buffer_size < 0 || io_buffer_size > ICAP_MAX_IO_BUFFER_SIZE)
+    {
+	PyErr_SetString(PyExc_ValueError, "I/O buffer size must be 0-16777216");
+
+	return -1;
+    }
+
+    job->io_buffer_size = io_buffer_size;
+
+    job->host = conn->host;
+    job->port = conn->port;
+    job->proto = conn->proto;
+    job->service = service;
+    job->url = url;
+
+    if(py_conn_job_setup(job, type, source, data, sink, timeout, read_content, preview) != 0 ||
+       py_conn_job_set_headers(job, req_headers, resp_headers) != 0 ||
+       py_conn_job_set_body(job, values[PY_CONN_ARG_BODY], values[PY_CONN_ARG_MAX_MEMORY_CONTENT]) != 0)
+    {
+	return -1;
+    }
+
+    return 0;
+}
+
+static PyObject *
+py_conn_request(PyICAPConnection *conn, PY_FAST_ARGS)
+{
+    py_conn_job_t job;
+    unsigned char digest[SHA256_DIGEST_SIZE];
+    int cacheable = 0;
+    int ret = 0;
+
+    // do not touch the request of another thread
+    if(py_conn_check_busy(conn) != 0)
+    {
+	return NULL;
+    }
+
+    // the setup below may run Python code and release the GIL
+    conn->busy = 1;
+
+    py_conn_job_init(&job);
+
+    if(py_conn_parse_request(conn, &job, "request", PY_FAST_PASS) != 0)
+    {
+	goto py_conn_request_error;
+    }
+
+    py_conn_free_req(conn);
+
+    // a streamed response cannot be replayed from the cache
+    if(py_verdict_cache_enabled() && job.output.sink_fd < 0 && job.output.sink_obj == NULL)
+    {
+	Py_ssize_t max_size = py_verdict_cache_max_size();
+
+	Py_BEGIN_ALLOW_THREADS
+	cacheable = (py_verdict_digest(&job.input, max_size, digest) == 0);
+	Py_END_ALLOW_THREADS
+
+	if(cacheable)
+	{
+	    // the same content was already scanned by the same service
+	    conn->response = py_verdict_cache_get(&job, digest);
+	    if(conn->response != NULL)
+	    {
+		goto py_conn_request_error;
+	    }
+	}
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = py_conn_job_run(&job, &conn->conn);
+    Py_END_ALLOW_THREADS
+
+    // keep the request for the response object
+    conn->req = job.req;
+    job.req = NULL;
+
+    if(ret != 0)
+    {
+	py_conn_job_set_error(&job);
+
+	goto py_conn_request_error;
+    }
+
+    conn->req_status = job.status;
+    conn->stats = job.stats;
+    conn->keepalive = job.keepalive;
+
+    if(py_conn_job_finish(&job, &conn->content) != 0)
+    {
+	goto py_conn_request_error;
+    }
+
+    if(cacheable)
+    {
+	conn->response = py_resp_new(conn->req, conn->req_status, &conn->stats, conn->content);
+	if(conn->response == NULL)
+	{
+	    goto py_conn_request_error;
+	}
+
+	char const *istag = NULL;
+	if(conn->req->response_header != NULL)
+	{
+	    istag = ci_headers_value(conn->req->response_header, "ISTag");
+	}
+
+	py_verdict_cache_put(&job, digest, istag, conn->response);
+    }
+
+py_conn_request_error:
+
+    py_conn_job_clear(&job);
+    conn->busy = 0;
+
+    if(PyErr_Occurred())
+    {
+	// the socket state is unknown
+	conn->keepalive = 0;
+	py_conn_free_req(conn);   
+
+	return NULL;
+    }
+   
+    Py_RETURN_NONE;
+}
+
+// the same arguments as request(), the returned exchange is advanced by an event loop
+static PyObject *
+py_conn_start(PyICAPConnection *conn, PY_FAST_ARGS)
+{
+    if(py_conn_check_busy(conn) != 0)
+    {
+	return NULL;
+    }
+
+    PyICAPExchange *ex = py_exchange_alloc();
+    if(ex == NULL)
+    {
+	return NULL;
+    }
+
+    // the setup below may run Python code and release the GIL
+    conn->busy = 1;
+
+    if(py_conn_parse_request(conn, &ex->job, "start", PY_FAST_PASS) != 0)
+    {
+	conn->busy = 0;
+	Py_DECREF(ex);
+
+	return NULL;
+    }
+
+    py_conn_free_req(conn);
+
+    // the exchange keeps the connection busy until its end
+    if(py_exchange_begin(ex, conn) != 0)
+    {
+	conn->busy = 0;
+	Py_DECREF(ex);
+
+	return NULL;
+    }
+
+    return (PyObject *)ex;
+}
+
+// None means no timeout, stored as a negative value
+int
+py_conn_parse_timeout(PyObject *obj, double *timeout)
+{
+    *timeout = -1;
+
+    if(obj == NULL || obj == Py_None)
+    {
+	return 0;
+    }
+
+    *timeout = PyFloat_AsDouble(obj);
+    if(*timeout == -1 && PyErr_Occurred())
+    {
+	return -1;
+    }
+
+    if(*timeout < 0)
+    {
+	PyErr_SetString(PyExc_ValueError, "Timeout must have a positive value (or zero)");
+
+	return -1;
+    }
+
+    return 0;
+}
+
+// turn the current Python exception into an object
+PyObject *
+py_conn_fetch_error(void)
+{
+    PyObject *exc_type = NULL;
+    PyObject *exc_value = NULL;
+    PyObject *exc_tb = NULL;
+
+    PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+    PyErr_NormalizeException(&exc_type, &exc_value, &exc_tb);
+    Py_XDECREF(exc_type);
+    Py_XDECREF(exc_tb);
+
+    return exc_value;
+}
+
+static PyObject *
+py_conn_scan_many(PyICAPConnection *conn, PyObject *args, PyObject *kwds)
+{
+    PyObject *items = NULL;
+    char *type = "REQMOD";
+    char *service = ICAP_DEFAULT_SERVICE;
+    char *url = "/";
+    int timeout = ICAP_DEFAULT_TIMEOUT;
+    int read_content = 1;
+    PyObject *preview = NULL;
+    PyObject *req_headers = NULL;
+    PyObject *resp_headers = NULL;
+    PyObject *body = NULL;
+    PyObject *max_memory_content = NULL;
+    PyObject *seq = NULL;
+    PyObject *results = NULL;
+    py_conn_job_t *jobs = NULL;
+    Py_ssize_t len = 0;
+
+    static char *kwlist[] = { "items", "type", "url", "service", "timeout", "read_content", "preview",
+			      "req_headers", "resp_headers", "body", "max_memory_content", NULL };
+
+    if(py_conn_check_busy(conn) != 0)
+    {
+	return NULL;
+    }
+
+    // the items are opened with the GIL, which may be released meanwhile
+    conn->busy = 1;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "O|sssiiOOOOO:scan_many", kwlist,
+				    &items, &type, &url, &service, &timeout, &read_content, &preview,
+				    &req_headers, &resp_headers, &body, &max_memory_content))
+    {
+	goto py_conn_scan_many_error;
+    }
+
+    // the arguments shared by all the items must be valid
+    if(py_conn_parse_type(type) < 0 ||
+       py_conn_check_headers(req_headers) != 0 || py_conn_check_headers(resp_headers) != 0)
+    {
+	goto py_conn_scan_many_error;
+    }
+
+    if(timeout < 0)
+    {
+	PyErr_SetString(PyExc_ValueError, "Request timeout must have a positive value (or zero)");
+
+	goto py_conn_scan_many_error;
+    }
+
+    seq = PySequence_Fast(items, "Items must be iterable");
+    if(seq == NULL)
+    {
+	goto py_conn_scan_many_error;
+    }
+
+    len = PySequence_Fast_GET_SIZE(seq);
+    jobs = PyMem_New(py_conn_job_t, len);
+    if(jobs == NULL && len > 0)
+    {
+	PyErr_NoMemory();
+
+	goto py_conn_scan_many_error;
+    }
+
+    for(Py_ssize_t idx = 0; idx < len; idx++)
+    {
+	py_conn_job_init(&jobs[idx]);
+    }
+
+    results = PyList_New(len);
+    if(results == NULL)
+    {
+	goto py_conn_scan_many_error;
+    }
+
+    // open all the inputs first, an item that cannot be opened gets its error
+    for(Py_ssize_t idx = 0; idx < len; idx++)
+    {
+	py_conn_job_t *job = &jobs[idx];
+	PyObject *item = PySequence_Fast_GET_ITEM(seq, idx);
+
+	job->host = conn->host;
+	job->port = conn->port;
+	job->proto = conn->proto;
+	job->service = service;
+	job->url = url;
+
+	if(py_conn_job_setup(job, type, item, NULL, NULL, timeout, read_content, preview) != 0 ||
+	   py_conn_job_set_headers(job, req_headers, resp_headers) != 0 ||
+	   py_conn_job_set_body(job, body, max_memory_content) != 0)
+	{
+	    job->error = PY_CONN_ERR_PYTHON;
+	    PyList_SET_ITEM(results, idx, py_conn_fetch_error());
+	}
+    }
+
+    py_conn_free_req(conn);
+
+    // run the whole batch without the GIL, over the same socket
+    Py_BEGIN_ALLOW_THREADS
+    for(Py_ssize_t idx = 0; idx < len; idx++)
+    {
+	py_conn_job_t *job = &jobs[idx];
+
+	if(job->error != PY_CONN_OK)
+	{
+	    continue;
+	}
+
+	py_conn_job_run(job, &conn->conn);
+
+	// do not send the next item on a closed or broken socket
+	if(!job->keepalive && conn->conn != NULL)
+	{
+	    py_conn_destroy_connection(conn->conn), conn->conn = NULL;
+	}
+    }
+    Py_END_ALLOW_THREADS
+
+    conn->keepalive = (conn->conn != NULL);
+
+    for(Py_ssize_t idx = 0; idx < len; idx++)
+    {
+	py_conn_job_t *job = &jobs[idx];
+	PyObject *result = NULL;
+	PyObject *content = NULL;
+
+	if(PyList_GET_ITEM(results, idx) != NULL)
+	{
+	    continue;
+	}
+
+	if(job->error == PY_CONN_OK && py_conn_job_finish(job, &content) == 0)
+	{
+	    result = py_resp_new(job->req, job->status, &job->stats, content);
+	    Py_XDECREF(content);
+	}
+	else
+	{
+	    py_conn_job_set_error(job);
+	}
+
+	if(result == NULL)
+	{
+	    if(!PyErr_Occurred())
+	    {
+		PyErr_SetString(PyICAP_Exc, "Cannot create the ICAP response object");
+	    }
+
+	    result = py_conn_fetch_error();
+	}
+
+	PyList_SET_ITEM(results, idx, result);
+    }
+
+py_conn_scan_many_error:
+
+    conn->busy = 0;
+
+    if(jobs != NULL)
+    {
+	for(Py_ssize_t idx = 0; idx < len; idx++)
+	{
+	    py_conn_job_clear(&jobs[idx]);
+	}
+
+	PyMem_Free(jobs);
+    }
+
+    Py_XDECREF(seq);
+
+    if(PyErr_Occurred())
+    {
+	Py_XDECREF(results);
+
+	return NULL;
+    }
+
+    return results;
+}
+
+static PyObject *
+py_conn_getresponse(PyICAPConnection *conn)
+{
+    if(py_conn_check_busy(conn) != 0)
+    {
+	return NULL;
+    }
+
+    if(conn->response != NULL)
+    {
+	Py_INCREF(conn->response);
+
+	return conn->response;
+    }
+
+    if(conn->req == NULL)
     {
 	PyErr_SetString(PyICAP_Exc, "No ICAP request was sent before");
       
 	return NULL;
     }
 
-    PyObject *resp = py_resp_new(conn);
+    PyObject *resp = py_resp_new(conn->req, conn->req_status, &conn->stats, conn->content);
     if(resp == NULL)
     {
 	if(!PyErr_Occurred())
@@ -438,12 +2456,38 @@ py_conn_getresponse(PyICAPConnection *conn)
     return resp;
 }
 
+// the server address used by the connection, None when not connected
+static PyObject *
+py_conn_get_address(PyICAPConnection *conn, GCC_UNUSED void *closure)
+{
+    char host[NI_MAXHOST];
+    int port = 0;
+
+    if(conn->conn == NULL || py_resolver_peer(conn->conn, host, sizeof(host), &port) != 0)
+    {
+	Py_RETURN_NONE;
+    }
+
+    return Py_BuildValue("(si)", host, port);
+}
+
+static PyGetSetDef py_conn_getset[] =
+{
+    { "address", (getter)py_conn_get_address, NULL,
+      "the (address, port) of the ICAP server, or None when not connected", NULL },
+    { .name = NULL }
+};
+
 static struct PyMethodDef py_conn_methods[] =
 {
     { "connect", (PyCFunction)py_conn_connect,
       METH_NOARGS, "connect to the ICAP server" },
-    { "request", (PyCFunction)py_conn_request,
-      METH_VARARGS | METH_KEYWORDS, "send an ICAP request" },
+    { "request", (PyCFunction)(void (*)(void))py_conn_request,
+      PY_METH_FAST, "send an ICAP request" },
+    { "start", (PyCFunction)(void (*)(void))py_conn_start,
+      PY_METH_FAST, "start an ICAP request advanced without blocking, by an event loop" },
+    { "scan_many", (PyCFunction)py_conn_scan_many,
+      METH_VARARGS | METH_KEYWORDS, "send ICAP requests for many items over the same connection" },
     { "getresponse", (PyCFunction)py_conn_getresponse,
       METH_NOARGS, "get the ICAP server response" },
     { "close", (PyCFunction)py_conn_close,
@@ -461,6 +2505,7 @@ PyTypeObject PyICAPConnectionType =
     .tp_flags = Py_TPFLAGS_DEFAULT,
     .tp_doc = "ICAP connection",
     .tp_methods = py_conn_methods,
+    .tp_getset = py_conn_getset,
     .tp_new = py_conn_new,
     .tp_init = py_conn_init,
     .tp_alloc = PyType_GenericAlloc,
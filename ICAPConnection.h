@@ -17,9 +17,170 @@
 #ifndef PY_ICAP_CONNECTION_H
 #define PY_ICAP_CONNECTION_H
 
-#include <Python.h>
+#include "py_compat.h"
+
+#include <stdint.h>
+#include <sys/types.h>
 
 #include "cicap_compat.h"
+#include "ICAPContent.h"
+
+// the request body source: a file, an in-memory buffer or a Python stream
+typedef struct
+{
+    int fd;
+    // the descriptor was given by the caller, it is not closed
+    int borrowed_fd;
+    // where the body starts in the file, to send it again
+    off_t start;
+    // the read method of a file object, or an iterator of chunks
+    PyObject *stream;
+    int stream_is_file;
+    int stream_eof;
+    // the exception raised by the stream, fetched with the GIL held
+    PyObject *error_type;
+    PyObject *error;
+    PyObject *error_tb;
+    // how long to wait for a non-blocking descriptor, in milliseconds, -1 to wait forever
+    int timeout;
+    // the descriptor could not be read
+    int read_errno;
+    // the buffer stays pinned until the end of the request (or the next stream chunk)
+    Py_buffer view;
+    // a big file is mapped in memory
+    void *map;
+    size_t map_len;
+    // the in-memory body, from the buffer or the mapping
+    char const *data;
+    Py_ssize_t len;
+    Py_ssize_t pos;
+    // the body bytes given to the library
+    Py_ssize_t sent;
+    // the preview size, -1 without preview
+    Py_ssize_t preview;
+    // the first and last reads, in monotonic nanoseconds
+    int64_t first_read;
+    int64_t last_read;
+} py_conn_input_t;
+
+// the response body destination
+typedef struct
+{
+    int read_content;
+    // the content, or the staging buffer of a Python sink
+    py_content_buf_t buf;
+    int sink_fd;
+    int close_sink;
+    PyObject *sink_obj;
+    int nomem;
+    int pyerror;
+    // the exception raised by the sink, fetched with the GIL held
+    PyObject *error_type;
+    PyObject *error;
+    PyObject *error_tb;
+    // the content could not be moved to or written in its temporary file
+    int spill_errno;
+    // the sink descriptor could not be written
+    int write_errno;
+    // the request being answered, to size the content from its headers
+    ci_request_t *req;
+    // only the verdict is wanted, the body is drained without being stored
+    int discard;
+    Py_ssize_t skipped;
+    // the response body bytes, and the arrival of the first one
+    Py_ssize_t received;
+    int64_t first_write;
+} py_conn_output_t;
+
+typedef enum
+{
+    PY_CONN_OK = 0,
+    PY_CONN_ERR_CONNECT,
+    PY_CONN_ERR_CREATE,
+    PY_CONN_ERR_OPTIONS,
+    PY_CONN_ERR_REQ_HEADERS,
+    PY_CONN_ERR_RESP_HEADERS,
+    PY_CONN_ERR_SEND,
+    PY_CONN_ERR_NOMEM,
+    PY_CONN_ERR_SPILL,
+    PY_CONN_ERR_READ,
+    PY_CONN_ERR_WRITE,
+    // a Python exception is already set
+    PY_CONN_ERR_PYTHON
+} py_conn_error_t;
+
+// what was actually exchanged with the server
+typedef struct
+{
+    Py_ssize_t body_bytes_sent;
+    Py_ssize_t body_bytes_received;
+    Py_ssize_t body_bytes_skipped;
+    // the ICAP bytes, headers included
+    int64_t bytes_sent;
+    int64_t bytes_received;
+    // the negotiated preview size, -1 without preview
+    int preview;
+    // the end of each phase, in monotonic nanoseconds
+    int64_t start;
+    int64_t connected;
+    int64_t options;
+    int64_t uploaded;
+    int64_t first_byte;
+    int64_t end;
+} py_conn_stats_t;
+
+// an ICAP request, that can be sent without holding the GIL
+typedef struct
+{
+    char const *host;
+    int port;
+    int proto;
+    char const *service;
+    char const *url;
+    int type;
+    int timeout;
+    // the requested preview size, -1 to use the server one
+    int preview;
+    // the size of the body chunks sent by the native writer, 0 to let the library send them
+    int io_buffer_size;
+    // HTTPHeaders templates, NULL for the default headers
+    PyObject *req_headers;
+    PyObject *resp_headers;
+    py_conn_input_t input;
+    py_conn_output_t output;
+    // the results
+    ci_request_t *req;
+    int status;
+    int keepalive;
+    py_conn_stats_t stats;
+    py_conn_error_t error;
+    // the errno of a failed exchange, 0 if unknown
+    int send_errno;
+} py_conn_job_t;
+
+// what a non-blocking request waits for before its next step
+#define PY_CONN_WANT_READ 1
+#define PY_CONN_WANT_WRITE 2
+
+typedef enum
+{
+    PY_CONN_STEP_CONNECT = 0,
+    PY_CONN_STEP_OPTIONS,
+    PY_CONN_STEP_EXCHANGE,
+    PY_CONN_STEP_OVER
+} py_conn_step_state_t;
+
+// a request advanced one non-blocking step at a time, by an event loop
+typedef struct
+{
+    py_conn_step_state_t state;
+    // the connection being established
+    struct py_resolver_attempt *attempt;
+    // the OPTIONS request, then the request itself
+    struct py_native_exchange *native;
+    // the request was sent over a keep-alive socket
+    int reused;
+} py_conn_step_t;
 
 typedef struct
 {
@@ -30,9 +191,46 @@ typedef struct
     ci_connection_t *conn;
     ci_request_t *req;
     int req_status;
+    py_conn_stats_t stats;
     PyObject *content;
+    // the response, when it was built by the request
+    PyObject *response;
+    // the server allows reusing the socket
+    int keepalive;
+    // a request is running without the GIL
+    int busy;
+    // the pool owning the socket, if any
+    PyObject *pool;
 } PyICAPConnection;
 
 PyTypeObject PyICAPConnectionType;
 
+void py_conn_destroy_connection(ci_connection_t *conn);
+PyObject *py_conn_release(PyICAPConnection *conn);
+
+int py_conn_parse_timeout(PyObject *obj, double *timeout);
+PyObject *py_conn_fetch_error(void);
+
+// must be called with the GIL held
+void py_conn_set_map_min_size(Py_ssize_t min_size);
+int py_conn_open_input(py_conn_input_t *input, char const *filename, PyObject *data);
+int py_conn_open_output(py_conn_output_t *output, PyObject *sink, int read_content);
+int py_conn_read(void *ctx, char *buf, int len);
+int py_conn_write(void *ctx, char *buf, int len);
+
+void py_conn_job_init(py_conn_job_t *job);
+int py_conn_job_setup(py_conn_job_t *job, char const *type, PyObject *source, PyObject *data,
+		      PyObject *sink, int timeout, int read_content, PyObject *preview);
+int py_conn_job_set_headers(py_conn_job_t *job, PyObject *req_headers, PyObject *resp_headers);
+int py_conn_job_set_body(py_conn_job_t *job, PyObject *body, PyObject *max_memory_content);
+int py_conn_job_run(py_conn_job_t *job, ci_connection_t **conn);
+// the non-blocking version: a step returns the PY_CONN_WANT_* flags to wait for, or 0 once the request is over
+void py_conn_job_begin(py_conn_job_t *job, ci_connection_t **conn, py_conn_step_t *step);
+int py_conn_job_step(py_conn_job_t *job, ci_connection_t **conn, py_conn_step_t *step);
+int py_conn_job_fileno(ci_connection_t const *conn, py_conn_step_t const *step);
+void py_conn_job_abort(py_conn_job_t *job, ci_connection_t **conn, py_conn_step_t *step);
+void py_conn_job_set_error(py_conn_job_t const *job);
+int py_conn_job_finish(py_conn_job_t *job, PyObject **content);
+void py_conn_job_clear(py_conn_job_t *job);
+
 #endif // PY_ICAP_CONNECTION_H
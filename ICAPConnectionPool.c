@@ -0,0 +1,441 @@
+/* -*- Mode: C; c-basic-offset: 4 -*- */
+/*
+ * Copyright 2015 Vincent Rasneur <vrasneur@free.fr>
+ * All Rights Reserved.
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation, version 3.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ *   NON INFRINGEMENT.  See the GNU General Public License for
+ *   more details.
+ */
+
+#include "ICAPConnectionPool.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gcc_attributes.h"
+#include "ICAPConnection.h"
+#include "timeutil.h"
+
+// default values
+#define ICAP_DEFAULT_PORT 1344
+#define ICAP_POOL_DEFAULT_SIZE 8
+// in seconds
+#define ICAP_POOL_DEFAULT_IDLE_TIMEOUT 60
+
+// default exception
+extern PyObject *PyICAP_Exc;
+
+static void
+py_pool_close_list(py_pool_conn_t *entry)
+{
+    while(entry != NULL)
+    {
+	py_pool_conn_t *next = entry->next;
+
+	py_conn_destroy_connection(entry->conn);
+	free(entry);
+	entry = next;
+    }
+}
+
+// must be called with the pool lock held
+static py_pool_conn_t *
+py_pool_evict(py_pool_t *pool, time_t now)
+{
+    py_pool_conn_t **pentry = &pool->idle;
+
+    // the idle list is sorted by last use: the older connections are at the end
+    while(*pentry != NULL && now - (*pentry)->last_used < pool->idle_timeout)
+    {
+	pentry = &(*pentry)->next;
+    }
+
+    py_pool_conn_t *expired = *pentry;
+    *pentry = NULL;
+
+    for(py_pool_conn_t *entry = expired; entry != NULL; entry = entry->next)
+    {
+	pool->nidle--;
+    }
+
+    return expired;
+}
+
+static void *
+py_pool_reaper(void *arg)
+{
+    py_pool_t *pool = arg;
+    // check the idle connections twice per timeout period
+    double interval = (pool->idle_timeout > 1) ? pool->idle_timeout / 2.0 : 1.0;
+
+    pthread_mutex_lock(&pool->lock);
+
+    while(!pool->closing)
+    {
+	struct timespec deadline;
+
+	py_time_deadline(&deadline, interval);
+	pthread_cond_timedwait(&pool->reaper_cond, &pool->lock, &deadline);
+
+	py_pool_conn_t *expired = py_pool_evict(pool, py_time_now());
+	if(expired != NULL)
+	{
+	    // do not hold the lock while closing the sockets
+	    pthread_mutex_unlock(&pool->lock);
+	    py_pool_close_list(expired);
+	    pthread_mutex_lock(&pool->lock);
+	}
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+py_pool_t *
+py_pool_create(char const *host, int port, int proto, int max_size, int idle_timeout)
+{
+    py_pool_t *pool = calloc(1, sizeof(*pool));
+    if(pool == NULL)
+    {
+	return NULL;
+    }
+
+    pool->host = strdup(host);
+    if(pool->host == NULL)
+    {
+	free(pool);
+
+	return NULL;
+    }
+
+    pool->port = port;
+    pool->proto = proto;
+    pool->max_size = max_size;
+    pool->idle_timeout = idle_timeout;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    py_time_cond_init(&pool->cond);
+    py_time_cond_init(&pool->reaper_cond);
+
+    if(pthread_create(&pool->reaper, NULL, py_pool_reaper, pool) != 0)
+    {
+	pthread_cond_destroy(&pool->reaper_cond);
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->host);
+	free(pool);
+
+	return NULL;
+    }
+
+    return pool;
+}
+
+void
+py_pool_destroy(py_pool_t *pool)
+{
+    if(pool == NULL)
+    {
+	return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->closing = 1;
+    pthread_cond_broadcast(&pool->reaper_cond);
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    pthread_join(pool->reaper, NULL);
+
+    py_pool_close_list(pool->idle), pool->idle = NULL;
+
+    pthread_cond_destroy(&pool->reaper_cond);
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->host);
+    free(pool);
+}
+
+// get an idle connection, or reserve a slot for a new one if *conn is NULL
+// timeout is in seconds, a negative timeout waits forever
+int
+py_pool_acquire(py_pool_t *pool, double timeout, ci_connection_t **conn)
+{
+    struct timespec deadline;
+    int ret = 0;
+
+    *conn = NULL;
+
+    if(timeout >= 0)
+    {
+	py_time_deadline(&deadline, timeout);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+
+    while(!pool->closing && pool->idle == NULL && pool->nused >= pool->max_size)
+    {
+	if(timeout < 0)
+	{
+	    pthread_cond_wait(&pool->cond, &pool->lock);
+	}
+	else if(pthread_cond_timedwait(&pool->cond, &pool->lock, &deadline) == ETIMEDOUT)
+	{
+	    break;
+	}
+    }
+
+    if(pool->closing)
+    {
+	ret = -1;
+    }
+    else if(pool->idle != NULL)
+    {
+	py_pool_conn_t *entry = pool->idle;
+
+	pool->idle = entry->next;
+	pool->nidle--;
+	pool->nused++;
+	*conn = entry->conn;
+	free(entry);
+    }
+    else if(pool->nused + pool->nidle < pool->max_size)
+    {
+	pool->nused++;
+    }
+    else
+    {
+	ret = -1;
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return ret;
+}
+
+// give back a slot, and keep the connection if the server allows it
+void
+py_pool_release(py_pool_t *pool, ci_connection_t *conn, int keepalive)
+{
+    py_pool_conn_t *entry = NULL;
+
+    if(conn != NULL && keepalive)
+    {
+	entry = malloc(sizeof(*entry));
+    }
+
+    pthread_mutex_lock(&pool->lock);
+
+    pool->nused--;
+
+    if(entry != NULL && !pool->closing)
+    {
+	entry->conn = conn;
+	entry->last_used = py_time_now();
+	entry->next = pool->idle;
+	pool->idle = entry;
+	pool->nidle++;
+
+	conn = NULL;
+	entry = NULL;
+    }
+
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    free(entry);
+    if(conn != NULL)
+    {
+	py_conn_destroy_connection(conn);
+    }
+}
+
+static PyObject *
+py_pool_new(PyTypeObject *type, GCC_UNUSED PyObject *args, GCC_UNUSED PyObject *kwds)
+{
+    PyObject *self = type->tp_alloc(type, 0);
+    PyICAPConnectionPool *pool = (PyICAPConnectionPool *)self;
+
+    // should already be set to 0 by the alloc call
+    pool->pool = NULL;
+
+    return self;
+}
+
+static int
+py_pool_init(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    PyICAPConnectionPool *pool = (PyICAPConnectionPool *)self;
+    char *host = NULL;
+    int port = ICAP_DEFAULT_PORT;
+    int max_size = ICAP_POOL_DEFAULT_SIZE;
+    int idle_timeout = ICAP_POOL_DEFAULT_IDLE_TIMEOUT;
+    int proto = AF_UNSPEC;
+
+    static char *kwlist[] = { "host", "port", "max_size", "idle_timeout", "proto", NULL };
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "s|iiii", kwlist,
+				    &host, &port, &max_size, &idle_timeout, &proto))
+    {
+	return -1;
+    }
+
+    if(port < 0 || port > 0xffff)
+    {
+	PyErr_SetString(PyExc_OverflowError, "Port must be 0-65535");
+
+	return -1;
+    }
+
+    if(proto != AF_UNSPEC && proto != AF_INET && proto != AF_INET6)
+    {
+	PyErr_SetString(PyExc_ValueError, "Proto must either be AF_UNSPEC, AF_INET or AF_INET6");
+
+	return -1;
+    }
+
+    if(max_size <= 0)
+    {
+	PyErr_SetString(PyExc_ValueError, "Pool size must have a positive value");
+
+	return -1;
+    }
+
+    if(idle_timeout < 0)
+    {
+	PyErr_SetString(PyExc_ValueError, "Idle timeout must have a positive value (or zero)");
+
+	return -1;
+    }
+
+    if(pool->pool != NULL)
+    {
+	PyErr_SetString(PyICAP_Exc, "The ICAP connection pool is already initialized");
+
+	return -1;
+    }
+
+    pool->pool = py_pool_create(host, port, proto, max_size, idle_timeout);
+    if(pool->pool == NULL)
+    {
+	PyErr_NoMemory();
+
+	return -1;
+    }
+
+    return 0;
+}
+
+static void
+py_pool_dealloc(PyObject *self)
+{
+    PyICAPConnectionPool *pool = (PyICAPConnectionPool *)self;
+
+    py_pool_destroy(pool->pool), pool->pool = NULL;
+
+    Py_TYPE(pool)->tp_free(self);
+}
+
+static PyObject *
+py_pool_acquire_conn(PyICAPConnectionPool *pool, PyObject *args, PyObject *kwds)
+{
+    PyObject *py_timeout = Py_None;
+    double timeout = -1;
+    ci_connection_t *sock = NULL;
+    int ret = 0;
+
+    static char *kwlist[] = { "timeout", NULL };
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "|O:acquire", kwlist, &py_timeout))
+    {
+	return NULL;
+    }
+
+    if(py_conn_parse_timeout(py_timeout, &timeout) != 0)
+    {
+	return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = py_pool_acquire(pool->pool, timeout, &sock);
+    Py_END_ALLOW_THREADS
+
+    if(ret != 0)
+    {
+	PyErr_SetString(PyICAP_Exc, "No ICAP connection available in the pool");
+
+	return NULL;
+    }
+
+    PyObject *obj = PyObject_CallFunction((PyObject *)&PyICAPConnectionType, "sii",
+					  pool->pool->host, pool->pool->port, pool->pool->proto);
+    if(obj == NULL)
+    {
+	py_pool_release(pool->pool, sock, 1);
+
+	return NULL;
+    }
+
+    // the connection gives back its socket when released
+    PyICAPConnection *conn = (PyICAPConnection *)obj;
+    conn->conn = sock;
+    conn->keepalive = (sock != NULL);
+    Py_INCREF(pool);
+    conn->pool = (PyObject *)pool;
+
+    return obj;
+}
+
+static PyObject *
+py_pool_release_conn(PyICAPConnectionPool *pool, PyObject *args)
+{
+    PyObject *obj = NULL;
+
+    if(!PyArg_ParseTuple(args, "O!:release", &PyICAPConnectionType, &obj))
+    {
+	return NULL;
+    }
+
+    PyICAPConnection *conn = (PyICAPConnection *)obj;
+    if(conn->pool != (PyObject *)pool)
+    {
+	PyErr_SetString(PyExc_ValueError, "The ICAP connection does not belong to this pool");
+
+	return NULL;
+    }
+
+    return py_conn_release(conn);
+}
+
+static struct PyMethodDef py_pool_methods[] =
+{
+    { "acquire", (PyCFunction)py_pool_acquire_conn,
+      METH_VARARGS | METH_KEYWORDS, "get a connection from the pool" },
+    { "release", (PyCFunction)py_pool_release_conn,
+      METH_VARARGS, "give a connection back to the pool" },
+    { .ml_name = NULL }
+};
+
+PyTypeObject PyICAPConnectionPoolType =
+{
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "icapclient.ICAPConnectionPool",
+    sizeof(PyICAPConnectionPool),
+    .tp_dealloc = py_pool_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "ICAP connection pool",
+    .tp_methods = py_pool_methods,
+    .tp_new = py_pool_new,
+    .tp_init = py_pool_init,
+    .tp_alloc = PyType_GenericAlloc,
+    .tp_free = PyObject_Del
+};
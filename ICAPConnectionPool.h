@@ -0,0 +1,69 @@
+/* -*- Mode: C; c-basic-offset: 4 -*- */
+/*
+ * Copyright 2015 Vincent Rasneur <vrasneur@free.fr>
+ * All Rights Reserved.
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation, version 3.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ *   NON INFRINGEMENT.  See the GNU General Public License for
+ *   more details.
+ */
+
+#ifndef PY_ICAP_CONNECTION_POOL_H
+#define PY_ICAP_CONNECTION_POOL_H
+
+#include "py_compat.h"
+
+#include <pthread.h>
+#include <time.h>
+
+#include "cicap_compat.h"
+
+typedef struct py_pool_conn
+{
+    struct py_pool_conn *next;
+    ci_connection_t *conn;
+    // monotonic time in seconds
+    time_t last_used;
+} py_pool_conn_t;
+
+// the native pool, usable without holding the GIL
+typedef struct
+{
+    char *host;
+    int port;
+    int proto;
+    int max_size;
+    int idle_timeout;
+    pthread_mutex_t lock;
+    // signaled when a connection slot is available
+    pthread_cond_t cond;
+    // idle connections, the most recently used first
+    py_pool_conn_t *idle;
+    int nidle;
+    // connections handed out to the callers
+    int nused;
+    int closing;
+    pthread_t reaper;
+    pthread_cond_t reaper_cond;
+} py_pool_t;
+
+py_pool_t *py_pool_create(char const *host, int port, int proto, int max_size, int idle_timeout);
+void py_pool_destroy(py_pool_t *pool);
+int py_pool_acquire(py_pool_t *pool, double timeout, ci_connection_t **conn);
+void py_pool_release(py_pool_t *pool, ci_connection_t *conn, int keepalive);
+
+typedef struct
+{
+    PyObject_HEAD
+    py_pool_t *pool;
+} PyICAPConnectionPool;
+
+PyTypeObject PyICAPConnectionPoolType;
+
+#endif // PY_ICAP_CONNECTION_POOL_H
@@ -0,0 +1,294 @@
+/* -*- Mode: C; c-basic-offset: 4 -*- */
+/*
+ * Copyright 2015 Vincent Rasneur <vrasneur@free.fr>
+ * All Rights Reserved.
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation, version 3.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ *   NON INFRINGEMENT.  See the GNU General Public License for
+ *   more details.
+ */
+
+#include "ICAPContent.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// the first allocation size, then the capacity doubles
+#define ICAP_CONTENT_MIN_CAPACITY 16384
+
+#ifndef Py_TPFLAGS_HAVE_NEWBUFFER
+#define Py_TPFLAGS_HAVE_NEWBUFFER 0
+#endif
+
+static int
+py_content_write_fd(int fd, char const *data, size_t len)
+{
+    while(len > 0)
+    {
+	ssize_t ret = write(fd, data, len);
+	if(ret < 0)
+	{
+	    if(errno == EINTR)
+	    {
+		continue;
+	    }
+
+	    return -1;
+	}
+
+	data += ret;
+	len -= ret;
+    }
+
+    return 0;
+}
+
+// move the content to an unlinked temporary file, it disappears with the last descriptor
+static int
+py_content_spill(py_content_buf_t *buf)
+{
+    char path[4096];
+    char const *tmpdir = getenv("TMPDIR");
+
+    if(tmpdir == NULL || *tmpdir == '\0')
+    {
+	tmpdir = "/tmp";
+    }
+
+    if(snprintf(path, sizeof(path), "%s/icapclient-XXXXXX", tmpdir) >= (int)sizeof(path))
+    {
+	errno = ENAMETOOLONG;
+
+	return -1;
+    }
+
+    int fd = mkstemp(path);
+    if(fd < 0)
+    {
+	return -1;
+    }
+
+    unlink(path);
+
+    if(py_content_write_fd(fd, buf->data, buf->size) != 0)
+    {
+	int err = errno;
+
+	close(fd);
+	errno = err;
+
+	return -1;
+    }
+
+    free(buf->data), buf->data = NULL;
+    buf->capacity = 0;
+    buf->spilled = 1;
+    buf->fd = fd;
+
+    return 0;
+}
+
+static int
+py_content_grow(py_content_buf_t *buf, size_t capacity)
+{
+    char *new_data = realloc(buf->data, capacity);
+    if(new_data == NULL)
+    {
+	errno = ENOMEM;
+
+	return -1;
+    }
+
+    buf->data = new_data;
+    buf->capacity = capacity;
+
+    return 0;
+}
+
+// allocate the expected size at once, or go straight to the file if it is too big
+int
+py_content_reserve(py_content_buf_t *buf, size_t size)
+{
+    if(buf->spilled || size <= buf->capacity)
+    {
+	return 0;
+    }
+
+    if(buf->max_memory > 0 && size > buf->max_memory)
+    {
+	return py_content_spill(buf);
+    }
+
+    return py_content_grow(buf, size);
+}
+
+int
+py_content_append(py_content_buf_t *buf, char const *data, size_t len)
+{
+    if(!buf->spilled && buf->max_memory > 0 && buf->size + len > buf->max_memory &&
+       py_content_spill(buf) != 0)
+    {
+	return -1;
+    }
+
+    if(buf->spilled)
+    {
+	if(py_content_write_fd(buf->fd, data, len) != 0)
+	{
+	    return -1;
+	}
+
+	buf->size += len;
+
+	return 0;
+    }
+
+    if(buf->size + len > buf->capacity)
+    {
+	size_t capacity = (buf->capacity > 0) ? buf->capacity : ICAP_CONTENT_MIN_CAPACITY;
+
+	while(capacity < buf->size + len)
+	{
+	    capacity *= 2;
+	}
+
+	// the content never grows past the limit in memory
+	if(buf->max_memory > 0 && capacity > buf->max_memory)
+	{
+	    capacity = buf->max_memory;
+	}
+
+	if(py_content_grow(buf, capacity) != 0)
+	{
+	    return -1;
+	}
+    }
+
+    memcpy(buf->data + buf->size, data, len);
+    buf->size += len;
+
+    return 0;
+}
+
+void
+py_content_reset(py_content_buf_t *buf)
+{
+    if(buf->spilled)
+    {
+	if(buf->data != NULL)
+	{
+	    munmap(buf->data, buf->size), buf->data = NULL;
+	}
+
+	if(buf->fd >= 0)
+	{
+	    close(buf->fd), buf->fd = -1;
+	}
+
+	buf->spilled = 0;
+    }
+
+    free(buf->data), buf->data = NULL;
+    buf->size = 0;
+    buf->capacity = 0;
+}
+
+// a spilled content is read back through a read-only mapping of its file
+static int
+py_content_map(py_content_buf_t *buf)
+{
+    if(buf->size > 0)
+    {
+	void *map = mmap(NULL, buf->size, PROT_READ, MAP_SHARED, buf->fd, 0);
+	if(map == MAP_FAILED)
+	{
+	    return -1;
+	}
+
+	buf->data = map;
+    }
+
+    // the mapping keeps the file alive
+    close(buf->fd), buf->fd = -1;
+
+    return 0;
+}
+
+// move the storage to a new content object, and return a read-only view on it
+PyObject *
+py_content_publish(py_content_buf_t *buf)
+{
+    if(buf->spilled && py_content_map(buf) != 0)
+    {
+	PyErr_SetFromErrno(PyExc_IOError);
+	py_content_reset(buf);
+
+	return NULL;
+    }
+
+    PyICAPContent *content = PyObject_New(PyICAPContent, &PyICAPContentType);
+    if(content == NULL)
+    {
+	py_content_reset(buf);
+
+	return NULL;
+    }
+
+    content->buf = *buf;
+    buf->data = NULL;
+    buf->size = 0;
+    buf->capacity = 0;
+    buf->spilled = 0;
+    buf->fd = -1;
+
+    PyObject *view = PyMemoryView_FromObject((PyObject *)content);
+    Py_DECREF(content);
+
+    return view;
+}
+
+static int
+py_content_getbuffer(PyObject *self, Py_buffer *view, int flags)
+{
+    PyICAPContent *content = (PyICAPContent *)self;
+
+    return PyBuffer_FillInfo(view, self, content->buf.data, content->buf.size, 1, flags);
+}
+
+static void
+py_content_dealloc(PyObject *self)
+{
+    PyICAPContent *content = (PyICAPContent *)self;
+
+    py_content_reset(&content->buf);
+
+    Py_TYPE(content)->tp_free(self);
+}
+
+static PyBufferProcs py_content_as_buffer =
+{
+    .bf_getbuffer = py_content_getbuffer,
+};
+
+PyTypeObject PyICAPContentType =
+{
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "icapclient.ICAPContent",
+    sizeof(PyICAPContent),
+    .tp_dealloc = py_content_dealloc,
+    .tp_as_buffer = &py_content_as_buffer,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER,
+    .tp_doc = "ICAP response content storage",
+    .tp_alloc = PyType_GenericAlloc,
+    .tp_free = PyObject_Del
+};
@@ -0,0 +1,49 @@
+/* -*- Mode: C; c-basic-offset: 4 -*- */
+/*
+ * Copyright 2015 Vincent Rasneur <vrasneur@free.fr>
+ * All Rights Reserved.
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation, version 3.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ *   NON INFRINGEMENT.  See the GNU General Public License for
+ *   more details.
+ */
+
+#ifndef PY_ICAP_CONTENT_H
+#define PY_ICAP_CONTENT_H
+
+#include "py_compat.h"
+
+// a growable buffer, filled without holding the GIL
+typedef struct
+{
+    char *data;
+    size_t size;
+    size_t capacity;
+    // above this size the content moves to a temporary file, 0 to always keep it in memory
+    size_t max_memory;
+    // the content is in the unlinked file, then in a mapping of it once published
+    int spilled;
+    int fd;
+} py_content_buf_t;
+
+int py_content_reserve(py_content_buf_t *buf, size_t size);
+int py_content_append(py_content_buf_t *buf, char const *data, size_t len);
+void py_content_reset(py_content_buf_t *buf);
+PyObject *py_content_publish(py_content_buf_t *buf);
+
+// the owner of the response content storage
+typedef struct
+{
+    PyObject_HEAD
+    py_content_buf_t buf;
+} PyICAPContent;
+
+PyTypeObject PyICAPContentType;
+
+#endif // PY_ICAP_CONTENT_H
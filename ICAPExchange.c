@@ -0,0 +1,299 @@
+/* -*- Mode: C; c-basic-offset: 4 -*- */
+/*
+ * Copyright 2015 Vincent Rasneur <vrasneur@free.fr>
+ * All Rights Reserved.
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation, version 3.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ *   NON INFRINGEMENT.  See the GNU General Public License for
+ *   more details.
+ */
+
+#include "ICAPExchange.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "gcc_attributes.h"
+#include "ICAPResponse.h"
+
+// default exception
+extern PyObject *PyICAP_Exc;
+
+PyICAPExchange *
+py_exchange_alloc(void)
+{
+    PyICAPExchange *ex = PyObject_New(PyICAPExchange, &PyICAPExchangeType);
+    if(ex == NULL)
+    {
+	return NULL;
+    }
+
+    ex->conn = NULL;
+    py_conn_job_init(&ex->job);
+    memset(&ex->step, 0, sizeof(ex->step));
+    ex->step.state = PY_CONN_STEP_OVER;
+    ex->service = NULL;
+    ex->url = NULL;
+    ex->want = 0;
+    ex->result = NULL;
+    ex->finished = 0;
+    ex->failed = 0;
+
+    return ex;
+}
+
+// give the connection back, the socket is kept only after a complete response
+static void
+py_exchange_release(PyICAPExchange *ex)
+{
+    PyICAPConnection *conn = ex->conn;
+
+    if(!ex->job.keepalive && conn->conn != NULL)
+    {
+	py_conn_destroy_connection(conn->conn), conn->conn = NULL;
+    }
+
+    conn->keepalive = (conn->conn != NULL);
+    conn->busy = 0;
+    ex->conn = NULL;
+    Py_DECREF(conn);
+}
+
+// build the response or the exception, must be called with the GIL held
+static void
+py_exchange_finish(PyICAPExchange *ex, int closed)
+{
+    PyObject *content = NULL;
+
+    if(closed)
+    {
+	PyErr_SetString(PyICAP_Exc, "The ICAP exchange is closed");
+    }
+    else if(ex->job.error == PY_CONN_OK && py_conn_job_finish(&ex->job, &content) == 0)
+    {
+	ex->result = py_resp_new(ex->job.req, ex->job.status, &ex->job.stats, content);
+	Py_XDECREF(content);
+    }
+    else
+    {
+	py_conn_job_set_error(&ex->job);
+    }
+
+    if(ex->result == NULL)
+    {
+	if(!PyErr_Occurred())
+	{
+	    PyErr_SetString(PyICAP_Exc, "Cannot create the ICAP response object");
+	}
+
+	ex->result = py_conn_fetch_error();
+	ex->failed = 1;
+    }
+    else
+    {
+	// like after request()
+	Py_INCREF(ex->result);
+	ex->conn->response = ex->result;
+    }
+
+    py_conn_job_clear(&ex->job);
+    py_exchange_release(ex);
+    ex->finished = 1;
+}
+
+// advance the exchange as far as the sockets allow
+static void
+py_exchange_step(PyICAPExchange *ex)
+{
+    PyICAPConnection *conn = ex->conn;
+    int want = 0;
+
+    // the Python sources and sinks take the GIL back when needed
+    Py_BEGIN_ALLOW_THREADS
+    want = py_conn_job_step(&ex->job, &conn->conn, &ex->step);
+    Py_END_ALLOW_THREADS
+
+    ex->want = want;
+
+    if(want == 0)
+    {
+	py_exchange_finish(ex, 0);
+    }
+}
+
+int
+py_exchange_begin(PyICAPExchange *ex, PyICAPConnection *conn)
+{
+    // the arguments are only borrowed by the job
+    ex->service = strdup(ex->job.service);
+    ex->url = strdup(ex->job.url);
+    if(ex->service == NULL || ex->url == NULL)
+    {
+	PyErr_NoMemory();
+
+	return -1;
+    }
+
+    ex->job.service = ex->service;
+    ex->job.url = ex->url;
+
+    Py_INCREF(conn);
+    ex->conn = conn;
+
+    Py_BEGIN_ALLOW_THREADS
+    py_conn_job_begin(&ex->job, &conn->conn, &ex->step);
+    Py_END_ALLOW_THREADS
+
+    // nothing to wait for yet: the connection or the first bytes go out now
+    py_exchange_step(ex);
+
+    return 0;
+}
+
+static PyObject *
+py_exchange_fileno(PyICAPExchange *ex)
+{
+    int fd = -1;
+
+    if(!ex->finished)
+    {
+	fd = py_conn_job_fileno(ex->conn->conn, &ex->step);
+    }
+
+    if(fd < 0)
+    {
+	PyErr_SetString(PyICAP_Exc, "The ICAP exchange is over");
+
+	return NULL;
+    }
+
+    return PyInt_FromLong(fd);
+}
+
+// return True when the exchange is over
+static PyObject *
+py_exchange_next(PyICAPExchange *ex)
+{
+    if(!ex->finished)
+    {
+	py_exchange_step(ex);
+    }
+
+    return PyBool_FromLong(ex->finished);
+}
+
+static PyObject *
+py_exchange_done(PyICAPExchange *ex)
+{
+    return PyBool_FromLong(ex->finished);
+}
+
+static PyObject *
+py_exchange_result(PyICAPExchange *ex)
+{
+    if(!ex->finished)
+    {
+	PyErr_SetString(PyICAP_Exc, "The ICAP exchange is not finished");
+
+	return NULL;
+    }
+
+    if(ex->failed)
+    {
+	PyErr_SetObject((PyObject *)Py_TYPE(ex->result), ex->result);
+
+	return NULL;
+    }
+
+    Py_INCREF(ex->result);
+
+    return ex->result;
+}
+
+static PyObject *
+py_exchange_close(PyICAPExchange *ex)
+{
+    if(!ex->finished)
+    {
+	py_conn_job_abort(&ex->job, &ex->conn->conn, &ex->step);
+	py_exchange_finish(ex, 1);
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+py_exchange_want_read(PyICAPExchange *ex, GCC_UNUSED void *closure)
+{
+    return PyBool_FromLong(!ex->finished && (ex->want & PY_CONN_WANT_READ));
+}
+
+static PyObject *
+py_exchange_want_write(PyICAPExchange *ex, GCC_UNUSED void *closure)
+{
+    return PyBool_FromLong(!ex->finished && (ex->want & PY_CONN_WANT_WRITE));
+}
+
+static void
+py_exchange_dealloc(PyObject *self)
+{
+    PyICAPExchange *ex = (PyICAPExchange *)self;
+
+    // the response was not read: the socket is closed
+    if(ex->conn != NULL)
+    {
+	py_conn_job_abort(&ex->job, &ex->conn->conn, &ex->step);
+	py_exchange_release(ex);
+    }
+
+    py_conn_job_clear(&ex->job);
+    free(ex->service), ex->service = NULL;
+    free(ex->url), ex->url = NULL;
+    Py_XDECREF(ex->result);
+
+    Py_TYPE(ex)->tp_free(self);
+}
+
+static struct PyMethodDef py_exchange_methods[] =
+{
+    { "fileno", (PyCFunction)py_exchange_fileno,
+      METH_NOARGS, "get the socket to watch before the next step" },
+    { "step", (PyCFunction)py_exchange_next,
+      METH_NOARGS, "advance the exchange without blocking, return True when it is over" },
+    { "done", (PyCFunction)py_exchange_done,
+      METH_NOARGS, "check if the ICAP exchange is over" },
+    { "result", (PyCFunction)py_exchange_result,
+      METH_NOARGS, "get the ICAP response, or raise the exchange exception" },
+    { "close", (PyCFunction)py_exchange_close,
+      METH_NOARGS, "stop the exchange and close its socket" },
+    { .ml_name = NULL }
+};
+
+static PyGetSetDef py_exchange_getset[] =
+{
+    { "want_read", (getter)py_exchange_want_read, NULL,
+      "the next step waits for the socket to be readable", NULL },
+    { "want_write", (getter)py_exchange_want_write, NULL,
+      "the next step waits for the socket to be writable", NULL },
+    { .name = NULL }
+};
+
+PyTypeObject PyICAPExchangeType =
+{
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "icapclient.ICAPExchange",
+    sizeof(PyICAPExchange),
+    .tp_dealloc = py_exchange_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "ICAP request advanced without blocking, by an event loop",
+    .tp_methods = py_exchange_methods,
+    .tp_getset = py_exchange_getset,
+    .tp_alloc = PyType_GenericAlloc,
+    .tp_free = PyObject_Del
+};
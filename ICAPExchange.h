@@ -0,0 +1,47 @@
+/* -*- Mode: C; c-basic-offset: 4 -*- */
+/*
+ * Copyright 2015 Vincent Rasneur <vrasneur@free.fr>
+ * All Rights Reserved.
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation, version 3.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ *   NON INFRINGEMENT.  See the GNU General Public License for
+ *   more details.
+ */
+
+#ifndef PY_ICAP_EXCHANGE_H
+#define PY_ICAP_EXCHANGE_H
+
+#include "py_compat.h"
+
+#include "ICAPConnection.h"
+
+typedef struct
+{
+    PyObject_HEAD
+    // the busy connection, NULL once the exchange is over
+    PyICAPConnection *conn;
+    py_conn_job_t job;
+    py_conn_step_t step;
+    char *service;
+    char *url;
+    // the PY_CONN_WANT_* flags of the last step
+    int want;
+    // the response, or the exception
+    PyObject *result;
+    int finished;
+    int failed;
+} PyICAPExchange;
+
+PyTypeObject PyICAPExchangeType;
+
+PyICAPExchange *py_exchange_alloc(void);
+// take the connection and run the first step, the job arguments are already parsed
+int py_exchange_begin(PyICAPExchange *ex, PyICAPConnection *conn);
+
+#endif // PY_ICAP_EXCHANGE_H
@@ -0,0 +1,477 @@
+/* -*- Mode: C; c-basic-offset: 4 -*- */
+/*
+ * Copyright 2015 Vincent Rasneur <vrasneur@free.fr>
+ * All Rights Reserved.
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation, version 3.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ *   NON INFRINGEMENT.  See the GNU General Public License for
+ *   more details.
+ */
+
+#include "ICAPHeaders.h"
+
+#include <ctype.h>
+#include <stdint.h>
+#include <strings.h>
+
+#include "gcc_attributes.h"
+
+// FNV-1a on the lowercase name
+static uint32_t
+py_headers_hash(char const *name, size_t len)
+{
+    uint32_t hash = 2166136261u;
+
+    for(size_t idx = 0; idx < len; idx++)
+    {
+	hash ^= (unsigned char)tolower((unsigned char)name[idx]);
+	hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+// the slot of a name, or the empty slot where it should be inserted
+static size_t
+py_headers_slot(PyICAPHeaders const *headers, char const *name, size_t len)
+{
+    size_t slot = py_headers_hash(name, len) & headers->mask;
+
+    // linear probing, the table is never full
+    while(headers->table[slot] >= 0)
+    {
+	py_headers_entry_t const *entry = &headers->entries[headers->table[slot]];
+
+	if(entry->name_len == len && strncasecmp(entry->name, name, len) == 0)
+	{
+	    break;
+	}
+
+	slot = (slot + 1) & headers->mask;
+    }
+
+    return slot;
+}
+
+// split the lines the same way as ci_headers_iterate, then index the names
+static int
+py_headers_index(PyICAPHeaders *headers)
+{
+    size_t size = 8;
+
+    while(size < (size_t)headers->count * 2)
+    {
+	size *= 2;
+    }
+
+    headers->entries = malloc(headers->count * sizeof(*headers->entries) + 1);
+    headers->table = malloc(size * sizeof(*headers->table));
+    if(headers->entries == NULL || headers->table == NULL)
+    {
+	return -1;
+    }
+
+    memset(headers->table, -1, size * sizeof(*headers->table));
+    headers->mask = size - 1;
+
+    int used = 0;
+
+    for(int idx = 0; idx < headers->count; idx++)
+    {
+	char const *line = headers->lines[idx];
+	char const *value = line + strcspn(line, ":");
+	size_t name_len = value - line;
+
+	if(*value == ':')
+	{
+	    value++;
+
+	    while(*value == ' ')
+	    {
+		value++;
+	    }
+	}
+
+	// the first line is the request or status line
+	if(idx == 0 && *value == '\0')
+	{
+	    headers->line = line;
+
+	    continue;
+	}
+
+	py_headers_entry_t *entry = &headers->entries[used];
+
+	entry->name = line;
+	entry->name_len = name_len;
+	entry->value = value;
+	entry->next = -1;
+	entry->last = -1;
+
+	size_t slot = py_headers_slot(headers, line, name_len);
+	if(headers->table[slot] < 0)
+	{
+	    headers->table[slot] = used;
+	}
+	else
+	{
+	    // chain the repeated headers, in order
+	    py_headers_entry_t *first = &headers->entries[headers->table[slot]];
+	    int last = (first->last >= 0) ? first->last : headers->table[slot];
+
+	    headers->entries[last].next = used;
+	    first->last = used;
+	}
+
+	used++;
+    }
+
+    headers->count = used;
+
+    return 0;
+}
+
+PyObject *
+py_headers_new(char **lines, int count)
+{
+    PyICAPHeaders *headers = PyObject_New(PyICAPHeaders, &PyICAPHeadersType);
+    if(headers == NULL)
+    {
+	return NULL;
+    }
+
+    headers->lines = lines;
+    headers->line = NULL;
+    headers->count = count;
+    headers->entries = NULL;
+    headers->table = NULL;
+    headers->mask = 0;
+
+    if(py_headers_index(headers) != 0)
+    {
+	// the caller still owns the lines
+	headers->lines = NULL;
+	Py_DECREF(headers);
+
+	return PyErr_NoMemory();
+    }
+
+    return (PyObject *)headers;
+}
+
+static int
+py_headers_find(PyICAPHeaders *headers, char const *name)
+{
+    size_t slot = py_headers_slot(headers, name, strlen(name));
+
+    return headers->table[slot];
+}
+
+// the names can be given as text or bytes, NULL for the other objects
+static char const *
+py_headers_key(PyObject *key)
+{
+    if(PyString_Check(key))
+    {
+	return PyString_AS_STRING(key);
+    }
+
+#if PY_MAJOR_VERSION >= 3
+    if(PyUnicode_Check(key))
+    {
+	char const *name = PyUnicode_AsUTF8(key);
+	if(name == NULL)
+	{
+	    PyErr_Clear();
+	}
+
+	return name;
+    }
+#endif
+
+    return NULL;
+}
+
+// the values are returned as raw bytes, and only decoded when asked
+PyObject *
+py_headers_value(char const *value, char const *encoding)
+{
+    if(encoding == NULL)
+    {
+	return PyString_FromString(value);
+    }
+
+    return PyUnicode_Decode(value, strlen(value), encoding, "strict");
+}
+
+PyObject *
+py_headers_get(PyICAPHeaders *headers, char const *name, PyObject *default_value, char const *encoding)
+{
+    int idx = py_headers_find(headers, name);
+
+    if(idx < 0)
+    {
+	Py_INCREF(default_value);
+
+	return default_value;
+    }
+
+    return py_headers_value(headers->entries[idx].value, encoding);
+}
+
+PyObject *
+py_headers_items(PyICAPHeaders *headers)
+{
+    PyObject *items = PyList_New(headers->count);
+    if(items == NULL)
+    {
+	return NULL;
+    }
+
+    for(int idx = 0; idx < headers->count; idx++)
+    {
+	py_headers_entry_t const *entry = &headers->entries[idx];
+
+	PyObject *item = Py_BuildValue("(" PY_BYTES_FORMAT "#" PY_BYTES_FORMAT ")",
+				     entry->name, (Py_ssize_t)entry->name_len, entry->value);
+	if(item == NULL)
+	{
+	    Py_DECREF(items);
+
+	    return NULL;
+	}
+
+	PyList_SET_ITEM(items, idx, item);
+    }
+
+    return items;
+}
+
+// the names or the values, in order: like email.message.Message, a repeated
+// header is listed each time
+static PyObject *
+py_headers_column(PyICAPHeaders *headers, int values)
+{
+    PyObject *column = PyList_New(headers->count);
+    if(column == NULL)
+    {
+	return NULL;
+    }
+
+    for(int idx = 0; idx < headers->count; idx++)
+    {
+	py_headers_entry_t const *entry = &headers->entries[idx];
+
+	PyObject *item = values ? PyString_FromString(entry->value) :
+	    PyString_FromStringAndSize(entry->name, entry->name_len);
+	if(item == NULL)
+	{
+	    Py_DECREF(column);
+
+	    return NULL;
+	}
+
+	PyList_SET_ITEM(column, idx, item);
+    }
+
+    return column;
+}
+
+static PyObject *
+py_headers_py_get(PyICAPHeaders *headers, PyObject *args)
+{
+    PyObject *key = NULL;
+    PyObject *default_value = Py_None;
+
+    if(!PyArg_ParseTuple(args, "O|O:get", &key, &default_value))
+    {
+	return NULL;
+    }
+
+    char const *name = py_headers_key(key);
+    if(name == NULL)
+    {
+	PyErr_SetString(PyExc_TypeError, "Header name must be a string");
+
+	return NULL;
+    }
+
+    return py_headers_get(headers, name, default_value, NULL);
+}
+
+static PyObject *
+py_headers_getall(PyICAPHeaders *headers, PyObject *args)
+{
+    PyObject *key = NULL;
+
+    if(!PyArg_ParseTuple(args, "O:getall", &key))
+    {
+	return NULL;
+    }
+
+    char const *name = py_headers_key(key);
+    if(name == NULL)
+    {
+	PyErr_SetString(PyExc_TypeError, "Header name must be a string");
+
+	return NULL;
+    }
+
+    PyObject *values = PyList_New(0);
+    if(values == NULL)
+    {
+	return NULL;
+    }
+
+    for(int idx = py_headers_find(headers, name); idx >= 0; idx = headers->entries[idx].next)
+    {
+	PyObject *value = PyString_FromString(headers->entries[idx].value);
+	if(value == NULL || PyList_Append(values, value) != 0)
+	{
+	    Py_XDECREF(value);
+	    Py_DECREF(values);
+
+	    return NULL;
+	}
+
+	Py_DECREF(value);
+    }
+
+    return values;
+}
+
+static PyObject *
+py_headers_py_items(PyICAPHeaders *headers)
+{
+    return py_headers_items(headers);
+}
+
+static PyObject *
+py_headers_keys(PyICAPHeaders *headers)
+{
+    return py_headers_column(headers, 0);
+}
+
+static PyObject *
+py_headers_values(PyICAPHeaders *headers)
+{
+    return py_headers_column(headers, 1);
+}
+
+static PyObject *
+py_headers_iter(PyObject *self)
+{
+    PyObject *keys = py_headers_column((PyICAPHeaders *)self, 0);
+    if(keys == NULL)
+    {
+	return NULL;
+    }
+
+    PyObject *iter = PyObject_GetIter(keys);
+    Py_DECREF(keys);
+
+    return iter;
+}
+
+static Py_ssize_t
+py_headers_length(PyObject *self)
+{
+    return ((PyICAPHeaders *)self)->count;
+}
+
+static int
+py_headers_contains(PyObject *self, PyObject *key)
+{
+    char const *name = py_headers_key(key);
+    if(name == NULL)
+    {
+	return 0;
+    }
+
+    return py_headers_find((PyICAPHeaders *)self, name) >= 0;
+}
+
+static PyObject *
+py_headers_subscript(PyObject *self, PyObject *key)
+{
+    char const *name = py_headers_key(key);
+    if(name == NULL)
+    {
+	PyErr_SetObject(PyExc_KeyError, key);
+
+	return NULL;
+    }
+
+    PyICAPHeaders *headers = (PyICAPHeaders *)self;
+    int idx = py_headers_find(headers, name);
+
+    if(idx < 0)
+    {
+	PyErr_SetObject(PyExc_KeyError, key);
+
+	return NULL;
+    }
+
+    return PyString_FromString(headers->entries[idx].value);
+}
+
+static void
+py_headers_dealloc(PyObject *self)
+{
+    PyICAPHeaders *headers = (PyICAPHeaders *)self;
+
+    free(headers->table), headers->table = NULL;
+    free(headers->entries), headers->entries = NULL;
+    free(headers->lines), headers->lines = NULL;
+
+    Py_TYPE(headers)->tp_free(self);
+}
+
+static PySequenceMethods py_headers_as_sequence =
+{
+    .sq_length = py_headers_length,
+    .sq_contains = py_headers_contains
+};
+
+static PyMappingMethods py_headers_as_mapping =
+{
+    .mp_length = py_headers_length,
+    .mp_subscript = py_headers_subscript
+};
+
+static struct PyMethodDef py_headers_methods[] =
+{
+    { "get", (PyCFunction)py_headers_py_get,
+      METH_VARARGS, "Get the first value of a header" },
+    { "getall", (PyCFunction)py_headers_getall,
+      METH_VARARGS, "Get all the values of a header" },
+    { "items", (PyCFunction)py_headers_py_items,
+      METH_NOARGS, "Get the (name, value) headers, in order" },
+    { "keys", (PyCFunction)py_headers_keys,
+      METH_NOARGS, "Get the header names, in order" },
+    { "values", (PyCFunction)py_headers_values,
+      METH_NOARGS, "Get the header values, in order" },
+    { .ml_name = NULL }
+};
+
+PyTypeObject PyICAPHeadersType =
+{
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "icapclient.ICAPHeaders",
+    sizeof(PyICAPHeaders),
+    .tp_dealloc = py_headers_dealloc,
+    .tp_as_sequence = &py_headers_as_sequence,
+    .tp_as_mapping = &py_headers_as_mapping,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "ICAP or HTTP headers, with case-insensitive names",
+    .tp_iter = py_headers_iter,
+    .tp_methods = py_headers_methods,
+    .tp_alloc = PyType_GenericAlloc,
+    .tp_free = PyObject_Del
+};
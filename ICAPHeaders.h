@@ -0,0 +1,55 @@
+/* -*- Mode: C; c-basic-offset: 4 -*- */
+/*
+ * Copyright 2015 Vincent Rasneur <vrasneur@free.fr>
+ * All Rights Reserved.
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation, version 3.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ *   NON INFRINGEMENT.  See the GNU General Public License for
+ *   more details.
+ */
+
+#ifndef PY_ICAP_HEADERS_H
+#define PY_ICAP_HEADERS_H
+
+#include "py_compat.h"
+
+typedef struct
+{
+    char const *name;
+    size_t name_len;
+    char const *value;
+    // the next and last headers with the same name, -1 if none
+    int next;
+    int last;
+} py_headers_entry_t;
+
+// a read-only mapping of header names to values
+typedef struct
+{
+    PyObject_HEAD
+    // the raw header lines, in a single block
+    char **lines;
+    // the request or status line, NULL if none
+    char const *line;
+    int count;
+    py_headers_entry_t *entries;
+    // the first entry of each name, by case-insensitive hash, -1 if empty
+    int *table;
+    size_t mask;
+} PyICAPHeaders;
+
+PyTypeObject PyICAPHeadersType;
+
+// take the ownership of the lines, only on success
+PyObject *py_headers_new(char **lines, int count);
+PyObject *py_headers_get(PyICAPHeaders *headers, char const *name, PyObject *default_value, char const *encoding);
+PyObject *py_headers_value(char const *value, char const *encoding);
+PyObject *py_headers_items(PyICAPHeaders *headers);
+
+#endif // PY_ICAP_HEADERS_H
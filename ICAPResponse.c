@@ -20,57 +20,154 @@
 
 #include "gcc_attributes.h"
 #include "cicap_compat.h"
+#include "ICAPHeaders.h"
 
 // default exception
 extern PyObject *PyICAP_Exc;
 
-typedef struct
+// end of a header line, folded lines continue with a space or a tab
+#ifndef eoh
+#define eoh(s) ((*s == '\r' && *(s+1) == '\n' && *(s+2) != '\t' && *(s+2) != ' ') || (*s == '\n' && *(s+1) != '\t' && *(s+1) != ' '))
+#endif
+
+static size_t
+py_resp_line_len(char const *line)
 {
-    PyObject *line;
-    PyObject *headers;
-    size_t idx;
-} py_resp_headers_ctx;
+    char const *s = line;
 
-static void
-py_resp_add_header(void *data, char const *name, char const *value)
+    while(*s != '\0' && !eoh(s))
+    {
+	s++;
+    }
+
+    return s - line;
+}
+
+// copy the header lines, the request is destroyed or reused after the response is built
+static int
+py_resp_copy_headers(py_resp_headers_t *section, ci_headers_list_t const *headers)
+{
+    size_t size = 0;
+
+    if(headers == NULL || headers->used <= 0)
+    {
+	return 0;
+    }
+
+    for(int idx = 0; idx < headers->used; idx++)
+    {
+	size += py_resp_line_len(headers->headers[idx]) + 1;
+    }
+
+    // the line pointers and the lines are stored in a single block
+    section->lines = malloc(headers->used * sizeof(char *) + size);
+    if(section->lines == NULL)
+    {
+	PyErr_NoMemory();
+
+	return -1;
+    }
+
+    char *data = (char *)(section->lines + headers->used);
+
+    for(int idx = 0; idx < headers->used; idx++)
+    {
+	size_t len = py_resp_line_len(headers->headers[idx]);
+
+	memcpy(data, headers->headers[idx], len);
+	data[len] = '\0';
+	section->lines[idx] = data;
+	data += len + 1;
+    }
+
+    section->count = headers->used;
+
+    return 0;
+}
+
+// index the header names on the first lookup
+static PyICAPHeaders *
+py_resp_get_map(py_resp_headers_t *section)
+{
+    if(section->map == NULL)
+    {
+	section->map = py_headers_new(section->lines, section->count);
+	if(section->map == NULL)
+	{
+	    // the lines are kept for the next try
+	    return NULL;
+	}
+
+	// the mapping owns the lines from now on
+	section->lines = NULL;
+	section->count = 0;
+    }
+
+    return (PyICAPHeaders *)section->map;
+}
+
+// build the Python line and (name, value) list on the first access
+static int
+py_resp_convert_headers(py_resp_headers_t *section)
 {
-    py_resp_headers_ctx *ctx = data;
+    if(section->converted)
+    {
+	return 0;
+    }
 
-    if(ctx->idx == 0 &&
-       (value == NULL || *value == '\0'))
+    PyICAPHeaders *map = py_resp_get_map(section);
+    if(map == NULL)
     {
-	ctx->line = PyString_FromString(name);
+	return -1;
     }
-    else
+
+    if(map->line != NULL)
     {
-	if(ctx->headers == NULL)
+	section->line = PyString_FromString(map->line);
+	if(section->line == NULL)
 	{
-	    ctx->headers = PyList_New(0);
+	    return -1;
 	}
+    }
+
+    if(map->count > 0)
+    {
+	section->headers = py_headers_items(map);
+	if(section->headers == NULL)
+	{
+	    Py_CLEAR(section->line);
 
-	PyObject *py_header = PyTuple_New(2);
-       
-	PyTuple_SET_ITEM(py_header, 0, PyString_FromString(name));
-	PyTuple_SET_ITEM(py_header, 1, PyString_FromString(value));
-	(void)PyList_Append(ctx->headers, py_header);
+	    return -1;
+	}
     }
 
-    ctx->idx++;
+    section->converted = 1;
+
+    return 0;
+}
+
+static void
+py_resp_clear_headers(py_resp_headers_t *section)
+{
+    free(section->lines), section->lines = NULL;
+    section->count = 0;
+    Py_CLEAR(section->map);
+    Py_CLEAR(section->line);
+    Py_CLEAR(section->headers);
 }
 
 static int
-py_resp_parse_icap_headers(PyICAPResponse *resp, PyICAPConnection const *conn)
+py_resp_parse_icap_headers(PyICAPResponse *resp, ci_request_t *req, int req_status)
 {
-    py_resp_headers_ctx ctx = { 0 };
-    ci_headers_list_t *icap_headers = conn->req->response_header;
+    ci_headers_list_t *icap_headers = req->response_header;
    
     if(icap_headers == NULL || icap_headers->used <= 0)
     {
 	// old versions of C-ICAP delete the headers
 	// if we receive a 204 response...
-	if(conn->req_status == 204)
+	if(req_status == 204)
 	{
-	    resp->icap_status = PyInt_FromLong(conn->req_status);
+	    resp->icap_status = PyInt_FromLong(req_status);
 	    resp->icap_reason = PyString_FromString("Unmodified");
 	}
 	else
@@ -80,23 +177,13 @@ py_resp_parse_icap_headers(PyICAPResponse *resp, PyICAPConnection const *conn)
      
 	goto py_resp_parse_icap_headers_error;
     }
-   
-    ci_headers_iterate(icap_headers, &ctx, py_resp_add_header);
 
-    if(ctx.line == NULL)
+    if(py_resp_copy_headers(&resp->icap, icap_headers) != 0)
     {
-	PyErr_SetString(PyICAP_Exc, "Cannot parse the ICAP response line");
-      
 	goto py_resp_parse_icap_headers_error;
     }
-   
-    char const *line = PyString_AS_STRING(ctx.line);
-    if(line == NULL)
-    {
-	PyErr_SetString(PyICAP_Exc, "Cannot get the ICAP response line");
 
-	goto py_resp_parse_icap_headers_error;
-    }
+    char const *line = resp->icap.lines[0];
    
     // parse the ICAP response line
     int nread = 0;
@@ -112,15 +199,10 @@ py_resp_parse_icap_headers(PyICAPResponse *resp, PyICAPConnection const *conn)
     }
 
     resp->icap_status = PyInt_FromLong(status);
-    resp->icap_reason = PyString_FromString(icap_headers->headers[0] + nread);
-    resp->icap_headers = ctx.headers;
-    ctx.headers = NULL;
+    resp->icap_reason = PyString_FromString(line + nread);
    
 py_resp_parse_icap_headers_error:
    
-    Py_XDECREF(ctx.line);
-    Py_XDECREF(ctx.headers);
-   
     if(PyErr_Occurred())
     {
 	return -1;
@@ -129,45 +211,20 @@ py_resp_parse_icap_headers_error:
     return 0;
 }
 
-static void
-py_resp_parse_http_req_headers(PyICAPResponse *resp, ci_request_t *req)
-{
-    ci_headers_list_t *req_headers = ci_http_request_headers(req);
-
-    if(req_headers != NULL && req_headers->used >= 1)
-    {
-	py_resp_headers_ctx ctx = { 0 };
-      
-	ci_headers_iterate(req_headers, &ctx, py_resp_add_header);
-	resp->http_req_line = ctx.line;
-	resp->http_req_headers = ctx.headers;
-    }
-}
-
-static void
-py_resp_parse_http_resp_headers(PyICAPResponse *resp, ci_request_t *req)
+static int
+py_resp_parse_headers(PyICAPResponse *resp, ci_request_t *req, int status)
 {
-    ci_headers_list_t *resp_headers = ci_http_response_headers(req);
+    int ret = py_resp_parse_icap_headers(resp, req, status);
 
-    if(resp_headers != NULL && resp_headers->used >= 1)
+    // only keep the raw HTTP headers, they are converted when accessed
+    if(ret == 0)
     {
-	py_resp_headers_ctx ctx = { 0 };
-      
-	ci_headers_iterate(resp_headers, &ctx, py_resp_add_header);
-	resp->http_resp_line = ctx.line;
-	resp->http_resp_headers = ctx.headers;
+	ret = py_resp_copy_headers(&resp->http_req, ci_http_request_headers(req));
     }
-}
-
-static int
-py_resp_parse_headers(PyICAPResponse *resp, PyICAPConnection const *conn)
-{
-    int ret = py_resp_parse_icap_headers(resp, conn);
 
     if(ret == 0)
     {
-	py_resp_parse_http_req_headers(resp, conn->req);
-	py_resp_parse_http_resp_headers(resp, conn->req);
+	ret = py_resp_copy_headers(&resp->http_resp, ci_http_response_headers(req));
     }
    
     return ret;
@@ -177,28 +234,33 @@ static void py_resp_init(PyICAPResponse *resp)
 {
     resp->icap_status = NULL;
     resp->icap_reason = NULL;
-    resp->icap_headers = NULL;
-    resp->http_req_line = NULL;
-    resp->http_req_headers = NULL;
-    resp->http_resp_line = NULL;
-    resp->http_resp_headers = NULL;
+    memset(&resp->icap, 0, sizeof(resp->icap));
+    memset(&resp->http_req, 0, sizeof(resp->http_req));
+    memset(&resp->http_resp, 0, sizeof(resp->http_resp));
     resp->content = NULL;
+    memset(&resp->stats, 0, sizeof(resp->stats));
+    resp->stats.preview = -1;
 }
 
-PyObject *py_resp_new(PyICAPConnection *conn)
+PyObject *py_resp_new(ci_request_t *req, int status, py_conn_stats_t const *stats, PyObject *content)
 {
     PyICAPResponse *resp = NULL;
 
-    if(conn->req == NULL)
+    if(req == NULL)
     {
 	return NULL;
     }
    
     resp = PyObject_New(PyICAPResponse, &PyICAPResponseType);
+    if(resp == NULL)
+    {
+	return NULL;
+    }
+
     // set all the custom attributes to NULL
     py_resp_init(resp);
    
-    int ret = py_resp_parse_headers(resp, conn);
+    int ret = py_resp_parse_headers(resp, req, status);
     if(ret != 0)
     {
 	Py_XDECREF(resp);
@@ -211,87 +273,228 @@ PyObject *py_resp_new(PyICAPConnection *conn)
 	return NULL;
     }
 
-    Py_XINCREF(conn->content);
-    resp->content = conn->content;
+    Py_XINCREF(content);
+    resp->content = content;
+    resp->stats = *stats;
    
     return (PyObject *)resp;
 }
 
+// share the immutable mapping, or copy the raw lines that were never indexed
+static int
+py_resp_copy_section(py_resp_headers_t *dest, py_resp_headers_t const *section)
+{
+    size_t size = 0;
+
+    if(section->map != NULL)
+    {
+	Py_INCREF(section->map);
+	dest->map = section->map;
+
+	return 0;
+    }
+
+    if(section->lines == NULL)
+    {
+	return 0;
+    }
+
+    for(int idx = 0; idx < section->count; idx++)
+    {
+	size += strlen(section->lines[idx]) + 1;
+    }
+
+    dest->lines = malloc(section->count * sizeof(char *) + size);
+    if(dest->lines == NULL)
+    {
+	PyErr_NoMemory();
+
+	return -1;
+    }
+
+    char *data = (char *)(dest->lines + section->count);
+
+    for(int idx = 0; idx < section->count; idx++)
+    {
+	size_t len = strlen(section->lines[idx]);
+
+	memcpy(data, section->lines[idx], len + 1);
+	dest->lines[idx] = data;
+	data += len + 1;
+    }
+
+    dest->count = section->count;
+
+    return 0;
+}
+
+// a response served again without any exchange: the same verdict, headers and
+// content, but nothing was sent or received
+PyObject *
+py_resp_copy(PyObject *obj)
+{
+    PyICAPResponse *orig = (PyICAPResponse *)obj;
+
+    PyICAPResponse *resp = PyObject_New(PyICAPResponse, &PyICAPResponseType);
+    if(resp == NULL)
+    {
+	return NULL;
+    }
+
+    py_resp_init(resp);
+
+    if(py_resp_copy_section(&resp->icap, &orig->icap) != 0 ||
+       py_resp_copy_section(&resp->http_req, &orig->http_req) != 0 ||
+       py_resp_copy_section(&resp->http_resp, &orig->http_resp) != 0)
+    {
+	Py_DECREF(resp);
+
+	return NULL;
+    }
+
+    Py_XINCREF(orig->icap_status);
+    resp->icap_status = orig->icap_status;
+    Py_XINCREF(orig->icap_reason);
+    resp->icap_reason = orig->icap_reason;
+    // a read-only buffer
+    Py_XINCREF(orig->content);
+    resp->content = orig->content;
+    resp->stats.preview = orig->stats.preview;
+
+    return (PyObject *)resp;
+}
+
 static PyObject *
-py_resp_get_header(PyObject *headers, char const *name)
+py_resp_get_value(PyObject *value)
 {
-    if(headers != NULL && PyList_Check(headers))
+    if(value == NULL)
     {
-	Py_ssize_t len = PyList_GET_SIZE(headers);
-	for(Py_ssize_t idx = 0; idx < len; idx++)
-	{
-	    PyObject *py_header = PyList_GET_ITEM(headers, idx);
-	    // not a good (name, value) header?
-	    if(py_header == NULL || !PyTuple_Check(py_header) ||
-	       PyTuple_GET_SIZE(py_header) != 2)
-	    {
-		continue;
-	    }
-	    
-	    PyObject *py_name = PyTuple_GET_ITEM(py_header, 0);
-	    // not a good header key?
-	    if(py_name == NULL || !PyString_Check(py_name))
-	    {
-		continue;
-	    }
-
-	    char const *header_name = PyString_AS_STRING(py_name);
-	    if(header_name != NULL && strcasecmp(header_name, name) == 0)
-	    {
-		PyObject *py_value = PyTuple_GET_ITEM(py_header, 1);
-		Py_XINCREF(py_value);
-
-		return py_value;
-	    }
-	}
+	Py_RETURN_NONE;
     }
-   
-    Py_RETURN_NONE;
+
+    Py_INCREF(value);
+
+    return value;
+}
+
+// the closure of the getters is the offset of their header section
+#define PY_RESP_SECTION(name) ((void *)offsetof(PyICAPResponse, name))
+
+static py_resp_headers_t *
+py_resp_section(PyICAPResponse *resp, void *closure)
+{
+    return (py_resp_headers_t *)((char *)resp + (size_t)closure);
 }
 
 static PyObject *
-py_resp_get_icap_header(PyICAPResponse *resp, PyObject *args)
+py_resp_get_line(PyICAPResponse *resp, void *closure)
 {
-    char *name = NULL;
+    py_resp_headers_t *section = py_resp_section(resp, closure);
 
-    if(!PyArg_ParseTuple(args, "s:get_icap_header", &name))
+    if(py_resp_convert_headers(section) != 0)
     {
 	return NULL;
     }
 
-    return py_resp_get_header(resp->icap_headers, name);
+    return py_resp_get_value(section->line);
 }
 
 static PyObject *
-py_resp_get_http_req_header(PyICAPResponse *resp, PyObject *args)
+py_resp_get_headers(PyICAPResponse *resp, void *closure)
 {
-    char *name = NULL;
+    py_resp_headers_t *section = py_resp_section(resp, closure);
 
-    if(!PyArg_ParseTuple(args, "s:get_http_req_header", &name))
+    if(py_resp_convert_headers(section) != 0)
+    {
+	return NULL;
+    }
+
+    return py_resp_get_value(section->headers);
+}
+
+static PyObject *
+py_resp_get_header_map(PyICAPResponse *resp, void *closure)
+{
+    PyObject *map = (PyObject *)py_resp_get_map(py_resp_section(resp, closure));
+    if(map == NULL)
     {
 	return NULL;
     }
 
-    return py_resp_get_header(resp->http_req_headers, name);
+    Py_INCREF(map);
+
+    return map;
 }
 
+static double
+py_resp_duration(int64_t start, int64_t end)
+{
+    return (start != 0 && end > start) ? (end - start) / 1e9 : 0.0;
+}
 
+// the duration of each phase of the request, in seconds
 static PyObject *
-py_resp_get_http_resp_header(PyICAPResponse *resp, PyObject *args)
+py_resp_get_timings(PyICAPResponse *resp, GCC_UNUSED void *closure)
 {
-    char *name = NULL;
+    py_conn_stats_t const *stats = &resp->stats;
+
+    return Py_BuildValue("{s:d,s:d,s:d,s:d,s:d,s:d}",
+			 "connect", py_resp_duration(stats->start, stats->connected),
+			 "options", py_resp_duration(stats->connected, stats->options),
+			 "upload", py_resp_duration(stats->options, stats->uploaded),
+			 "server", py_resp_duration(stats->uploaded, stats->first_byte),
+			 "download", py_resp_duration(stats->first_byte, stats->end),
+			 "total", py_resp_duration(stats->start, stats->end));
+}
+
+static char const *const py_resp_header_kwlist[] = { "name", "encoding", NULL };
+
+static PyObject *
+py_resp_get_header(py_resp_headers_t *section, char const *fname, PY_FAST_ARGS)
+{
+    PyObject *values[2] = { NULL, NULL };
+    char const *name = NULL;
+    char const *encoding = NULL;
+
+    if(py_args_parse(fname, py_resp_header_kwlist, 1, values) != 0
+       || py_args_string(values[0], "name", &name) != 0
+       || py_args_string(values[1], "encoding", &encoding) != 0)
+    {
+	return NULL;
+    }
+
+    if(name == NULL)
+    {
+	PyErr_Format(PyExc_TypeError, "%s() argument 'name' must be a string", fname);
+
+	return NULL;
+    }
 
-    if(!PyArg_ParseTuple(args, "s:get_http_resp_header", &name))
+    PyICAPHeaders *map = py_resp_get_map(section);
+    if(map == NULL)
     {
 	return NULL;
     }
 
-    return py_resp_get_header(resp->http_resp_headers, name);
+    return py_headers_get(map, name, Py_None, encoding);
+}
+
+static PyObject *
+py_resp_get_icap_header(PyICAPResponse *resp, PY_FAST_ARGS)
+{
+    return py_resp_get_header(&resp->icap, "get_icap_header", PY_FAST_PASS);
+}
+
+static PyObject *
+py_resp_get_http_req_header(PyICAPResponse *resp, PY_FAST_ARGS)
+{
+    return py_resp_get_header(&resp->http_req, "get_http_req_header", PY_FAST_PASS);
+}
+
+static PyObject *
+py_resp_get_http_resp_header(PyICAPResponse *resp, PY_FAST_ARGS)
+{
+    return py_resp_get_header(&resp->http_resp, "get_http_resp_header", PY_FAST_PASS);
 }
 
 static void
@@ -301,11 +504,9 @@ py_resp_dealloc(PyObject *self)
 
     Py_XDECREF(resp->icap_status);
     Py_XDECREF(resp->icap_reason);
-    Py_XDECREF(resp->icap_headers);
-    Py_XDECREF(resp->http_req_line);
-    Py_XDECREF(resp->http_req_headers);
-    Py_XDECREF(resp->http_resp_line);
-    Py_XDECREF(resp->http_resp_headers);
+    py_resp_clear_headers(&resp->icap);
+    py_resp_clear_headers(&resp->http_req);
+    py_resp_clear_headers(&resp->http_resp);
     Py_XDECREF(resp->content);
    
     Py_TYPE(resp)->tp_free(self);
@@ -317,29 +518,55 @@ static PyMemberDef py_resp_members[] =
       READONLY, "ICAP response status" },
     { "icap_reason",  T_OBJECT, offsetof(PyICAPResponse, icap_reason),
       READONLY, "ICAP response reason" },
-    { "icap_headers",  T_OBJECT, offsetof(PyICAPResponse, icap_headers),
-      READONLY, "ICAP response headers" },
-    { "http_req_line",  T_OBJECT, offsetof(PyICAPResponse, http_req_line),
-      READONLY, "HTTP request line" },
-    { "http_req_headers",  T_OBJECT, offsetof(PyICAPResponse, http_req_headers),
-      READONLY, "HTTP request headers" },
-    { "http_resp_line",  T_OBJECT, offsetof(PyICAPResponse, http_resp_line),
-      READONLY, "HTTP response line" },
-    { "http_resp_headers",  T_OBJECT, offsetof(PyICAPResponse, http_resp_headers),
-      READONLY, "HTTP response headers" },
     { "content",  T_OBJECT, offsetof(PyICAPResponse, content),
       READONLY, "HTTP response content" },
+    { "body_bytes_sent",  T_PYSSIZET, offsetof(PyICAPResponse, stats.body_bytes_sent),
+      READONLY, "number of request body bytes sent to the server" },
+    { "body_bytes_received",  T_PYSSIZET, offsetof(PyICAPResponse, stats.body_bytes_received),
+      READONLY, "number of response body bytes received from the server" },
+    { "body_bytes_skipped",  T_PYSSIZET, offsetof(PyICAPResponse, stats.body_bytes_skipped),
+      READONLY, "number of response body bytes drained without being kept" },
+    { "bytes_sent",  T_LONGLONG, offsetof(PyICAPResponse, stats.bytes_sent),
+      READONLY, "number of ICAP bytes sent to the server" },
+    { "bytes_received",  T_LONGLONG, offsetof(PyICAPResponse, stats.bytes_received),
+      READONLY, "number of ICAP bytes received from the server" },
+    { "preview",  T_INT, offsetof(PyICAPResponse, stats.preview),
+      READONLY, "preview size used for the request (-1 without preview)" },
+    { .name = NULL }
+};
+
+// the headers are only converted to Python objects when accessed
+static PyGetSetDef py_resp_getset[] =
+{
+    { "icap_headers", (getter)py_resp_get_headers, NULL,
+      "ICAP response headers", PY_RESP_SECTION(icap) },
+    { "icap_header_map", (getter)py_resp_get_header_map, NULL,
+      "ICAP response headers, indexed by name", PY_RESP_SECTION(icap) },
+    { "http_req_line", (getter)py_resp_get_line, NULL,
+      "HTTP request line", PY_RESP_SECTION(http_req) },
+    { "http_req_headers", (getter)py_resp_get_headers, NULL,
+      "HTTP request headers", PY_RESP_SECTION(http_req) },
+    { "http_req_header_map", (getter)py_resp_get_header_map, NULL,
+      "HTTP request headers, indexed by name", PY_RESP_SECTION(http_req) },
+    { "http_resp_line", (getter)py_resp_get_line, NULL,
+      "HTTP response line", PY_RESP_SECTION(http_resp) },
+    { "http_resp_headers", (getter)py_resp_get_headers, NULL,
+      "HTTP response headers", PY_RESP_SECTION(http_resp) },
+    { "http_resp_header_map", (getter)py_resp_get_header_map, NULL,
+      "HTTP response headers, indexed by name", PY_RESP_SECTION(http_resp) },
+    { "timings", (getter)py_resp_get_timings, NULL,
+      "duration of each request phase, in seconds", NULL },
     { .name = NULL }
 };
 
 static struct PyMethodDef py_resp_methods[] =
 {
-    { "get_icap_header", (PyCFunction)py_resp_get_icap_header,
-      METH_VARARGS, "Get the value associated with an ICAP response header" },
-    { "get_http_req_header", (PyCFunction)py_resp_get_http_req_header,
-      METH_VARARGS, "Get the value associated with an HTTP request header" },
-    { "get_http_resp_header", (PyCFunction)py_resp_get_http_resp_header,
-      METH_VARARGS, "Get the value associated with an HTTP response header" },
+    { "get_icap_header", (PyCFunction)(void (*)(void))py_resp_get_icap_header,
+      PY_METH_FAST, "Get the value associated with an ICAP response header" },
+    { "get_http_req_header", (PyCFunction)(void (*)(void))py_resp_get_http_req_header,
+      PY_METH_FAST, "Get the value associated with an HTTP request header" },
+    { "get_http_resp_header", (PyCFunction)(void (*)(void))py_resp_get_http_resp_header,
+      PY_METH_FAST, "Get the value associated with an HTTP response header" },
     { .ml_name = NULL }
 };
 
@@ -352,6 +579,7 @@ PyTypeObject PyICAPResponseType =
     .tp_flags = Py_TPFLAGS_DEFAULT,
     .tp_doc = "ICAP Response",
     .tp_members = py_resp_members,
+    .tp_getset = py_resp_getset,
     .tp_methods = py_resp_methods,
     .tp_alloc = PyType_GenericAlloc,
     .tp_free = PyObject_Del
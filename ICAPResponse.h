@@ -17,25 +17,37 @@
 #ifndef PY_ICAP_RESPONSE_H
 #define PY_ICAP_RESPONSE_H
 
-#include <Python.h>
+#include "py_compat.h"
 
 #include "ICAPConnection.h"
 
+// a header section, converted to Python objects on the first access
+typedef struct
+{
+    // the raw lines, owned by the mapping once it is built
+    int count;
+    char **lines;
+    PyObject *map;
+    int converted;
+    PyObject *line;
+    PyObject *headers;
+} py_resp_headers_t;
+
 typedef struct
 {
     PyObject_HEAD
     PyObject *icap_status;
     PyObject *icap_reason;
-    PyObject *icap_headers;
-    PyObject *http_req_line;
-    PyObject *http_req_headers;
-    PyObject *http_resp_line;
-    PyObject *http_resp_headers;
+    py_resp_headers_t icap;
+    py_resp_headers_t http_req;
+    py_resp_headers_t http_resp;
     PyObject *content;
+    py_conn_stats_t stats;
 } PyICAPResponse;
 
 PyTypeObject PyICAPResponseType;
 
-PyObject *py_resp_new(PyICAPConnection *conn);
+PyObject *py_resp_new(ci_request_t *req, int status, py_conn_stats_t const *stats, PyObject *content);
+PyObject *py_resp_copy(PyObject *obj);
 
 #endif // PY_ICAP_RESPONSE_H
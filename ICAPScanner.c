@@ -0,0 +1,747 @@
+/* -*- Mode: C; c-basic-offset: 4 -*- */
+/*
+ * Copyright 2015 Vincent Rasneur <vrasneur@free.fr>
+ * All Rights Reserved.
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation, version 3.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ *   NON INFRINGEMENT.  See the GNU General Public License for
+ *   more details.
+ */
+
+#include "ICAPScanner.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gcc_attributes.h"
+#include "timeutil.h"
+#include "ICAPResponse.h"
+
+// default values
+#define ICAP_DEFAULT_PORT 1344
+#define ICAP_DEFAULT_SERVICE "avscan"
+// in seconds
+#define ICAP_DEFAULT_TIMEOUT 300
+#define ICAP_SCANNER_DEFAULT_WORKERS 4
+#define ICAP_SCANNER_DEFAULT_QUEUE_SIZE 1024
+
+#define py_future_from_node(n) \
+    ((PyICAPFuture *)((char *)(n) - offsetof(PyICAPFuture, node)))
+
+// default exception
+extern PyObject *PyICAP_Exc;
+
+static void
+py_sem_wait(sem_t *sem)
+{
+    while(sem_wait(sem) != 0 && errno == EINTR)
+    {
+	continue;
+    }
+}
+
+// called by the worker threads, or by the shutdown code
+static void
+py_scanner_complete(PyICAPScanner *scanner, PyICAPFuture *fut)
+{
+    __atomic_store_n(&fut->done, 1, __ATOMIC_RELEASE);
+
+    // the Python thread may drop the future as soon as it is on the stack:
+    // this is the last access to it, only the scanner is touched afterwards
+    lf_stack_push(&scanner->completed, &fut->node);
+
+    // one byte is enough to wake up the event loop until the next poll
+    if(__atomic_exchange_n(&scanner->notified, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+	char byte = 0;
+	ssize_t ret GCC_UNUSED = write(scanner->notify_fds[1], &byte, 1);
+    }
+
+    pthread_mutex_lock(&scanner->lock);
+    pthread_cond_broadcast(&scanner->cond);
+    pthread_mutex_unlock(&scanner->lock);
+}
+
+static void *
+py_scanner_worker(void *arg)
+{
+    PyICAPScanner *scanner = arg;
+    // each worker has its own keep-alive connection
+    ci_connection_t *conn = NULL;
+
+    for(;;)
+    {
+	py_sem_wait(&scanner->pending);
+
+	if(__atomic_load_n(&scanner->closing, __ATOMIC_ACQUIRE))
+	{
+	    break;
+	}
+
+	PyICAPFuture *fut = lf_queue_pop(&scanner->queue);
+	if(fut == NULL)
+	{
+	    continue;
+	}
+
+	sem_post(&scanner->slots);
+
+	py_conn_job_run(&fut->job, &conn);
+
+	// do not send the next request on a closed or broken socket
+	if(!fut->job.keepalive && conn != NULL)
+	{
+	    py_conn_destroy_connection(conn), conn = NULL;
+	}
+
+	py_scanner_complete(scanner, fut);
+    }
+
+    if(conn != NULL)
+    {
+	py_conn_destroy_connection(conn), conn = NULL;
+    }
+
+    return NULL;
+}
+
+// build the response or the exception, must be called with the GIL held
+static void
+py_future_finish(PyICAPFuture *fut)
+{
+    PyObject *content = NULL;
+
+    if(fut->finished)
+    {
+	return;
+    }
+
+    if(fut->cancelled)
+    {
+	PyErr_SetString(PyICAP_Exc, "The ICAP scanner is closed");
+    }
+    else if(fut->job.error == PY_CONN_OK && py_conn_job_finish(&fut->job, &content) == 0)
+    {
+	fut->result = py_resp_new(fut->job.req, fut->job.status, &fut->job.stats, content);
+	Py_XDECREF(content);
+    }
+    else
+    {
+	py_conn_job_set_error(&fut->job);
+    }
+
+    if(fut->result == NULL)
+    {
+	if(!PyErr_Occurred())
+	{
+	    PyErr_SetString(PyICAP_Exc, "Cannot create the ICAP response object");
+	}
+
+	fut->result = py_conn_fetch_error();
+	fut->failed = 1;
+    }
+
+    py_conn_job_clear(&fut->job);
+    fut->scanner = NULL;
+    fut->finished = 1;
+}
+
+// empty the notification pipe before taking the completed futures
+static void
+py_scanner_clear_notify(PyICAPScanner *scanner)
+{
+    char buf[64];
+
+    __atomic_store_n(&scanner->notified, 0, __ATOMIC_RELEASE);
+
+    while(read(scanner->notify_fds[0], buf, sizeof(buf)) > 0)
+    {
+	continue;
+    }
+}
+
+// finish the completed futures, and run their callbacks if asked to
+static int
+py_scanner_process(PyICAPScanner *scanner, int run_callbacks)
+{
+    py_scanner_clear_notify(scanner);
+
+    lf_stack_node_t *node = lf_stack_take_all(&scanner->completed);
+    int count = 0;
+
+    while(node != NULL)
+    {
+	PyICAPFuture *fut = py_future_from_node(node);
+
+	node = node->next;
+	py_future_finish(fut);
+
+	if(run_callbacks && fut->callback != NULL)
+	{
+	    PyObject *callback = fut->callback;
+	    fut->callback = NULL;
+
+	    PyObject *res = PyObject_CallFunctionObjArgs(callback, (PyObject *)fut, NULL);
+	    if(res == NULL)
+	    {
+		PyErr_WriteUnraisable(callback);
+	    }
+
+	    Py_XDECREF(res);
+	    Py_DECREF(callback);
+	}
+
+	// drop the reference taken at submission
+	Py_DECREF(fut);
+	count++;
+    }
+
+    return count;
+}
+
+// stop the workers and cancel the queued requests, must be called with the GIL held
+static void
+py_scanner_shutdown(PyICAPScanner *scanner)
+{
+    if(scanner->workers == NULL)
+    {
+	return;
+    }
+
+    __atomic_store_n(&scanner->closing, 1, __ATOMIC_RELEASE);
+
+    for(int idx = 0; idx < scanner->nworkers; idx++)
+    {
+	sem_post(&scanner->pending);
+    }
+
+    // the workers may need the GIL to write in a Python sink
+    Py_BEGIN_ALLOW_THREADS
+    for(int idx = 0; idx < scanner->nworkers; idx++)
+    {
+	pthread_join(scanner->workers[idx], NULL);
+    }
+    Py_END_ALLOW_THREADS
+
+    free(scanner->workers), scanner->workers = NULL;
+    scanner->nworkers = 0;
+
+    PyICAPFuture *fut = NULL;
+    while((fut = lf_queue_pop(&scanner->queue)) != NULL)
+    {
+	fut->cancelled = 1;
+	py_scanner_complete(scanner, fut);
+    }
+
+    // wake up the threads waiting for a free slot
+    for(size_t idx = 0; idx < lf_queue_capacity(&scanner->queue); idx++)
+    {
+	sem_post(&scanner->slots);
+    }
+}
+
+static PyObject *
+py_scanner_new(PyTypeObject *type, GCC_UNUSED PyObject *args, GCC_UNUSED PyObject *kwds)
+{
+    PyObject *self = type->tp_alloc(type, 0);
+    PyICAPScanner *scanner = (PyICAPScanner *)self;
+
+    // should already be set to 0 by the alloc call
+    scanner->host = NULL;
+    scanner->workers = NULL;
+    scanner->completed = NULL;
+    scanner->notify_fds[0] = -1;
+    scanner->notify_fds[1] = -1;
+    scanner->notified = 0;
+    scanner->ready = 0;
+    scanner->closing = 0;
+
+    return self;
+}
+
+static int
+py_scanner_init(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    PyICAPScanner *scanner = (PyICAPScanner *)self;
+    char *host = NULL;
+    int port = ICAP_DEFAULT_PORT;
+    int workers = ICAP_SCANNER_DEFAULT_WORKERS;
+    int proto = AF_UNSPEC;
+    int queue_size = ICAP_SCANNER_DEFAULT_QUEUE_SIZE;
+
+    static char *kwlist[] = { "host", "port", "workers", "proto", "queue_size", NULL };
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "s|iiii", kwlist,
+				    &host, &port, &workers, &proto, &queue_size))
+    {
+	return -1;
+    }
+
+    if(port < 0 || port > 0xffff)
+    {
+	PyErr_SetString(PyExc_OverflowError, "Port must be 0-65535");
+
+	return -1;
+    }
+
+    if(proto != AF_UNSPEC && proto != AF_INET && proto != AF_INET6)
+    {
+	PyErr_SetString(PyExc_ValueError, "Proto must either be AF_UNSPEC, AF_INET or AF_INET6");
+
+	return -1;
+    }
+
+    if(workers <= 0 || queue_size <= 0)
+    {
+	PyErr_SetString(PyExc_ValueError, "Workers and queue size must have a positive value");
+
+	return -1;
+    }
+
+    if(scanner->ready)
+    {
+	PyErr_SetString(PyICAP_Exc, "The ICAP scanner is already initialized");
+
+	return -1;
+    }
+
+    if(pipe2(scanner->notify_fds, O_NONBLOCK | O_CLOEXEC) != 0)
+    {
+	PyErr_SetFromErrno(PyExc_OSError);
+
+	return -1;
+    }
+
+    scanner->host = strdup(host);
+    if(scanner->host == NULL || lf_queue_init(&scanner->queue, queue_size) != 0)
+    {
+	free(scanner->host), scanner->host = NULL;
+	PyErr_NoMemory();
+
+	return -1;
+    }
+
+    scanner->port = port;
+    scanner->proto = proto;
+
+    sem_init(&scanner->pending, 0, 0);
+    sem_init(&scanner->slots, 0, lf_queue_capacity(&scanner->queue));
+    pthread_mutex_init(&scanner->lock, NULL);
+    py_time_cond_init(&scanner->cond);
+    scanner->ready = 1;
+
+    // the workers may reacquire the GIL from their own threads
+#if PY_VERSION_HEX < 0x03070000
+    PyEval_InitThreads();
+#endif
+
+    scanner->workers = calloc(workers, sizeof(pthread_t));
+    if(scanner->workers == NULL)
+    {
+	PyErr_NoMemory();
+
+	return -1;
+    }
+
+    for(; scanner->nworkers < workers; scanner->nworkers++)
+    {
+	if(pthread_create(&scanner->workers[scanner->nworkers], NULL,
+			  py_scanner_worker, scanner) != 0)
+	{
+	    PyErr_SetString(PyICAP_Exc, "Cannot start the ICAP scanner workers");
+	    py_scanner_shutdown(scanner);
+
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+static void
+py_scanner_dealloc(PyObject *self)
+{
+    PyICAPScanner *scanner = (PyICAPScanner *)self;
+
+    if(scanner->ready)
+    {
+	py_scanner_shutdown(scanner);
+	// nobody can poll anymore: drop the callbacks
+	py_scanner_process(scanner, 0);
+
+	lf_queue_destroy(&scanner->queue);
+	sem_destroy(&scanner->pending);
+	sem_destroy(&scanner->slots);
+	pthread_cond_destroy(&scanner->cond);
+	pthread_mutex_destroy(&scanner->lock);
+	scanner->ready = 0;
+    }
+
+    for(int idx = 0; idx < 2; idx++)
+    {
+	if(scanner->notify_fds[idx] >= 0)
+	{
+	    close(scanner->notify_fds[idx]), scanner->notify_fds[idx] = -1;
+	}
+    }
+
+    free(scanner->host), scanner->host = NULL;
+
+    Py_TYPE(scanner)->tp_free(self);
+}
+
+static PyICAPFuture *
+py_future_alloc(void)
+{
+    PyICAPFuture *fut = PyObject_New(PyICAPFuture, &PyICAPFutureType);
+    if(fut == NULL)
+    {
+	return NULL;
+    }
+
+    fut->node.next = NULL;
+    py_conn_job_init(&fut->job);
+    fut->scanner = NULL;
+    fut->service = NULL;
+    fut->url = NULL;
+    fut->callback = NULL;
+    fut->result = NULL;
+    fut->done = 0;
+    fut->cancelled = 0;
+    fut->finished = 0;
+    fut->failed = 0;
+
+    return fut;
+}
+
+static PyObject *
+py_scanner_submit(PyICAPScanner *scanner, PyObject *args, PyObject *kwds)
+{
+    char *type = NULL;
+    PyObject *source = NULL;
+    PyObject *data = NULL;
+    PyObject *sink = NULL;
+    PyObject *callback = NULL;
+    PyObject *preview = NULL;
+    PyObject *req_headers = NULL;
+    PyObject *resp_headers = NULL;
+    PyObject *body = NULL;
+    PyObject *max_memory_content = NULL;
+    char *service = ICAP_DEFAULT_SERVICE;
+    char *url = "/";
+    int timeout = ICAP_DEFAULT_TIMEOUT;
+    int read_content = 1;
+
+    static char *kwlist[] = { "type", "filename", "url", "service", "timeout", "read_content",
+			      "data", "sink", "callback", "preview", "req_headers", "resp_headers", "body",
+			      "max_memory_content", NULL };
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "s|OssiiOOOOOOOO:submit", kwlist,
+				    &type, &source, &url, &service, &timeout, &read_content,
+				    &data, &sink, &callback, &preview, &req_headers, &resp_headers, &body,
+				    &max_memory_content))
+    {
+	return NULL;
+    }
+
+    if(callback == Py_None)
+    {
+	callback = NULL;
+    }
+
+    if(callback != NULL && !PyCallable_Check(callback))
+    {
+	PyErr_SetString(PyExc_TypeError, "Callback must be callable");
+
+	return NULL;
+    }
+
+    if(scanner->workers == NULL)
+    {
+	PyErr_SetString(PyICAP_Exc, "The ICAP scanner is closed");
+
+	return NULL;
+    }
+
+    PyICAPFuture *fut = py_future_alloc();
+    if(fut == NULL)
+    {
+	return NULL;
+    }
+
+    // the strings must live as long as the request
+    fut->service = strdup(service);
+    fut->url = strdup(url);
+    if(fut->service == NULL || fut->url == NULL)
+    {
+	PyErr_NoMemory();
+
+	goto py_scanner_submit_error;
+    }
+
+    fut->job.host = scanner->host;
+    fut->job.port = scanner->port;
+    fut->job.proto = scanner->proto;
+    fut->job.service = fut->service;
+    fut->job.url = fut->url;
+
+    if(py_conn_job_setup(&fut->job, type, source, data, sink, timeout, read_content, preview) != 0 ||
+       py_conn_job_set_headers(&fut->job, req_headers, resp_headers) != 0 ||
+       py_conn_job_set_body(&fut->job, body, max_memory_content) != 0)
+    {
+	goto py_scanner_submit_error;
+    }
+
+    // wait for a free slot in the queue
+    if(sem_trywait(&scanner->slots) != 0)
+    {
+	Py_BEGIN_ALLOW_THREADS
+	py_sem_wait(&scanner->slots);
+	Py_END_ALLOW_THREADS
+    }
+
+    // the scanner may have been closed by another thread in the meantime
+    if(scanner->workers == NULL)
+    {
+	PyErr_SetString(PyICAP_Exc, "The ICAP scanner is closed");
+
+	goto py_scanner_submit_error;
+    }
+
+    Py_XINCREF(callback);
+    fut->callback = callback;
+    fut->scanner = scanner;
+
+    // this reference is dropped when the future is processed
+    Py_INCREF(fut);
+    lf_queue_push(&scanner->queue, fut);
+    sem_post(&scanner->pending);
+
+    return (PyObject *)fut;
+
+py_scanner_submit_error:
+
+    Py_DECREF(fut);
+
+    return NULL;
+}
+
+static PyObject *
+py_scanner_poll(PyICAPScanner *scanner, PyObject *args, PyObject *kwds)
+{
+    PyObject *py_timeout = NULL;
+    double timeout = 0;
+
+    static char *kwlist[] = { "timeout", NULL };
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "|O:poll", kwlist, &py_timeout))
+    {
+	return NULL;
+    }
+
+    if(py_timeout != NULL && py_conn_parse_timeout(py_timeout, &timeout) != 0)
+    {
+	return NULL;
+    }
+
+    // wait for a completion, if asked to
+    if(timeout != 0 && scanner->ready &&
+       __atomic_load_n(&scanner->completed, __ATOMIC_ACQUIRE) == NULL)
+    {
+	struct timespec deadline;
+
+	Py_BEGIN_ALLOW_THREADS
+	py_time_deadline(&deadline, timeout);
+
+	pthread_mutex_lock(&scanner->lock);
+	while(__atomic_load_n(&scanner->completed, __ATOMIC_ACQUIRE) == NULL)
+	{
+	    if(timeout < 0)
+	    {
+		pthread_cond_wait(&scanner->cond, &scanner->lock);
+	    }
+	    else if(pthread_cond_timedwait(&scanner->cond, &scanner->lock, &deadline) == ETIMEDOUT)
+	    {
+		break;
+	    }
+	}
+	pthread_mutex_unlock(&scanner->lock);
+	Py_END_ALLOW_THREADS
+    }
+
+    int count = py_scanner_process(scanner, 1);
+
+    return PyInt_FromLong(count);
+}
+
+static PyObject *
+py_scanner_fileno(PyICAPScanner *scanner)
+{
+    if(scanner->notify_fds[0] < 0)
+    {
+	PyErr_SetString(PyICAP_Exc, "The ICAP scanner is not initialized");
+
+	return NULL;
+    }
+
+    return PyInt_FromLong(scanner->notify_fds[0]);
+}
+
+static PyObject *
+py_scanner_close(PyICAPScanner *scanner)
+{
+    // the cancelled requests are reported by the next poll
+    py_scanner_shutdown(scanner);
+
+    Py_RETURN_NONE;
+}
+
+static struct PyMethodDef py_scanner_methods[] =
+{
+    { "submit", (PyCFunction)py_scanner_submit,
+      METH_VARARGS | METH_KEYWORDS, "queue an ICAP request, and return its future" },
+    { "poll", (PyCFunction)py_scanner_poll,
+      METH_VARARGS | METH_KEYWORDS, "process the finished requests and run their callbacks" },
+    { "fileno", (PyCFunction)py_scanner_fileno,
+      METH_NOARGS, "get the file descriptor readable when some requests are finished, for event loops" },
+    { "close", (PyCFunction)py_scanner_close,
+      METH_NOARGS, "stop the workers and cancel the queued requests" },
+    { .ml_name = NULL }
+};
+
+PyTypeObject PyICAPScannerType =
+{
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "icapclient.ICAPScanner",
+    sizeof(PyICAPScanner),
+    .tp_dealloc = py_scanner_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "pool of native threads running ICAP requests, with a completion descriptor for event loops",
+    .tp_methods = py_scanner_methods,
+    .tp_new = py_scanner_new,
+    .tp_init = py_scanner_init,
+    .tp_alloc = PyType_GenericAlloc,
+    .tp_free = PyObject_Del
+};
+
+static PyObject *
+py_future_done(PyICAPFuture *fut)
+{
+    return PyBool_FromLong(fut->finished || __atomic_load_n(&fut->done, __ATOMIC_ACQUIRE));
+}
+
+static PyObject *
+py_future_result(PyICAPFuture *fut, PyObject *args, PyObject *kwds)
+{
+    PyObject *py_timeout = NULL;
+    double timeout = -1;
+
+    static char *kwlist[] = { "timeout", NULL };
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "|O:result", kwlist, &py_timeout))
+    {
+	return NULL;
+    }
+
+    if(py_conn_parse_timeout(py_timeout, &timeout) != 0)
+    {
+	return NULL;
+    }
+
+    if(!fut->finished && !__atomic_load_n(&fut->done, __ATOMIC_ACQUIRE))
+    {
+	PyICAPScanner *scanner = fut->scanner;
+	struct timespec deadline;
+
+	// the scanner must stay alive while waiting
+	Py_INCREF(scanner);
+
+	Py_BEGIN_ALLOW_THREADS
+	py_time_deadline(&deadline, timeout);
+
+	pthread_mutex_lock(&scanner->lock);
+	while(!__atomic_load_n(&fut->done, __ATOMIC_ACQUIRE))
+	{
+	    if(timeout < 0)
+	    {
+		pthread_cond_wait(&scanner->cond, &scanner->lock);
+	    }
+	    else if(pthread_cond_timedwait(&scanner->cond, &scanner->lock, &deadline) == ETIMEDOUT)
+	    {
+		break;
+	    }
+	}
+	pthread_mutex_unlock(&scanner->lock);
+	Py_END_ALLOW_THREADS
+
+	Py_DECREF(scanner);
+    }
+
+    if(!fut->finished)
+    {
+	if(!__atomic_load_n(&fut->done, __ATOMIC_ACQUIRE))
+	{
+	    PyErr_SetString(PyICAP_Exc, "The ICAP request is not finished");
+
+	    return NULL;
+	}
+
+	py_future_finish(fut);
+    }
+
+    if(fut->failed)
+    {
+	PyErr_SetObject((PyObject *)Py_TYPE(fut->result), fut->result);
+
+	return NULL;
+    }
+
+    Py_INCREF(fut->result);
+
+    return fut->result;
+}
+
+static void
+py_future_dealloc(PyObject *self)
+{
+    PyICAPFuture *fut = (PyICAPFuture *)self;
+
+    py_conn_job_clear(&fut->job);
+    free(fut->service), fut->service = NULL;
+    free(fut->url), fut->url = NULL;
+    Py_XDECREF(fut->callback);
+    Py_XDECREF(fut->result);
+
+    Py_TYPE(fut)->tp_free(self);
+}
+
+static struct PyMethodDef py_future_methods[] =
+{
+    { "done", (PyCFunction)py_future_done,
+      METH_NOARGS, "check if the ICAP request is over" },
+    { "result", (PyCFunction)py_future_result,
+      METH_VARARGS | METH_KEYWORDS, "wait for the ICAP response, or raise the request exception" },
+    { .ml_name = NULL }
+};
+
+PyTypeObject PyICAPFutureType =
+{
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "icapclient.ICAPFuture",
+    sizeof(PyICAPFuture),
+    .tp_dealloc = py_future_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "pending ICAP request",
+    .tp_methods = py_future_methods,
+    .tp_alloc = PyType_GenericAlloc,
+    .tp_free = PyObject_Del
+};
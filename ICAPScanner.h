@@ -0,0 +1,78 @@
+/* -*- Mode: C; c-basic-offset: 4 -*- */
+/*
+ * Copyright 2015 Vincent Rasneur <vrasneur@free.fr>
+ * All Rights Reserved.
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation, version 3.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ *   NON INFRINGEMENT.  See the GNU General Public License for
+ *   more details.
+ */
+
+#ifndef PY_ICAP_SCANNER_H
+#define PY_ICAP_SCANNER_H
+
+#include "py_compat.h"
+
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "lockfree.h"
+#include "ICAPConnection.h"
+
+struct PyICAPScanner;
+
+typedef struct
+{
+    PyObject_HEAD
+    // link in the completed futures stack
+    lf_stack_node_t node;
+    py_conn_job_t job;
+    // the scanner running the request, NULL once the future is finished
+    struct PyICAPScanner *scanner;
+    char *service;
+    char *url;
+    PyObject *callback;
+    // the response, or the exception
+    PyObject *result;
+    // set by the worker thread when the request is over
+    int done;
+    int cancelled;
+    // the result is available, protected by the GIL
+    int finished;
+    int failed;
+} PyICAPFuture;
+
+typedef struct PyICAPScanner
+{
+    PyObject_HEAD
+    char *host;
+    int port;
+    int proto;
+    int nworkers;
+    pthread_t *workers;
+    // the submitted futures
+    lf_queue_t queue;
+    sem_t pending;
+    sem_t slots;
+    // the futures processed by the workers
+    lf_stack_node_t *completed;
+    // readable when some futures are completed, for event loops
+    int notify_fds[2];
+    int notified;
+    // protects the waits for a completion
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int ready;
+    int closing;
+} PyICAPScanner;
+
+PyTypeObject PyICAPScannerType;
+PyTypeObject PyICAPFutureType;
+
+#endif // PY_ICAP_SCANNER_H
@@ -0,0 +1,300 @@
+#!/usr/bin/env python
+# -*- mode: python; coding: utf-8 -*-
+
+"""A small ICAP server for the benchmarks.
+
+It answers OPTIONS requests, then REQMOD and RESPMOD requests either with
+a 204 response (when the client allows it) or with an echo of the body.
+
+Two modes answer before reading the whole body, like some real servers do:
+"stream" echoes each chunk as soon as it is read, and "early" blocks the
+content from its headers only, then closes the connection.
+"""
+
+from __future__ import print_function
+
+import argparse
+import socket
+import sys
+import time
+
+try:
+    import socketserver
+except ImportError:
+    import SocketServer as socketserver
+
+
+class ICAPError(Exception):
+    pass
+
+
+class ICAPHandler(socketserver.StreamRequestHandler):
+
+    def read_line(self):
+        line = self.rfile.readline(65536)
+        if not line:
+            raise EOFError()
+
+        return line.decode('latin-1').rstrip('\r\n')
+
+    def read_headers(self):
+        lines = []
+
+        while True:
+            line = self.read_line()
+            if not line:
+                return lines
+
+            lines.append(line)
+
+    def read_chunk(self):
+        # return the chunk data, None for the last chunk, and whether it has ieof
+        size_line = self.read_line()
+        size, _, ext = size_line.partition(';')
+        size = int(size.strip(), 16)
+
+        if size == 0:
+            # the empty line after the last chunk
+            self.read_line()
+
+            return None, ext.strip() == 'ieof'
+
+        data = self.rfile.read(size)
+        self.rfile.read(2)
+
+        return data, False
+
+    def read_chunks(self):
+        # return the body and whether the preview ended with ieof
+        chunks = []
+
+        while True:
+            data, ieof = self.read_chunk()
+            if data is None:
+                return b''.join(chunks), ieof
+
+            chunks.append(data)
+
+    def send(self, data):
+        self.wfile.write(data)
+        self.wfile.flush()
+
+    def send_options(self):
+        config = self.server.config
+        lines = ['ICAP/1.0 200 OK',
+                 'Methods: REQMOD, RESPMOD',
+                 'Service: mock ICAP server',
+                 'ISTag: "%s"' % config.istag,
+                 'Allow: 204',
+                 'Options-TTL: %d' % config.options_ttl,
+                 'Max-Connections: 1000',
+                 'Encapsulated: null-body=0']
+
+        if config.preview >= 0:
+            lines.append('Preview: %d' % config.preview)
+            lines.append('Transfer-Preview: *')
+
+        self.send(('\r\n'.join(lines) + '\r\n\r\n').encode('latin-1'))
+
+    def send_echo(self, body):
+        http = ('HTTP/1.1 200 OK\r\n'
+                'Content-Length: %d\r\n\r\n' % len(body)).encode('latin-1')
+        icap = ('ICAP/1.0 200 OK\r\n'
+                'ISTag: "%s"\r\n'
+                'Encapsulated: res-hdr=0, res-body=%d\r\n\r\n'
+                % (self.server.config.istag, len(http))).encode('latin-1')
+        chunk = b''
+
+        if body:
+            chunk = ('%x\r\n' % len(body)).encode('latin-1') + body + b'\r\n'
+
+        self.send(icap + http + chunk + b'0\r\n\r\n')
+
+    def send_chunk(self, data):
+        if data:
+            self.send(('%x\r\n' % len(data)).encode('latin-1') + data + b'\r\n')
+
+    def send_stream(self, preview):
+        # the response starts before the body is read, then each chunk is echoed
+        # as soon as it arrives: a client that sends the whole body before
+        # reading anything fills both socket buffers and hangs
+        body, ieof = b'', False
+
+        if preview:
+            body, ieof = self.read_chunks()
+
+            if not ieof:
+                self.send(b'ICAP/1.0 100 Continue\r\n\r\n')
+
+        http = b'HTTP/1.1 200 OK\r\n\r\n'
+        self.send(('ICAP/1.0 200 OK\r\n'
+                   'ISTag: "%s"\r\n'
+                   'Encapsulated: res-hdr=0, res-body=%d\r\n\r\n'
+                   % (self.server.config.istag, len(http))).encode('latin-1') + http)
+        self.send_chunk(body)
+
+        while not ieof:
+            data, _ = self.read_chunk()
+            if data is None:
+                break
+
+            self.send_chunk(data)
+
+        self.send(b'0\r\n\r\n')
+
+    def send_early(self):
+        # block the content without reading its body, then close the connection
+        # once the client stopped sending
+        page = b'blocked by the mock ICAP server\n'
+        http = ('HTTP/1.1 403 Forbidden\r\n'
+                'Content-Length: %d\r\n\r\n' % len(page)).encode('latin-1')
+        icap = ('ICAP/1.0 200 OK\r\n'
+                'ISTag: "%s"\r\n'
+                'Connection: close\r\n'
+                'Encapsulated: res-hdr=0, res-body=%d\r\n\r\n'
+                % (self.server.config.istag, len(http))).encode('latin-1')
+
+        self.send(icap + http + ('%x\r\n' % len(page)).encode('latin-1') + page + b'\r\n0\r\n\r\n')
+
+        # a close with unread data resets the connection, maybe before the
+        # client reads the response: drain what is still coming
+        self.connection.shutdown(socket.SHUT_WR)
+        while self.connection.recv(65536):
+            pass
+
+    def send_204(self):
+        self.send(('ICAP/1.0 204 No Content\r\n'
+                   'ISTag: "%s"\r\n'
+                   'Encapsulated: null-body=0\r\n\r\n' % self.server.config.istag).encode('latin-1'))
+
+    def handle_request(self, headers):
+        # returns True when the connection must be closed
+        config = self.server.config
+        encapsulated = headers.get('encapsulated', '')
+        sections = []
+
+        for part in encapsulated.split(','):
+            name, _, offset = part.strip().partition('=')
+            sections.append((name, int(offset)))
+
+        # the encapsulated HTTP headers come before the body
+        body_offset = sections[-1][1] if sections else 0
+        if body_offset > 0:
+            self.rfile.read(body_offset)
+
+        has_body = sections and sections[-1][0] in ('req-body', 'res-body')
+        body = b''
+        ieof = True
+        allow204 = '204' in headers.get('allow', '')
+        preview = 'preview' in headers
+
+        # these modes answer before the body is read
+        if config.mode == 'early' or (config.mode == 'stream' and has_body):
+            if config.latency > 0:
+                time.sleep(config.latency)
+
+            if config.mode == 'early':
+                self.send_early()
+
+                return True
+
+            self.send_stream(preview)
+
+            return False
+
+        if has_body:
+            body, ieof = self.read_chunks()
+
+        if config.latency > 0:
+            time.sleep(config.latency)
+
+        # clean content: answer after the preview, without reading the rest
+        if config.mode == '204' and allow204:
+            self.send_204()
+
+            return False
+
+        if preview and not ieof:
+            self.send(b'ICAP/1.0 100 Continue\r\n\r\n')
+            rest, _ = self.read_chunks()
+            body += rest
+
+        # also when a 204 is not allowed
+        self.send_echo(body)
+
+        return False
+
+    def handle(self):
+        try:
+            while True:
+                request_line = self.read_line()
+                if not request_line:
+                    continue
+
+                method = request_line.split(' ', 1)[0]
+                headers = {}
+
+                for line in self.read_headers():
+                    name, _, value = line.partition(':')
+                    headers[name.strip().lower()] = value.strip()
+
+                if method == 'OPTIONS':
+                    self.send_options()
+                elif method in ('REQMOD', 'RESPMOD'):
+                    if self.handle_request(headers):
+                        return
+                else:
+                    raise ICAPError('unknown method %s' % method)
+
+                if headers.get('connection', '').lower() == 'close':
+                    return
+        except (EOFError, ICAPError, ValueError, socket.error):
+            return
+
+
+class ICAPServer(socketserver.ThreadingMixIn, socketserver.TCPServer):
+    allow_reuse_address = True
+    daemon_threads = True
+
+    def __init__(self, address, config):
+        socketserver.TCPServer.__init__(self, address, ICAPHandler)
+        self.config = config
+
+
+def parse_args(argv=None):
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--host', default='127.0.0.1')
+    parser.add_argument('--port', type=int, default=13440,
+                        help='listening port, 0 for any free port')
+    parser.add_argument('--mode', choices=('echo', '204', 'stream', 'early'), default='echo',
+                        help='echo the body, answer 204 when the client allows it, '
+                        'echo each chunk while the body is read, or block the content '
+                        'before reading its body')
+    parser.add_argument('--preview', type=int, default=1024,
+                        help='preview size sent in the OPTIONS response, -1 to disable previews')
+    parser.add_argument('--latency', type=float, default=0.0,
+                        help='delay in seconds before each response')
+    parser.add_argument('--istag', default='MOCK-0001')
+    parser.add_argument('--options-ttl', type=int, default=3600)
+
+    return parser.parse_args(argv)
+
+
+def main(argv=None):
+    config = parse_args(argv)
+    server = ICAPServer((config.host, config.port), config)
+
+    # the harness reads the port, useful with --port 0
+    print(server.server_address[1])
+    sys.stdout.flush()
+
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        server.server_close()
+
+
+if __name__ == '__main__':
+    main()
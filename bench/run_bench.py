@@ -0,0 +1,260 @@
+#!/usr/bin/env python
+# -*- mode: python; coding: utf-8 -*-
+
+"""Measure the icapclient throughput and latency against the mock ICAP server.
+
+The results are written as JSON, one entry per (type, size, read_content,
+io_buffer_size, map_min_size) combination, so that two runs can be compared
+by a script. An io_buffer_size of 0 sends the bodies with the C-ICAP library
+writer, the other sizes with the native writer: the "comparison" section
+gives the throughput of each native size relative to the library writer.
+A map_min_size of 0 reads the input files, the other sizes map the files at
+least that big: the "mapping" section gives the throughput of each mapped
+case relative to the same case with reads.
+"""
+
+from __future__ import division, print_function
+
+import argparse
+import json
+import os
+import platform
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+try:
+    from time import perf_counter as clock
+except ImportError:
+    from time import time as clock
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+
+# use the module built in place by "make bench"
+sys.path.insert(0, os.path.dirname(BENCH_DIR))
+
+import icapclient
+
+
+def parse_size(value):
+    units = {'k': 1024, 'm': 1024 * 1024, 'g': 1024 * 1024 * 1024}
+    value = value.strip().lower()
+
+    if value and value[-1] in units:
+        return int(value[:-1]) * units[value[-1]]
+
+    return int(value)
+
+
+def percentile(values, pct):
+    # nearest-rank percentile, values must be sorted
+    if not values:
+        return 0.0
+
+    rank = max(1, int(round(pct / 100 * len(values))))
+
+    return values[min(rank, len(values)) - 1]
+
+
+def make_file(directory, size, seed):
+    # the same seed always gives the same content
+    rng = random.Random(seed + size)
+    path = os.path.join(directory, 'body-%d' % size)
+    block = bytearray(rng.getrandbits(8) for _ in range(min(size, 65536)))
+
+    with open(path, 'wb') as f:
+        remaining = size
+        while remaining > 0:
+            f.write(block[:remaining])
+            remaining -= len(block)
+
+    return path
+
+
+def start_server(args):
+    cmd = [sys.executable, os.path.join(BENCH_DIR, 'mock_icap_server.py'),
+           '--host', '127.0.0.1', '--port', '0',
+           '--mode', args.server_mode,
+           '--preview', str(args.preview),
+           '--latency', str(args.latency)]
+    server = subprocess.Popen(cmd, stdout=subprocess.PIPE)
+    port = int(server.stdout.readline())
+
+    return server, port
+
+
+def run_case(port, path, size, icap_type, read_content, io_buffer_size, map_min_size, args):
+    icapclient.set_input_mapping(map_min_size)
+    conn = icapclient.ICAPConnection('127.0.0.1', port)
+    latencies = []
+
+    try:
+        for _ in range(args.warmup):
+            conn.request(icap_type, path, read_content=read_content, io_buffer_size=io_buffer_size)
+            conn.getresponse()
+
+        start = clock()
+
+        for _ in range(args.iterations):
+            t0 = clock()
+            conn.request(icap_type, path, read_content=read_content, io_buffer_size=io_buffer_size)
+            resp = conn.getresponse()
+            latencies.append(clock() - t0)
+
+        elapsed = clock() - start
+    finally:
+        conn.close()
+
+    latencies.sort()
+
+    return {
+        'type': icap_type,
+        'size': size,
+        'read_content': bool(read_content),
+        'io_buffer_size': io_buffer_size,
+        'writer': 'native' if io_buffer_size > 0 else 'library',
+        'map_min_size': map_min_size,
+        'mapped': 0 < map_min_size <= size,
+        'iterations': args.iterations,
+        'status': resp.icap_status,
+        'requests_per_sec': args.iterations / elapsed if elapsed > 0 else 0.0,
+        'mb_per_sec': size * args.iterations / elapsed / (1024 * 1024) if elapsed > 0 else 0.0,
+        'p50_ms': percentile(latencies, 50) * 1000,
+        'p99_ms': percentile(latencies, 99) * 1000,
+        'mean_ms': sum(latencies) / len(latencies) * 1000,
+    }
+
+
+def compare_writers(results):
+    # the throughput of the native writer, relative to the library one
+    library = dict(((r['type'], r['size'], r['read_content'], r['map_min_size']), r['mb_per_sec'])
+                   for r in results if r['io_buffer_size'] == 0)
+    comparison = []
+
+    for result in results:
+        base = library.get((result['type'], result['size'], result['read_content'],
+                            result['map_min_size']))
+        if result['io_buffer_size'] == 0 or not base:
+            continue
+
+        comparison.append({
+            'type': result['type'],
+            'size': result['size'],
+            'read_content': result['read_content'],
+            'io_buffer_size': result['io_buffer_size'],
+            'map_min_size': result['map_min_size'],
+            'speedup': result['mb_per_sec'] / base,
+        })
+
+    return comparison
+
+
+def compare_mapping(results):
+    # the throughput with the input files mapped, relative to reading them
+    reads = dict(((r['type'], r['size'], r['read_content'], r['io_buffer_size']), r['mb_per_sec'])
+                 for r in results if not r['mapped'])
+    comparison = []
+
+    for result in results:
+        base = reads.get((result['type'], result['size'], result['read_content'],
+                          result['io_buffer_size']))
+        if not result['mapped'] or not base:
+            continue
+
+        comparison.append({
+            'type': result['type'],
+            'size': result['size'],
+            'read_content': result['read_content'],
+            'io_buffer_size': result['io_buffer_size'],
+            'map_min_size': result['map_min_size'],
+            'speedup': result['mb_per_sec'] / base,
+        })
+
+    return comparison
+
+
+def parse_args(argv=None):
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--sizes', default='1k,64k,1m,16m',
+                        help='comma-separated body sizes (k, m and g suffixes)')
+    parser.add_argument('--types', default='REQMOD,RESPMOD')
+    parser.add_argument('--io-buffer-sizes', default='0,64k',
+                        help='comma-separated body chunk sizes, 0 for the library writer')
+    parser.add_argument('--map-min-sizes', default='0',
+                        help='comma-separated input mapping thresholds, 0 to read the files')
+    parser.add_argument('--iterations', type=int, default=200)
+    parser.add_argument('--warmup', type=int, default=10)
+    parser.add_argument('--seed', type=int, default=1344)
+    parser.add_argument('--server-mode', choices=('echo', '204', 'stream', 'early'), default='echo')
+    parser.add_argument('--preview', type=int, default=1024)
+    parser.add_argument('--latency', type=float, default=0.0,
+                        help='server delay in seconds before each response')
+    parser.add_argument('--output', default='-',
+                        help='JSON output file, - for stdout')
+
+    return parser.parse_args(argv)
+
+
+def main(argv=None):
+    args = parse_args(argv)
+    sizes = [parse_size(size) for size in args.sizes.split(',')]
+    types = [icap_type.strip().upper() for icap_type in args.types.split(',')]
+    io_buffer_sizes = [parse_size(size) for size in args.io_buffer_sizes.split(',')]
+    map_min_sizes = [parse_size(size) for size in args.map_min_sizes.split(',')]
+    directory = tempfile.mkdtemp(prefix='icapclient-bench-')
+    server, port = start_server(args)
+    results = []
+
+    try:
+        paths = dict((size, make_file(directory, size, args.seed)) for size in sizes)
+
+        for icap_type in types:
+            for size in sizes:
+                for read_content in (1, 0):
+                    for io_buffer_size in io_buffer_sizes:
+                        for map_min_size in map_min_sizes:
+                            results.append(run_case(port, paths[size], size, icap_type,
+                                                    read_content, io_buffer_size,
+                                                    map_min_size, args))
+    finally:
+        server.terminate()
+        server.wait()
+        shutil.rmtree(directory)
+
+    report = {
+        'config': {
+            'sizes': sizes,
+            'types': types,
+            'io_buffer_sizes': io_buffer_sizes,
+            'map_min_sizes': map_min_sizes,
+            'iterations': args.iterations,
+            'warmup': args.warmup,
+            'seed': args.seed,
+            'server_mode': args.server_mode,
+            'preview': args.preview,
+            'latency': args.latency,
+        },
+        'environment': {
+            'python': platform.python_version(),
+            'platform': platform.platform(),
+            'machine': platform.machine(),
+        },
+        'results': results,
+        'comparison': compare_writers(results),
+        'mapping': compare_mapping(results),
+    }
+
+    output = json.dumps(report, indent=2, sort_keys=True, separators=(',', ': '))
+
+    if args.output == '-':
+        print(output)
+    else:
+        with open(args.output, 'w') as f:
+            f.write(output + '\n')
+
+
+if __name__ == '__main__':
+    main()
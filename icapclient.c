@@ -14,17 +14,24 @@
  *   more details.
  */
 
-#include <Python.h>
-#include <cStringIO.h>
+#include "py_compat.h"
 
 #include <debug.h>
 
 #include "gcc_attributes.h"
 #include "ICAPConnection.h"
 #include "ICAPResponse.h"
-
-// PycStringIO is static, use a non-static variable
-struct PycStringIO_CAPI *PycStringIO_ref = NULL;
+#include "ICAPHeaders.h"
+#include "HTTPHeaders.h"
+#include "ICAPConnectionPool.h"
+#include "ICAPCluster.h"
+#include "ICAPContent.h"
+#include "ICAPScanner.h"
+#include "ICAPExchange.h"
+#include "options_cache.h"
+#include "verdict_cache.h"
+#include "metrics.h"
+#include "resolver.h"
 
 static char icapclient_doc[] = "Provide bindings to the C-ICAP library (Client only)";
 
@@ -61,39 +68,262 @@ icapclient_debug_stdout(GCC_UNUSED PyObject *obj, PyObject *args)
     Py_RETURN_NONE;
 }
 
+static PyObject *
+icapclient_clear_options_cache(GCC_UNUSED PyObject *obj, GCC_UNUSED PyObject *args)
+{
+    py_options_cache_clear();
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+icapclient_verdict_cache(GCC_UNUSED PyObject *obj, PyObject *args, PyObject *kwds)
+{
+    Py_ssize_t max_entries = 0;
+    int ttl = 300;
+    Py_ssize_t max_size = ICAP_VERDICT_DEFAULT_MAX_SIZE;
+
+    static char *kwlist[] = { "max_entries", "ttl", "max_size", NULL };
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "n|in:set_verdict_cache", kwlist,
+				    &max_entries, &ttl, &max_size))
+    {
+	return NULL;
+    }
+
+    if(max_entries < 0)
+    {
+	PyErr_SetString(PyExc_ValueError, "The maximum number of entries must be positive (or zero)");
+
+	return NULL;
+    }
+
+    if(ttl <= 0)
+    {
+	PyErr_SetString(PyExc_ValueError, "The verdict TTL must have a positive value");
+
+	return NULL;
+    }
+
+    if(max_size < 0)
+    {
+	PyErr_SetString(PyExc_ValueError, "The maximum content size must be positive (or zero)");
+
+	return NULL;
+    }
+
+    py_verdict_cache_configure(max_entries, ttl, max_size);
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+icapclient_clear_verdict_cache(GCC_UNUSED PyObject *obj, GCC_UNUSED PyObject *args)
+{
+    py_verdict_cache_clear();
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+icapclient_dns_cache_ttl(GCC_UNUSED PyObject *obj, PyObject *args)
+{
+    int ttl = 0;
+
+    if(!PyArg_ParseTuple(args, "i:set_dns_cache_ttl", &ttl))
+    {
+	return NULL;
+    }
+
+    if(ttl < 0)
+    {
+	PyErr_SetString(PyExc_ValueError, "The DNS cache TTL must have a positive value (or zero)");
+
+	return NULL;
+    }
+
+    py_resolver_set_ttl(ttl);
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+icapclient_input_mapping(GCC_UNUSED PyObject *obj, PyObject *args)
+{
+    Py_ssize_t min_size = 0;
+
+    if(!PyArg_ParseTuple(args, "n:set_input_mapping", &min_size))
+    {
+	return NULL;
+    }
+
+    if(min_size < 0)
+    {
+	PyErr_SetString(PyExc_ValueError, "The minimum file size must be positive (or zero)");
+
+	return NULL;
+    }
+
+    py_conn_set_map_min_size(min_size);
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+icapclient_clear_dns_cache(GCC_UNUSED PyObject *obj, GCC_UNUSED PyObject *args)
+{
+    py_resolver_cache_clear();
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+icapclient_metrics(GCC_UNUSED PyObject *obj, GCC_UNUSED PyObject *args)
+{
+    return py_metrics_snapshot();
+}
+
+static PyObject *
+icapclient_server_options(GCC_UNUSED PyObject *obj, PyObject *args, PyObject *kwds)
+{
+    char *host = NULL;
+    int port = 1344;
+    char *service = "avscan";
+    py_options_t opts;
+
+    static char *kwlist[] = { "host", "port", "service", NULL };
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "s|is:get_server_options", kwlist,
+				    &host, &port, &service))
+    {
+	return NULL;
+    }
+
+    if(!py_options_cache_get(host, port, service, &opts))
+    {
+	Py_RETURN_NONE;
+    }
+
+    py_options_transfer_t const *transfer = opts.transfer;
+
+    PyObject *dict = Py_BuildValue("{s:i,s:O,s:O,s:O,s:s,s:z,s:z,s:z}",
+				   "preview", opts.preview,
+				   "allow204", opts.allow204 ? Py_True : Py_False,
+				   "allow206", opts.allow206 ? Py_True : Py_False,
+				   "keepalive", opts.keepalive ? Py_True : Py_False,
+				   "istag", opts.istag,
+				   "transfer_preview", (transfer != NULL) ? transfer->preview : NULL,
+				   "transfer_ignore", (transfer != NULL) ? transfer->ignore : NULL,
+				   "transfer_complete", (transfer != NULL) ? transfer->complete : NULL);
+    py_options_free(&opts);
+
+    return dict;
+}
+
 static struct PyMethodDef icapclient_methods[] =
 {
     { "set_debug_level", icapclient_debug_level,
       METH_VARARGS, "set the debug level" },
     { "set_debug_stdout", icapclient_debug_stdout,
       METH_VARARGS, "set the debug to stdout" },
+    { "clear_options_cache", icapclient_clear_options_cache,
+      METH_NOARGS, "forget all the cached ICAP server options" },
+    { "set_verdict_cache", (PyCFunction)icapclient_verdict_cache,
+      METH_VARARGS | METH_KEYWORDS, "cache the ICAP responses for the already scanned contents" },
+    { "clear_verdict_cache", icapclient_clear_verdict_cache,
+      METH_NOARGS, "forget all the cached ICAP responses" },
+    { "set_dns_cache_ttl", icapclient_dns_cache_ttl,
+      METH_VARARGS, "set how long the resolved ICAP server addresses are cached, zero disables the cache" },
+    { "set_input_mapping", icapclient_input_mapping,
+      METH_VARARGS, "map the input files of at least the given size in memory, zero reads all of them" },
+    { "clear_dns_cache", icapclient_clear_dns_cache,
+      METH_NOARGS, "forget all the resolved ICAP server addresses" },
+    { "metrics", icapclient_metrics,
+      METH_NOARGS, "get a snapshot of the client metrics" },
+    { "get_server_options", (PyCFunction)icapclient_server_options,
+      METH_VARARGS | METH_KEYWORDS, "get the cached ICAP server options for a service" },
     { .ml_name = NULL }
 };
 
-// C-ICAP default cflags include "-fvisibility=hidden"
-GCC_STD_DEFAULT
-PyMODINIT_FUNC
-initicapclient(void)
+#if PY_MAJOR_VERSION >= 3
+static struct PyModuleDef icapclient_module_def =
+{
+    PyModuleDef_HEAD_INIT,
+    .m_name = "icapclient",
+    .m_doc = icapclient_doc,
+    .m_size = -1,
+    .m_methods = icapclient_methods
+};
+#endif
+
+// the module object, or NULL with an exception set
+static PyObject *
+icapclient_init(void)
 {
     PyObject *icapclient_module = NULL;
 
     if(PyType_Ready(&PyICAPConnectionType) < 0)
     {
-	return;
+	return NULL;
     }
 
     if(PyType_Ready(&PyICAPResponseType) < 0)
     {
-	return;
+	return NULL;
+    }
+
+    if(PyType_Ready(&PyICAPHeadersType) < 0)
+    {
+	return NULL;
+    }
+
+    if(PyType_Ready(&PyHTTPHeadersType) < 0)
+    {
+	return NULL;
+    }
+
+    if(PyType_Ready(&PyICAPConnectionPoolType) < 0)
+    {
+	return NULL;
+    }
+
+    if(PyType_Ready(&PyICAPClusterType) < 0)
+    {
+	return NULL;
+    }
+
+    if(PyType_Ready(&PyICAPContentType) < 0)
+    {
+	return NULL;
+    }
+
+    if(PyType_Ready(&PyICAPScannerType) < 0)
+    {
+	return NULL;
+    }
+
+    if(PyType_Ready(&PyICAPFutureType) < 0)
+    {
+	return NULL;
+    }
+
+    if(PyType_Ready(&PyICAPExchangeType) < 0)
+    {
+	return NULL;
     }
    
+#if PY_MAJOR_VERSION >= 3
+    icapclient_module = PyModule_Create(&icapclient_module_def);
+#else
     icapclient_module = Py_InitModule3("icapclient", icapclient_methods, icapclient_doc);
+#endif
     if(icapclient_module == NULL)
     {
-	return;
+	return NULL;
     }
 
     // some constants for the ICAPConnection object
+    PyModule_AddIntConstant(icapclient_module, "AF_UNSPEC", AF_UNSPEC);
     PyModule_AddIntConstant(icapclient_module, "AF_INET", AF_INET);
     PyModule_AddIntConstant(icapclient_module, "AF_INET6", AF_INET6);
 
@@ -101,7 +331,9 @@ initicapclient(void)
     PyICAP_Exc = PyErr_NewException("icapclient.ICAPException", PyExc_IOError, NULL);
     if(PyICAP_Exc == NULL)
     {
-	return;
+	Py_DECREF(icapclient_module);
+
+	return NULL;
     }
 
     Py_INCREF(PyICAP_Exc);
@@ -112,8 +344,37 @@ initicapclient(void)
     PyModule_AddObject(icapclient_module, "ICAPConnection", (PyObject *)&PyICAPConnectionType);
     Py_INCREF(&PyICAPResponseType);
     PyModule_AddObject(icapclient_module, "ICAPResponse", (PyObject *)&PyICAPResponseType);
-   
-    // import the cStringIO module
-    PycString_IMPORT;
-    PycStringIO_ref = PycStringIO;
+    Py_INCREF(&PyICAPHeadersType);
+    PyModule_AddObject(icapclient_module, "ICAPHeaders", (PyObject *)&PyICAPHeadersType);
+    Py_INCREF(&PyHTTPHeadersType);
+    PyModule_AddObject(icapclient_module, "HTTPHeaders", (PyObject *)&PyHTTPHeadersType);
+    Py_INCREF(&PyICAPConnectionPoolType);
+    PyModule_AddObject(icapclient_module, "ICAPConnectionPool", (PyObject *)&PyICAPConnectionPoolType);
+    Py_INCREF(&PyICAPClusterType);
+    PyModule_AddObject(icapclient_module, "ICAPCluster", (PyObject *)&PyICAPClusterType);
+    Py_INCREF(&PyICAPScannerType);
+    PyModule_AddObject(icapclient_module, "ICAPScanner", (PyObject *)&PyICAPScannerType);
+    Py_INCREF(&PyICAPFutureType);
+    PyModule_AddObject(icapclient_module, "ICAPFuture", (PyObject *)&PyICAPFutureType);
+    Py_INCREF(&PyICAPExchangeType);
+    PyModule_AddObject(icapclient_module, "ICAPExchange", (PyObject *)&PyICAPExchangeType);
+
+    return icapclient_module;
+}
+
+// C-ICAP default cflags include "-fvisibility=hidden"
+#if PY_MAJOR_VERSION >= 3
+GCC_STD_DEFAULT
+PyMODINIT_FUNC
+PyInit_icapclient(void)
+{
+    return icapclient_init();
+}
+#else
+GCC_STD_DEFAULT
+PyMODINIT_FUNC
+initicapclient(void)
+{
+    icapclient_init();
 }
+#endif
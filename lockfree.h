@@ -0,0 +1,194 @@
+/* -*- Mode: C; c-basic-offset: 4 -*- */
+/*
+ * Copyright 2015 Vincent Rasneur <vrasneur@free.fr>
+ * All Rights Reserved.
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation, version 3.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ *   NON INFRINGEMENT.  See the GNU General Public License for
+ *   more details.
+ */
+
+#ifndef LOCKFREE_H
+#define LOCKFREE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// bounded multi-producer multi-consumer queue (D. Vyukov's algorithm)
+// uses the GCC atomic builtins
+
+typedef struct
+{
+    size_t seq;
+    void *data;
+} lf_queue_cell_t;
+
+typedef struct
+{
+    lf_queue_cell_t *cells;
+    size_t mask;
+    size_t enqueue_pos;
+    size_t dequeue_pos;
+} lf_queue_t;
+
+// the size is rounded up to a power of 2
+static inline int
+lf_queue_init(lf_queue_t *queue, size_t size)
+{
+    size_t capacity = 2;
+
+    while(capacity < size)
+    {
+	capacity *= 2;
+    }
+
+    queue->cells = calloc(capacity, sizeof(lf_queue_cell_t));
+    if(queue->cells == NULL)
+    {
+	return -1;
+    }
+
+    for(size_t idx = 0; idx < capacity; idx++)
+    {
+	queue->cells[idx].seq = idx;
+    }
+
+    queue->mask = capacity - 1;
+    queue->enqueue_pos = 0;
+    queue->dequeue_pos = 0;
+
+    return 0;
+}
+
+static inline void
+lf_queue_destroy(lf_queue_t *queue)
+{
+    free(queue->cells), queue->cells = NULL;
+}
+
+static inline size_t
+lf_queue_capacity(lf_queue_t const *queue)
+{
+    return queue->mask + 1;
+}
+
+// return -1 if the queue is full
+static inline int
+lf_queue_push(lf_queue_t *queue, void *data)
+{
+    lf_queue_cell_t *cell = NULL;
+    size_t pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+
+    for(;;)
+    {
+	cell = &queue->cells[pos & queue->mask];
+	size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+	intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+	if(diff == 0)
+	{
+	    if(__atomic_compare_exchange_n(&queue->enqueue_pos, &pos, pos + 1, 1,
+					   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	    {
+		break;
+	    }
+	}
+	else if(diff < 0)
+	{
+	    return -1;
+	}
+	else
+	{
+	    pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+	}
+    }
+
+    cell->data = data;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+// return NULL if the queue is empty
+static inline void *
+lf_queue_pop(lf_queue_t *queue)
+{
+    lf_queue_cell_t *cell = NULL;
+    size_t pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+
+    for(;;)
+    {
+	cell = &queue->cells[pos & queue->mask];
+	size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+	intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+	if(diff == 0)
+	{
+	    if(__atomic_compare_exchange_n(&queue->dequeue_pos, &pos, pos + 1, 1,
+					   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	    {
+		break;
+	    }
+	}
+	else if(diff < 0)
+	{
+	    return NULL;
+	}
+	else
+	{
+	    pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+	}
+    }
+
+    void *data = cell->data;
+    __atomic_store_n(&cell->seq, pos + queue->mask + 1, __ATOMIC_RELEASE);
+
+    return data;
+}
+
+// intrusive multi-producer stack, emptied all at once by its consumer
+
+typedef struct lf_stack_node
+{
+    struct lf_stack_node *next;
+} lf_stack_node_t;
+
+static inline void
+lf_stack_push(lf_stack_node_t **head, lf_stack_node_t *node)
+{
+    lf_stack_node_t *top = __atomic_load_n(head, __ATOMIC_RELAXED);
+
+    do
+    {
+	node->next = top;
+    }
+    while(!__atomic_compare_exchange_n(head, &top, node, 1,
+				       __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// return the nodes in push order
+static inline lf_stack_node_t *
+lf_stack_take_all(lf_stack_node_t **head)
+{
+    lf_stack_node_t *node = __atomic_exchange_n(head, NULL, __ATOMIC_ACQUIRE);
+    lf_stack_node_t *list = NULL;
+
+    while(node != NULL)
+    {
+	lf_stack_node_t *next = node->next;
+
+	node->next = list;
+	list = node;
+	node = next;
+    }
+
+    return list;
+}
+
+#endif // LOCKFREE_H
@@ -0,0 +1,332 @@
+/* -*- Mode: C; c-basic-offset: 4 -*- */
+/*
+ * Copyright 2015 Vincent Rasneur <vrasneur@free.fr>
+ * All Rights Reserved.
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation, version 3.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ *   NON INFRINGEMENT.  See the GNU General Public License for
+ *   more details.
+ */
+
+#include "metrics.h"
+
+#include <stdint.h>
+
+// the latency buckets hold up to 2^idx microseconds, the last one is unbounded
+#define PY_METRICS_BUCKETS 27
+
+typedef enum
+{
+    PY_METRICS_STATUS_200 = 0,
+    PY_METRICS_STATUS_204,
+    PY_METRICS_STATUS_206,
+    PY_METRICS_STATUS_4XX,
+    PY_METRICS_STATUS_5XX,
+    PY_METRICS_STATUS_OTHER,
+    PY_METRICS_STATUS_COUNT
+} py_metrics_status_t;
+
+static char const *py_metrics_status_names[PY_METRICS_STATUS_COUNT] =
+{
+    "200", "204", "206", "4xx", "5xx", "other"
+};
+
+static char const *py_metrics_error_names[PY_CONN_ERR_PYTHON + 1] =
+{
+    [PY_CONN_OK] = NULL,
+    [PY_CONN_ERR_CONNECT] = "connect",
+    [PY_CONN_ERR_CREATE] = "create",
+    [PY_CONN_ERR_OPTIONS] = "options",
+    [PY_CONN_ERR_REQ_HEADERS] = "req_headers",
+    [PY_CONN_ERR_RESP_HEADERS] = "resp_headers",
+    [PY_CONN_ERR_SEND] = "send",
+    [PY_CONN_ERR_NOMEM] = "nomem",
+    [PY_CONN_ERR_SPILL] = "spill",
+    [PY_CONN_ERR_READ] = "read",
+    [PY_CONN_ERR_WRITE] = "write",
+    [PY_CONN_ERR_PYTHON] = "python"
+};
+
+// all the counters only grow, the snapshot reads them one by one
+static struct
+{
+    uint64_t reqmod;
+    uint64_t respmod;
+    uint64_t statuses[PY_METRICS_STATUS_COUNT];
+    uint64_t errors[PY_CONN_ERR_PYTHON + 1];
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t body_bytes_skipped;
+    uint64_t connects;
+    uint64_t reuses;
+    // the idle sockets closed by the server, and the requests sent twice
+    uint64_t stale_connections;
+    uint64_t retries;
+    uint64_t options_requests;
+    uint64_t options_cache_hits;
+    uint64_t verdict_cache_hits;
+    uint64_t verdict_cache_misses;
+    uint64_t latency[PY_METRICS_BUCKETS];
+    uint64_t latency_sum_ns;
+} py_metrics;
+
+#define PY_METRICS_ADD(counter, value) __atomic_fetch_add(&(counter), (value), __ATOMIC_RELAXED)
+#define PY_METRICS_GET(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+static py_metrics_status_t
+py_metrics_status(int status)
+{
+    switch(status)
+    {
+    case 200:
+	return PY_METRICS_STATUS_200;
+    case 204:
+	return PY_METRICS_STATUS_204;
+    case 206:
+	return PY_METRICS_STATUS_206;
+    }
+
+    if(status >= 400 && status < 500)
+    {
+	return PY_METRICS_STATUS_4XX;
+    }
+
+    if(status >= 500 && status < 600)
+    {
+	return PY_METRICS_STATUS_5XX;
+    }
+
+    return PY_METRICS_STATUS_OTHER;
+}
+
+static int
+py_metrics_bucket(int64_t duration_ns)
+{
+    uint64_t usecs = (duration_ns > 0) ? (uint64_t)duration_ns / 1000 : 0;
+
+    if(usecs <= 1)
+    {
+	return 0;
+    }
+
+    // the smallest power of 2 that is not below the duration
+    int idx = 64 - __builtin_clzll(usecs - 1);
+
+    return (idx < PY_METRICS_BUCKETS) ? idx : PY_METRICS_BUCKETS - 1;
+}
+
+void
+py_metrics_record_job(py_conn_job_t const *job, int reused)
+{
+    py_conn_stats_t const *stats = &job->stats;
+
+    PY_METRICS_ADD(*((job->type == ICAP_RESPMOD) ? &py_metrics.respmod : &py_metrics.reqmod), 1);
+
+    if(job->error != PY_CONN_OK)
+    {
+	PY_METRICS_ADD(py_metrics.errors[job->error], 1);
+    }
+    else
+    {
+	PY_METRICS_ADD(py_metrics.statuses[py_metrics_status(job->status)], 1);
+    }
+
+    // no connection was made if the connect failed
+    if(reused)
+    {
+	PY_METRICS_ADD(py_metrics.reuses, 1);
+    }
+    else if(job->error != PY_CONN_ERR_CONNECT)
+    {
+	PY_METRICS_ADD(py_metrics.connects, 1);
+    }
+
+    if(stats->bytes_received > 0)
+    {
+	PY_METRICS_ADD(py_metrics.bytes_in, stats->bytes_received);
+    }
+
+    if(stats->bytes_sent > 0)
+    {
+	PY_METRICS_ADD(py_metrics.bytes_out, stats->bytes_sent);
+    }
+
+    if(stats->body_bytes_skipped > 0)
+    {
+	PY_METRICS_ADD(py_metrics.body_bytes_skipped, stats->body_bytes_skipped);
+    }
+
+    // only the exchanges that went through
+    if(stats->end != 0)
+    {
+	int64_t duration = stats->end - stats->start;
+
+	PY_METRICS_ADD(py_metrics.latency[py_metrics_bucket(duration)], 1);
+	PY_METRICS_ADD(py_metrics.latency_sum_ns, duration);
+    }
+}
+
+void
+py_metrics_record_options(int cached)
+{
+    PY_METRICS_ADD(*(cached ? &py_metrics.options_cache_hits : &py_metrics.options_requests), 1);
+}
+
+void
+py_metrics_record_verdict(int cached)
+{
+    PY_METRICS_ADD(*(cached ? &py_metrics.verdict_cache_hits : &py_metrics.verdict_cache_misses), 1);
+}
+
+void
+py_metrics_record_stale(void)
+{
+    PY_METRICS_ADD(py_metrics.stale_connections, 1);
+}
+
+void
+py_metrics_record_retry(void)
+{
+    PY_METRICS_ADD(py_metrics.retries, 1);
+}
+
+static int
+py_metrics_set(PyObject *dict, char const *name, uint64_t value)
+{
+    PyObject *obj = PyLong_FromUnsignedLongLong(value);
+    if(obj == NULL)
+    {
+	return -1;
+    }
+
+    int ret = PyDict_SetItemString(dict, name, obj);
+    Py_DECREF(obj);
+
+    return ret;
+}
+
+static PyObject *
+py_metrics_latency(void)
+{
+    uint64_t count = 0;
+    PyObject *buckets = PyList_New(PY_METRICS_BUCKETS);
+    if(buckets == NULL)
+    {
+	return NULL;
+    }
+
+    for(int idx = 0; idx < PY_METRICS_BUCKETS; idx++)
+    {
+	uint64_t value = PY_METRICS_GET(py_metrics.latency[idx]);
+	PyObject *bucket = NULL;
+
+	count += value;
+
+	// the upper bound of the bucket in seconds, None for the last one
+	if(idx < PY_METRICS_BUCKETS - 1)
+	{
+	    bucket = Py_BuildValue("(dK)", (double)(1ULL << idx) / 1e6, (unsigned long long)value);
+	}
+	else
+	{
+	    bucket = Py_BuildValue("(OK)", Py_None, (unsigned long long)value);
+	}
+
+	if(bucket == NULL)
+	{
+	    Py_DECREF(buckets);
+
+	    return NULL;
+	}
+
+	PyList_SET_ITEM(buckets, idx, bucket);
+    }
+
+    return Py_BuildValue("{s:N,s:K,s:d}", "buckets", buckets, "count", (unsigned long long)count,
+			 "sum", PY_METRICS_GET(py_metrics.latency_sum_ns) / 1e9);
+}
+
+PyObject *
+py_metrics_snapshot(void)
+{
+    PyObject *snapshot = PyDict_New();
+    PyObject *requests = PyDict_New();
+    PyObject *statuses = PyDict_New();
+    PyObject *errors = PyDict_New();
+    PyObject *latency = NULL;
+
+    if(snapshot == NULL || requests == NULL || statuses == NULL || errors == NULL)
+    {
+	goto py_metrics_snapshot_error;
+    }
+
+    if(py_metrics_set(requests, "REQMOD", PY_METRICS_GET(py_metrics.reqmod)) != 0 ||
+       py_metrics_set(requests, "RESPMOD", PY_METRICS_GET(py_metrics.respmod)) != 0)
+    {
+	goto py_metrics_snapshot_error;
+    }
+
+    for(int idx = 0; idx < PY_METRICS_STATUS_COUNT; idx++)
+    {
+	if(py_metrics_set(statuses, py_metrics_status_names[idx],
+			  PY_METRICS_GET(py_metrics.statuses[idx])) != 0)
+	{
+	    goto py_metrics_snapshot_error;
+	}
+    }
+
+    for(int idx = PY_CONN_ERR_CONNECT; idx <= PY_CONN_ERR_PYTHON; idx++)
+    {
+	if(py_metrics_set(errors, py_metrics_error_names[idx], PY_METRICS_GET(py_metrics.errors[idx])) != 0)
+	{
+	    goto py_metrics_snapshot_error;
+	}
+    }
+
+    latency = py_metrics_latency();
+    if(latency == NULL)
+    {
+	goto py_metrics_snapshot_error;
+    }
+
+    if(PyDict_SetItemString(snapshot, "requests", requests) != 0 ||
+       PyDict_SetItemString(snapshot, "statuses", statuses) != 0 ||
+       PyDict_SetItemString(snapshot, "errors", errors) != 0 ||
+       PyDict_SetItemString(snapshot, "latency", latency) != 0 ||
+       py_metrics_set(snapshot, "bytes_in", PY_METRICS_GET(py_metrics.bytes_in)) != 0 ||
+       py_metrics_set(snapshot, "bytes_out", PY_METRICS_GET(py_metrics.bytes_out)) != 0 ||
+       py_metrics_set(snapshot, "body_bytes_skipped", PY_METRICS_GET(py_metrics.body_bytes_skipped)) != 0 ||
+       py_metrics_set(snapshot, "connects", PY_METRICS_GET(py_metrics.connects)) != 0 ||
+       py_metrics_set(snapshot, "reuses", PY_METRICS_GET(py_metrics.reuses)) != 0 ||
+       py_metrics_set(snapshot, "stale_connections", PY_METRICS_GET(py_metrics.stale_connections)) != 0 ||
+       py_metrics_set(snapshot, "retries", PY_METRICS_GET(py_metrics.retries)) != 0 ||
+       py_metrics_set(snapshot, "options_requests", PY_METRICS_GET(py_metrics.options_requests)) != 0 ||
+       py_metrics_set(snapshot, "options_cache_hits", PY_METRICS_GET(py_metrics.options_cache_hits)) != 0 ||
+       py_metrics_set(snapshot, "verdict_cache_hits", PY_METRICS_GET(py_metrics.verdict_cache_hits)) != 0 ||
+       py_metrics_set(snapshot, "verdict_cache_misses", PY_METRICS_GET(py_metrics.verdict_cache_misses)) != 0)
+    {
+	goto py_metrics_snapshot_error;
+    }
+
+py_metrics_snapshot_error:
+
+    Py_XDECREF(requests);
+    Py_XDECREF(statuses);
+    Py_XDECREF(errors);
+    Py_XDECREF(latency);
+
+    if(PyErr_Occurred())
+    {
+	Py_XDECREF(snapshot);
+
+	return NULL;
+    }
+
+    return snapshot;
+}
@@ -0,0 +1,33 @@
+/* -*- Mode: C; c-basic-offset: 4 -*- */
+/*
+ * Copyright 2015 Vincent Rasneur <vrasneur@free.fr>
+ * All Rights Reserved.
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation, version 3.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ *   NON INFRINGEMENT.  See the GNU General Public License for
+ *   more details.
+ */
+
+#ifndef PY_ICAP_METRICS_H
+#define PY_ICAP_METRICS_H
+
+#include "py_compat.h"
+
+#include "ICAPConnection.h"
+
+// the update functions use atomic counters, they can be called without holding the GIL
+void py_metrics_record_job(py_conn_job_t const *job, int reused);
+void py_metrics_record_options(int cached);
+void py_metrics_record_stale(void);
+void py_metrics_record_retry(void);
+void py_metrics_record_verdict(int cached);
+
+PyObject *py_metrics_snapshot(void);
+
+#endif // PY_ICAP_METRICS_H
@@ -0,0 +1,1037 @@
+/* -*- Mode: C; c-basic-offset: 4 -*- */
+/*
+ * Copyright 2015 Vincent Rasneur <vrasneur@free.fr>
+ * All Rights Reserved.
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation, version 3.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ *   NON INFRINGEMENT.  See the GNU General Public License for
+ *   more details.
+ */
+
+#include "native_client.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// the response lines, including the chunk sizes, must fit in the read buffer
+#define PY_NATIVE_MIN_READ_SIZE 16384
+// the body chunks of the exchanges driven by an event loop, when no size is given
+#define PY_NATIVE_DEFAULT_CHUNK_SIZE 65536
+// enough for a chunk size in hexadecimal with its CRLF
+#define PY_NATIVE_CHUNK_HEADER_SIZE 20
+// the headers that can be encapsulated in a response
+#define PY_NATIVE_MAX_ENTITIES 4
+
+#define PY_NATIVE_CRLF "\r\n"
+#define PY_NATIVE_LAST_CHUNK "0\r\n\r\n"
+#define PY_NATIVE_LAST_CHUNK_IEOF "0; ieof\r\n\r\n"
+
+// the socket has no data yet
+#define PY_NATIVE_AGAIN 1
+
+// a server closing the socket must not kill the process with SIGPIPE
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+typedef struct
+{
+    int fd;
+    // in milliseconds, -1 to wait forever
+    int timeout;
+    // the ICAP head, sent with the first chunk
+    char *head;
+    size_t head_len;
+    // the body chunk being sent
+    char *payload;
+    size_t payload_size;
+    // the body is sent while the response is read, a phase at a time:
+    // the preview, then the rest of the body
+    py_conn_input_t *input;
+    Py_ssize_t limit;
+    int preview;
+    // the phase still has bytes to send
+    int uploading;
+    // the last chunk of the phase is queued
+    int last_queued;
+    // the whole body fitted in the phase
+    int eof;
+    // the server stopped reading the body, with this errno
+    int broken;
+    // the framed chunk not sent yet
+    char chunk_header[PY_NATIVE_CHUNK_HEADER_SIZE];
+    struct iovec iov[5];
+    struct iovec *iov_next;
+    int iovcnt;
+    // the received bytes, between pos and len
+    char *rbuf;
+    size_t rbuf_size;
+    size_t pos;
+    size_t len;
+    int64_t bytes_sent;
+    int64_t bytes_received;
+} py_native_stream_t;
+
+// the response parts, in the order they are received
+typedef enum
+{
+    PY_NATIVE_STATUS = 0,
+    PY_NATIVE_ENTITIES,
+    PY_NATIVE_CHUNK_SIZE,
+    PY_NATIVE_CHUNK_DATA,
+    PY_NATIVE_CHUNK_END,
+    PY_NATIVE_TRAILERS,
+    PY_NATIVE_OVER,
+    PY_NATIVE_FAILED
+} py_native_state_t;
+
+struct py_native_exchange
+{
+    py_native_stream_t stream;
+    py_native_state_t state;
+    ci_request_t *req;
+    py_conn_input_t *input;
+    // NULL to drop the body, for an OPTIONS response
+    py_conn_output_t *output;
+    int options;
+    // the server may still ask for the rest of the body
+    int in_preview;
+    int status;
+    int hasbody;
+    // the encapsulated headers, and the ones already read
+    int nentities;
+    int entity;
+    // the bytes left in the chunk being decoded
+    unsigned long long chunk_left;
+    // the errno of the failure
+    int error;
+};
+
+// returns the ready events, or -1
+static int
+py_native_wait(py_native_stream_t const *stream, short events)
+{
+    struct pollfd pfd = { .fd = stream->fd, .events = events, .revents = 0 };
+    int ret = 0;
+
+    do
+    {
+	ret = poll(&pfd, 1, stream->timeout);
+    }
+    while(ret < 0 && errno == EINTR);
+
+    // a timeout is an error too
+    if(ret == 0)
+    {
+	errno = ETIMEDOUT;
+    }
+
+    return (ret > 0) ? pfd.revents : -1;
+}
+
+// read the next body chunk and frame it, with the head before the first one
+static int
+py_native_queue_chunk(py_native_stream_t *stream)
+{
+    py_conn_input_t *input = stream->input;
+    Py_ssize_t limit = stream->limit;
+    size_t fill = 0;
+    int eof = 0;
+
+    while(fill < stream->payload_size)
+    {
+	size_t want = stream->payload_size - fill;
+
+	if(limit >= 0 && (Py_ssize_t)want > limit - input->sent)
+	{
+	    want = limit - input->sent;
+	}
+
+	if(want == 0)
+	{
+	    break;
+	}
+
+	int ret = py_conn_read(input, stream->payload + fill, want);
+	if(ret < 0)
+	{
+	    return -1;
+	}
+
+	if(ret == 0)
+	{
+	    eof = 1;
+	    break;
+	}
+
+	fill += ret;
+    }
+
+    int done = eof || (limit >= 0 && input->sent >= limit);
+    struct iovec *iov = stream->iov;
+    int iovcnt = 0;
+
+    // the head is only sent once
+    if(stream->head_len > 0)
+    {
+	iov[iovcnt].iov_base = stream->head;
+	iov[iovcnt++].iov_len = stream->head_len;
+	stream->head_len = 0;
+    }
+
+    if(fill > 0)
+    {
+	iov[iovcnt].iov_base = stream->chunk_header;
+	iov[iovcnt++].iov_len = snprintf(stream->chunk_header, sizeof(stream->chunk_header), "%zx\r\n", fill);
+	iov[iovcnt].iov_base = stream->payload;
+	iov[iovcnt++].iov_len = fill;
+	iov[iovcnt].iov_base = PY_NATIVE_CRLF;
+	iov[iovcnt++].iov_len = 2;
+    }
+
+    if(done)
+    {
+	// the server does not ask for the rest of a body that fits in the preview
+	char *last = (stream->preview && eof) ? PY_NATIVE_LAST_CHUNK_IEOF : PY_NATIVE_LAST_CHUNK;
+
+	iov[iovcnt].iov_base = last;
+	iov[iovcnt++].iov_len = strlen(last);
+
+	stream->last_queued = 1;
+	stream->eof = eof;
+    }
+
+    stream->iov_next = iov;
+    stream->iovcnt = iovcnt;
+
+    return 0;
+}
+
+// send what the socket takes without blocking, framing the next chunks as needed
+static int
+py_native_send_some(py_native_stream_t *stream)
+{
+    while(stream->uploading)
+    {
+	if(stream->iovcnt == 0)
+	{
+	    if(stream->last_queued)
+	    {
+		stream->uploading = 0;
+
+		break;
+	    }
+
+	    if(py_native_queue_chunk(stream) != 0)
+	    {
+		return -1;
+	    }
+
+	    continue;
+	}
+
+	struct msghdr msg = { .msg_iov = stream->iov_next, .msg_iovlen = stream->iovcnt };
+
+	ssize_t ret = sendmsg(stream->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if(ret < 0)
+	{
+	    if(errno == EINTR)
+	    {
+		continue;
+	    }
+
+	    if(errno == EAGAIN || errno == EWOULDBLOCK)
+	    {
+		return 0;
+	    }
+
+	    // the server may have answered before closing: read the response first
+	    if(errno == EPIPE || errno == ECONNRESET)
+	    {
+		stream->broken = errno;
+		stream->uploading = 0;
+
+		return 0;
+	    }
+
+	    return -1;
+	}
+
+	stream->bytes_sent += ret;
+
+	// skip what was written
+	while(stream->iovcnt > 0 && (size_t)ret >= stream->iov_next->iov_len)
+	{
+	    ret -= stream->iov_next->iov_len;
+	    stream->iov_next++;
+	    stream->iovcnt--;
+	}
+
+	if(stream->iovcnt > 0)
+	{
+	    stream->iov_next->iov_base = (char *)stream->iov_next->iov_base + ret;
+	    stream->iov_next->iov_len -= ret;
+	}
+    }
+
+    return 0;
+}
+
+// read more bytes at the end of the buffer, moving the unparsed ones first
+static int
+py_native_fill(py_native_stream_t *stream)
+{
+    if(stream->pos > 0)
+    {
+	memmove(stream->rbuf, stream->rbuf + stream->pos, stream->len - stream->pos);
+	stream->len -= stream->pos;
+	stream->pos = 0;
+    }
+
+    if(stream->len >= stream->rbuf_size)
+    {
+	return -1;
+    }
+
+    for(;;)
+    {
+	ssize_t ret = recv(stream->fd, stream->rbuf + stream->len, stream->rbuf_size - stream->len, MSG_DONTWAIT);
+	if(ret > 0)
+	{
+	    stream->len += ret;
+	    stream->bytes_received += ret;
+
+	    return 0;
+	}
+
+	if(ret == 0)
+	{
+	    // the server closed the connection
+	    return -1;
+	}
+
+	if(errno == EINTR)
+	{
+	    continue;
+	}
+
+	return (errno == EAGAIN || errno == EWOULDBLOCK) ? PY_NATIVE_AGAIN : -1;
+    }
+}
+
+// the line is valid until the next read, without its CRLF
+static int
+py_native_read_line(py_native_stream_t *stream, char **line)
+{
+    size_t scanned = 0;
+
+    for(;;)
+    {
+	char *start = stream->rbuf + stream->pos;
+	char *end = memchr(start + scanned, '\n', stream->len - stream->pos - scanned);
+
+	if(end != NULL)
+	{
+	    stream->pos += end - start + 1;
+
+	    if(end > start && end[-1] == '\r')
+	    {
+		end--;
+	    }
+
+	    *end = '\0';
+	    *line = start;
+
+	    return 0;
+	}
+
+	scanned = stream->len - stream->pos;
+
+	// an incomplete line is parsed again from its start
+	int ret = py_native_fill(stream);
+	if(ret != 0)
+	{
+	    return ret;
+	}
+    }
+}
+
+// read the lines up to the empty one, the lines already read are kept when the socket has no data
+static int
+py_native_read_headers(py_native_stream_t *stream, ci_headers_list_t *headers)
+{
+    for(;;)
+    {
+	char *line = NULL;
+
+	int ret = py_native_read_line(stream, &line);
+	if(ret != 0)
+	{
+	    return ret;
+	}
+
+	if(line[0] == '\0')
+	{
+	    return 0;
+	}
+
+	if(headers != NULL && ci_headers_add(headers, line) == NULL)
+	{
+	    return -1;
+	}
+    }
+}
+
+// the bytes needed by the header lines, and the empty line that ends them
+static size_t
+py_native_headers_size(ci_headers_list_t const *headers)
+{
+    size_t size = 2;
+
+    for(int idx = 0; idx < headers->used; idx++)
+    {
+	// the packed lines end with CRLF instead of a NUL byte
+	size += strcspn(headers->headers[idx], "\r\n") + 2;
+    }
+
+    return size;
+}
+
+static char *
+py_native_headers_copy(ci_headers_list_t const *headers, char *dest)
+{
+    for(int idx = 0; idx < headers->used; idx++)
+    {
+	size_t len = strcspn(headers->headers[idx], "\r\n");
+
+	memcpy(dest, headers->headers[idx], len);
+	memcpy(dest + len, PY_NATIVE_CRLF, 2);
+	dest += len + 2;
+    }
+
+    memcpy(dest, PY_NATIVE_CRLF, 2);
+
+    return dest + 2;
+}
+
+// a partial response only matters when the body is discarded, the original one is not kept to complete it
+static char const *
+py_native_allow(py_conn_job_t const *job, ci_request_t const *req)
+{
+    if(job->output.discard)
+    {
+	return "Allow: 204, 206\r\n";
+    }
+
+    return req->allow204 ? "Allow: 204\r\n" : "";
+}
+
+// the ICAP request line and its Host header, an IPv6 address is bracketed in both
+static int
+py_native_request_line(char *dest, size_t size, char const *method, py_conn_job_t const *job)
+{
+    int ipv6 = (strchr(job->host, ':') != NULL);
+    char const *lbracket = ipv6 ? "[" : "";
+    char const *rbracket = ipv6 ? "]" : "";
+
+    return snprintf(dest, size,
+		    "%s icap://%s%s%s:%d/%s ICAP/1.0\r\n"
+		    "Host: %s%s%s\r\n",
+		    method, lbracket, job->host, rbracket, job->port, job->service,
+		    lbracket, job->host, rbracket);
+}
+
+// the ICAP request line, its headers, then the encapsulated HTTP headers
+static int
+py_native_build_head(py_native_stream_t *stream, py_conn_job_t const *job, ci_request_t const *req,
+		     ci_headers_list_t const *req_headers, ci_headers_list_t const *resp_headers)
+{
+    char icap[1024];
+    char encapsulated[128];
+    size_t req_len = py_native_headers_size(req_headers);
+    size_t resp_len = (resp_headers != NULL) ? py_native_headers_size(resp_headers) : 0;
+    char preview[32] = "";
+
+    if(resp_headers != NULL)
+    {
+	snprintf(encapsulated, sizeof(encapsulated), "req-hdr=0, res-hdr=%zu, res-body=%zu",
+		 req_len, req_len + resp_len);
+    }
+    else
+    {
+	snprintf(encapsulated, sizeof(encapsulated), "req-hdr=0, req-body=%zu", req_len);
+    }
+
+    if(req->preview >= 0)
+    {
+	snprintf(preview, sizeof(preview), "Preview: %d\r\n", req->preview);
+    }
+
+    int line_len = py_native_request_line(icap, sizeof(icap),
+					  (job->type == ICAP_RESPMOD) ? "RESPMOD" : "REQMOD", job);
+    if(line_len < 0 || (size_t)line_len >= sizeof(icap))
+    {
+	return -1;
+    }
+
+    int icap_len = snprintf(icap + line_len, sizeof(icap) - line_len,
+			    "%s"
+			    "%s"
+			    "Encapsulated: %s\r\n"
+			    "\r\n",
+			    py_native_allow(job, req),
+			    preview, encapsulated);
+    if(icap_len < 0 || (size_t)icap_len >= sizeof(icap) - line_len)
+    {
+	return -1;
+    }
+
+    icap_len += line_len;
+
+    stream->head_len = icap_len + req_len + resp_len;
+    stream->head = malloc(stream->head_len);
+    if(stream->head == NULL)
+    {
+	return -1;
+    }
+
+    char *dest = stream->head;
+
+    memcpy(dest, icap, icap_len);
+    dest = py_native_headers_copy(req_headers, dest + icap_len);
+    if(resp_headers != NULL)
+    {
+	py_native_headers_copy(resp_headers, dest);
+    }
+
+    return 0;
+}
+
+// send the body until limit bytes were sent (or the end of the body for a negative limit),
+// each chunk going out in as few syscalls as possible, while the response is read
+static void
+py_native_send_body(py_native_stream_t *stream, py_conn_input_t *input, Py_ssize_t limit, int preview)
+{
+    stream->input = input;
+    stream->limit = limit;
+    stream->preview = preview;
+    stream->uploading = 1;
+    stream->last_queued = 0;
+    stream->eof = 0;
+    stream->iovcnt = 0;
+}
+
+// the ICAP status of the response line
+static int
+py_native_parse_status(ci_request_t const *req)
+{
+    int v1 = 0;
+    int v2 = 0;
+    int status = 0;
+
+    if(req->response_header->used <= 0 ||
+       sscanf(req->response_header->headers[0], "ICAP/%d.%d %d", &v1, &v2, &status) != 3)
+    {
+	return -1;
+    }
+
+    return status;
+}
+
+// the encapsulated HTTP headers are stored like the library does, they are read afterwards
+static int
+py_native_parse_entities(py_native_exchange_t *ex)
+{
+    ci_request_t *req = ex->req;
+    char const *encapsulated = ci_headers_value(req->response_header, "Encapsulated");
+
+    ex->hasbody = 0;
+    ex->nentities = 0;
+    ex->entity = 0;
+
+    if(encapsulated == NULL)
+    {
+	return 0;
+    }
+
+    while(*encapsulated != '\0')
+    {
+	char name[16];
+	int offset = 0;
+	int nread = 0;
+
+	if(sscanf(encapsulated, " %15[a-z-]=%d%n", name, &offset, &nread) != 2)
+	{
+	    return -1;
+	}
+
+	encapsulated += nread;
+	encapsulated += strspn(encapsulated, ", ");
+
+	int type = -1;
+	if(strcasecmp(name, "req-hdr") == 0)
+	{
+	    type = ICAP_REQ_HDR;
+	}
+	else if(strcasecmp(name, "res-hdr") == 0)
+	{
+	    type = ICAP_RES_HDR;
+	}
+	else if(strcasecmp(name, "req-body") == 0 || strcasecmp(name, "res-body") == 0 ||
+		strcasecmp(name, "opt-body") == 0)
+	{
+	    ex->hasbody = 1;
+	}
+
+	if(type < 0)
+	{
+	    continue;
+	}
+
+	if(ex->nentities >= PY_NATIVE_MAX_ENTITIES)
+	{
+	    return -1;
+	}
+
+	ci_encaps_entity_t *entity = ci_request_alloc_entity(req, type, offset);
+	if(entity == NULL)
+	{
+	    return -1;
+	}
+
+	req->entities[ex->nentities++] = entity;
+    }
+
+    return 0;
+}
+
+// the server options, parsed like the library does
+static void
+py_native_parse_options(ci_request_t *req)
+{
+    ci_headers_list_t *headers = req->response_header;
+
+    char const *value = ci_headers_value(headers, "Preview");
+    long preview = (value != NULL) ? strtol(value, NULL, 10) : -1;
+    req->preview = (preview >= 0 && preview <= INT_MAX) ? preview : -1;
+
+    req->allow204 = 0;
+#ifndef OLD_CICAP_VERSION
+    req->allow206 = 0;
+#endif
+
+    // a list of status codes
+    value = ci_headers_value(headers, "Allow");
+    while(value != NULL && *value != '\0')
+    {
+	char *end = NULL;
+	long code = strtol(value, &end, 10);
+	if(end == value)
+	{
+	    break;
+	}
+
+	if(code == 204)
+	{
+	    req->allow204 = 1;
+	}
+#ifndef OLD_CICAP_VERSION
+	else if(code == 206)
+	{
+	    req->allow206 = 1;
+	}
+#endif
+
+	value = end + strspn(end, ", ");
+    }
+
+    value = ci_headers_value(headers, "Connection");
+    req->keepalive = (value == NULL || strcasecmp(value, "close") != 0);
+}
+
+// parse what was received, returns 0 once the whole response is read, PY_NATIVE_AGAIN or -1
+static int
+py_native_advance(py_native_exchange_t *ex)
+{
+    py_native_stream_t *stream = &ex->stream;
+    char *line = NULL;
+    int ret = 0;
+
+    for(;;)
+    {
+	switch(ex->state)
+	{
+	case PY_NATIVE_STATUS:
+	    ret = py_native_read_headers(stream, ex->req->response_header);
+	    if(ret != 0)
+	    {
+		return ret;
+	    }
+
+	    ex->status = py_native_parse_status(ex->req);
+
+	    // the server wants the rest of the body, once it got the whole preview
+	    if(ex->in_preview && ex->status == 100 && !stream->eof && !stream->uploading && !stream->broken)
+	    {
+		ex->in_preview = 0;
+		ci_headers_reset(ex->req->response_header);
+		py_native_send_body(stream, ex->input, -1, 0);
+
+		if(py_native_send_some(stream) != 0)
+		{
+		    return -1;
+		}
+
+		// the final response follows
+		break;
+	    }
+
+	    if(ex->status < 0 || ex->status == 100 || py_native_parse_entities(ex) != 0)
+	    {
+		return -1;
+	    }
+
+	    ex->state = PY_NATIVE_ENTITIES;
+	    break;
+
+	case PY_NATIVE_ENTITIES:
+	    if(ex->entity < ex->nentities)
+	    {
+		ret = py_native_read_headers(stream, (ci_headers_list_t *)ex->req->entities[ex->entity]->entity);
+		if(ret != 0)
+		{
+		    return ret;
+		}
+
+		ex->entity++;
+	    }
+	    else
+	    {
+		ex->state = ex->hasbody ? PY_NATIVE_CHUNK_SIZE : PY_NATIVE_OVER;
+	    }
+	    break;
+
+	case PY_NATIVE_CHUNK_SIZE:
+	    ret = py_native_read_line(stream, &line);
+	    if(ret != 0)
+	    {
+		return ret;
+	    }
+
+	    char *end = NULL;
+	    errno = 0;
+	    ex->chunk_left = strtoull(line, &end, 16);
+	    if(end == line || errno != 0)
+	    {
+		return -1;
+	    }
+
+	    // the trailers follow the last chunk
+	    ex->state = (ex->chunk_left == 0) ? PY_NATIVE_TRAILERS : PY_NATIVE_CHUNK_DATA;
+	    break;
+
+	case PY_NATIVE_CHUNK_DATA:
+	    if(stream->pos == stream->len)
+	    {
+		ret = py_native_fill(stream);
+		if(ret != 0)
+		{
+		    return ret;
+		}
+	    }
+
+	    // decode the chunked body straight into the destination
+	    size_t len = stream->len - stream->pos;
+	    if(len > ex->chunk_left)
+	    {
+		len = ex->chunk_left;
+	    }
+
+	    if(ex->output != NULL && py_conn_write(ex->output, stream->rbuf + stream->pos, len) != (int)len)
+	    {
+		return -1;
+	    }
+
+	    stream->pos += len;
+	    ex->chunk_left -= len;
+
+	    if(ex->chunk_left == 0)
+	    {
+		ex->state = PY_NATIVE_CHUNK_END;
+	    }
+	    break;
+
+	case PY_NATIVE_CHUNK_END:
+	    // the CRLF after the chunk data
+	    ret = py_native_read_line(stream, &line);
+	    if(ret != 0)
+	    {
+		return ret;
+	    }
+
+	    if(line[0] != '\0')
+	    {
+		return -1;
+	    }
+
+	    ex->state = PY_NATIVE_CHUNK_SIZE;
+	    break;
+
+	case PY_NATIVE_TRAILERS:
+	    ret = py_native_read_headers(stream, NULL);
+	    if(ret != 0)
+	    {
+		return ret;
+	    }
+
+	    ex->state = PY_NATIVE_OVER;
+	    break;
+
+	case PY_NATIVE_OVER:
+	    return 0;
+
+	case PY_NATIVE_FAILED:
+	    return -1;
+	}
+    }
+}
+
+static py_native_exchange_t *
+py_native_alloc(py_conn_job_t *job, ci_connection_t *conn)
+{
+    py_native_exchange_t *ex = calloc(1, sizeof(*ex));
+    if(ex == NULL)
+    {
+	return NULL;
+    }
+
+    py_native_stream_t *stream = &ex->stream;
+    // the library writer cannot be driven by an event loop: the native one always sends the body
+    size_t payload_size = (job->io_buffer_size > 0) ? (size_t)job->io_buffer_size : PY_NATIVE_DEFAULT_CHUNK_SIZE;
+
+    stream->fd = conn->fd;
+    stream->timeout = (job->timeout > 0) ? job->timeout * 1000 : -1;
+    stream->payload_size = payload_size;
+    stream->rbuf_size = (payload_size > PY_NATIVE_MIN_READ_SIZE) ? payload_size : PY_NATIVE_MIN_READ_SIZE;
+
+    // the chunk being sent and the bytes being received share one allocation
+    stream->payload = malloc(stream->payload_size + stream->rbuf_size);
+    if(stream->payload == NULL)
+    {
+	free(ex);
+
+	return NULL;
+    }
+
+    stream->rbuf = stream->payload + stream->payload_size;
+
+    ex->state = PY_NATIVE_STATUS;
+    ex->req = job->req;
+    ex->input = &job->input;
+    ci_headers_reset(ex->req->response_header);
+
+    return ex;
+}
+
+static void
+py_native_free(py_native_exchange_t *ex)
+{
+    free(ex->stream.head), ex->stream.head = NULL;
+    free(ex->stream.payload), ex->stream.payload = NULL;
+    free(ex);
+}
+
+py_native_exchange_t *
+py_native_begin_options(py_conn_job_t *job, ci_connection_t *conn)
+{
+    char head[1024];
+
+    py_native_exchange_t *ex = py_native_alloc(job, conn);
+    if(ex == NULL)
+    {
+	return NULL;
+    }
+
+    py_native_stream_t *stream = &ex->stream;
+
+    int line_len = py_native_request_line(head, sizeof(head), "OPTIONS", job);
+    int head_len = (line_len < 0 || (size_t)line_len >= sizeof(head)) ? -1 :
+	snprintf(head + line_len, sizeof(head) - line_len, "Encapsulated: null-body=0\r\n\r\n");
+    if(head_len < 0 || (size_t)head_len >= sizeof(head) - line_len)
+    {
+	py_native_free(ex);
+
+	return NULL;
+    }
+
+    stream->head_len = line_len + head_len;
+    stream->head = malloc(stream->head_len);
+    if(stream->head == NULL)
+    {
+	py_native_free(ex);
+
+	return NULL;
+    }
+
+    memcpy(stream->head, head, stream->head_len);
+
+    // only the head is sent
+    stream->iov[0].iov_base = stream->head;
+    stream->iov[0].iov_len = stream->head_len;
+    stream->iov_next = stream->iov;
+    stream->iovcnt = 1;
+    stream->last_queued = 1;
+    stream->uploading = 1;
+
+    ex->options = 1;
+
+    return ex;
+}
+
+py_native_exchange_t *
+py_native_begin(py_conn_job_t *job, ci_connection_t *conn,
+		ci_headers_list_t *req_headers, ci_headers_list_t *resp_headers)
+{
+    py_native_exchange_t *ex = py_native_alloc(job, conn);
+    if(ex == NULL)
+    {
+	job->output.nomem = 1;
+
+	return NULL;
+    }
+
+    ci_request_t *req = job->req;
+
+    if(py_native_build_head(&ex->stream, job, req, req_headers,
+			    (job->type == ICAP_RESPMOD) ? resp_headers : NULL) != 0)
+    {
+	job->output.nomem = 1;
+	py_native_free(ex);
+
+	return NULL;
+    }
+
+    ex->output = &job->output;
+    ex->in_preview = (req->preview >= 0);
+
+    if(ex->in_preview)
+    {
+	py_native_send_body(&ex->stream, &job->input, req->preview, 1);
+    }
+    else
+    {
+	py_native_send_body(&ex->stream, &job->input, -1, 0);
+    }
+
+    return ex;
+}
+
+int
+py_native_step(py_native_exchange_t *ex)
+{
+    py_native_stream_t *stream = &ex->stream;
+
+    // the parse errors have no errno
+    errno = 0;
+
+    // a server may answer, or echo the body, before reading all of it:
+    // the body is sent as far as the socket takes it, then the response is read
+    int ret = py_native_send_some(stream);
+    if(ret == 0)
+    {
+	ret = py_native_advance(ex);
+    }
+
+    if(ret < 0)
+    {
+	ex->error = stream->broken ? stream->broken : errno;
+	ex->state = PY_NATIVE_FAILED;
+
+	return -1;
+    }
+
+    if(ret == 0)
+    {
+	return 0;
+    }
+
+    // the socket has no data yet, and maybe no room for the body either
+    return PY_CONN_WANT_READ | (stream->uploading ? PY_CONN_WANT_WRITE : 0);
+}
+
+int
+py_native_end(py_native_exchange_t *ex)
+{
+    ci_request_t *req = ex->req;
+    py_native_stream_t *stream = &ex->stream;
+    int status = (ex->state == PY_NATIVE_OVER) ? ex->status : CI_ERROR;
+    int error = ex->error;
+
+    if(ex->state == PY_NATIVE_OVER)
+    {
+	if(ex->options)
+	{
+	    py_native_parse_options(req);
+	}
+	// the server answered before getting the whole body: the rest of it
+	// was not sent and the socket cannot be reused
+	else if(stream->uploading || stream->broken)
+	{
+	    req->keepalive = 0;
+	}
+    }
+
+    req->bytes_out += stream->bytes_sent;
+    req->bytes_in += stream->bytes_received;
+
+    py_native_free(ex);
+
+    if(status == CI_ERROR)
+    {
+	errno = error;
+    }
+
+    return status;
+}
+
+int
+py_native_exchange(py_conn_job_t *job, ci_connection_t *conn,
+		   ci_headers_list_t *req_headers, ci_headers_list_t *resp_headers)
+{
+    py_native_exchange_t *ex = py_native_begin(job, conn, req_headers, resp_headers);
+    if(ex == NULL)
+    {
+	return CI_ERROR;
+    }
+
+    // the same steps as an event loop, waiting for the socket in between
+    int want = 0;
+    while((want = py_native_step(ex)) > 0)
+    {
+	short events = ((want & PY_CONN_WANT_READ) ? POLLIN : 0) | ((want & PY_CONN_WANT_WRITE) ? POLLOUT : 0);
+
+	if(py_native_wait(&ex->stream, events) < 0)
+	{
+	    ex->error = errno;
+	    ex->state = PY_NATIVE_FAILED;
+
+	    break;
+	}
+    }
+
+    return py_native_end(ex);
+}
@@ -0,0 +1,44 @@
+/* -*- Mode: C; c-basic-offset: 4 -*- */
+/*
+ * Copyright 2015 Vincent Rasneur <vrasneur@free.fr>
+ * All Rights Reserved.
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation, version 3.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ *   NON INFRINGEMENT.  See the GNU General Public License for
+ *   more details.
+ */
+
+#ifndef PY_ICAP_NATIVE_CLIENT_H
+#define PY_ICAP_NATIVE_CLIENT_H
+
+#include "ICAPConnection.h"
+#include "cicap_compat.h"
+
+// an exchange over an already connected socket, resumed when the socket is ready
+typedef struct py_native_exchange py_native_exchange_t;
+
+// all the functions must be called without holding the GIL
+
+// the OPTIONS request of the job, or the job request itself: the headers are copied
+py_native_exchange_t *py_native_begin_options(py_conn_job_t *job, ci_connection_t *conn);
+py_native_exchange_t *py_native_begin(py_conn_job_t *job, ci_connection_t *conn,
+				      ci_headers_list_t *req_headers, ci_headers_list_t *resp_headers);
+// do what the socket allows without blocking: returns the PY_CONN_WANT_* flags to wait for,
+// 0 once the response is read, or -1
+int py_native_step(py_native_exchange_t *ex);
+// free the exchange, returns the ICAP status, or CI_ERROR with errno set
+// the OPTIONS values are stored in the request, like ci_client_get_server_options does
+int py_native_end(py_native_exchange_t *ex);
+
+// send the request over an already connected socket and read the response,
+// the same contract as ci_client_icapfilter: returns the ICAP status or CI_ERROR
+int py_native_exchange(py_conn_job_t *job, ci_connection_t *conn,
+		       ci_headers_list_t *req_headers, ci_headers_list_t *resp_headers);
+
+#endif // PY_ICAP_NATIVE_CLIENT_H
@@ -0,0 +1,286 @@
+/* -*- Mode: C; c-basic-offset: 4 -*- */
+/*
+ * Copyright 2015 Vincent Rasneur <vrasneur@free.fr>
+ * All Rights Reserved.
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation, version 3.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ *   NON INFRINGEMENT.  See the GNU General Public License for
+ *   more details.
+ */
+
+#include "options_cache.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "timeutil.h"
+
+typedef struct py_options_entry
+{
+    struct py_options_entry *next;
+    char *host;
+    int port;
+    char *service;
+    py_options_t opts;
+} py_options_entry_t;
+
+// the cache is a simple list: there are only a few ICAP services per process
+static py_options_entry_t *py_options_cache = NULL;
+static pthread_mutex_t py_options_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *
+py_options_header_dup(ci_headers_list_t *headers, char const *name)
+{
+    char const *value = ci_headers_value(headers, name);
+
+    return (value != NULL) ? strdup(value) : NULL;
+}
+
+static void
+py_options_transfer_release(py_options_transfer_t *transfer)
+{
+    // the copies are released without the cache lock
+    if(transfer == NULL || __atomic_sub_fetch(&transfer->refs, 1, __ATOMIC_ACQ_REL) != 0)
+    {
+	return;
+    }
+
+    free(transfer->preview);
+    free(transfer->ignore);
+    free(transfer->complete);
+    free(transfer);
+}
+
+static py_options_transfer_t *
+py_options_transfer_new(ci_headers_list_t *headers)
+{
+    if(ci_headers_value(headers, "Transfer-Preview") == NULL &&
+       ci_headers_value(headers, "Transfer-Ignore") == NULL &&
+       ci_headers_value(headers, "Transfer-Complete") == NULL)
+    {
+	return NULL;
+    }
+
+    py_options_transfer_t *transfer = calloc(1, sizeof(*transfer));
+    if(transfer == NULL)
+    {
+	return NULL;
+    }
+
+    transfer->refs = 1;
+    transfer->preview = py_options_header_dup(headers, "Transfer-Preview");
+    transfer->ignore = py_options_header_dup(headers, "Transfer-Ignore");
+    transfer->complete = py_options_header_dup(headers, "Transfer-Complete");
+
+    return transfer;
+}
+
+void
+py_options_fill(py_options_t *opts, ci_request_t const *req)
+{
+    ci_headers_list_t *headers = req->response_header;
+
+    memset(opts, 0, sizeof(*opts));
+
+    opts->preview = req->preview;
+    opts->allow204 = req->allow204;
+#ifndef OLD_CICAP_VERSION
+    opts->allow206 = req->allow206;
+#endif
+    opts->keepalive = req->keepalive;
+
+    if(headers == NULL)
+    {
+	return;
+    }
+
+    char const *istag = ci_headers_value(headers, "ISTag");
+    if(istag != NULL)
+    {
+	snprintf(opts->istag, sizeof(opts->istag), "%s", istag);
+    }
+
+    opts->transfer = py_options_transfer_new(headers);
+
+    // no Options-TTL header: the OPTIONS response does not expire (RFC 3507 4.10.2)
+    char const *ttl = ci_headers_value(headers, "Options-TTL");
+    if(ttl != NULL)
+    {
+	long secs = strtol(ttl, NULL, 10);
+	// an invalid or null TTL: the OPTIONS response must not be cached
+	opts->expires = (secs > 0) ? py_time_now() + secs : -1;
+    }
+}
+
+void
+py_options_apply(py_options_t const *opts, ci_request_t *req)
+{
+    req->preview = opts->preview;
+    req->allow204 = opts->allow204;
+#ifndef OLD_CICAP_VERSION
+    req->allow206 = opts->allow206;
+#endif
+    req->keepalive = opts->keepalive;
+}
+
+void
+py_options_free(py_options_t *opts)
+{
+    py_options_transfer_release(opts->transfer), opts->transfer = NULL;
+}
+
+// the lists are not copied, only referenced
+static void
+py_options_copy(py_options_t *dst, py_options_t const *src)
+{
+    *dst = *src;
+
+    if(dst->transfer != NULL)
+    {
+	__atomic_add_fetch(&dst->transfer->refs, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void
+py_options_entry_free(py_options_entry_t *entry)
+{
+    free(entry->host), entry->host = NULL;
+    free(entry->service), entry->service = NULL;
+    py_options_free(&entry->opts);
+    free(entry);
+}
+
+// must be called with the cache lock held
+static py_options_entry_t **
+py_options_cache_find(char const *host, int port, char const *service)
+{
+    py_options_entry_t **pentry = &py_options_cache;
+
+    for(; *pentry != NULL; pentry = &(*pentry)->next)
+    {
+	py_options_entry_t *entry = *pentry;
+
+	if(entry->port == port && strcmp(entry->host, host) == 0 &&
+	   strcmp(entry->service, service) == 0)
+	{
+	    break;
+	}
+    }
+
+    return pentry;
+}
+
+// must be called with the cache lock held
+static void
+py_options_cache_remove(py_options_entry_t **pentry)
+{
+    py_options_entry_t *entry = *pentry;
+
+    *pentry = entry->next;
+    py_options_entry_free(entry);
+}
+
+int
+py_options_cache_get(char const *host, int port, char const *service, py_options_t *opts)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&py_options_cache_lock);
+
+    py_options_entry_t **pentry = py_options_cache_find(host, port, service);
+    if(*pentry != NULL)
+    {
+	py_options_entry_t *entry = *pentry;
+
+	if(entry->opts.expires != 0 && entry->opts.expires <= py_time_now())
+	{
+	    py_options_cache_remove(pentry);
+	}
+	else
+	{
+	    py_options_copy(opts, &entry->opts);
+	    found = 1;
+	}
+    }
+
+    pthread_mutex_unlock(&py_options_cache_lock);
+
+    return found;
+}
+
+void
+py_options_cache_put(char const *host, int port, char const *service, py_options_t const *opts)
+{
+    pthread_mutex_lock(&py_options_cache_lock);
+
+    py_options_entry_t **pentry = py_options_cache_find(host, port, service);
+    if(*pentry != NULL)
+    {
+	py_options_cache_remove(pentry);
+    }
+
+    if(opts->expires >= 0)
+    {
+	py_options_entry_t *entry = calloc(1, sizeof(*entry));
+	if(entry != NULL)
+	{
+	    entry->host = strdup(host);
+	    entry->port = port;
+	    entry->service = strdup(service);
+	    py_options_copy(&entry->opts, opts);
+
+	    if(entry->host == NULL || entry->service == NULL)
+	    {
+		py_options_entry_free(entry);
+	    }
+	    else
+	    {
+		entry->next = py_options_cache;
+		py_options_cache = entry;
+	    }
+	}
+    }
+
+    pthread_mutex_unlock(&py_options_cache_lock);
+}
+
+void
+py_options_cache_check_istag(char const *host, int port, char const *service, char const *istag)
+{
+    if(istag == NULL)
+    {
+	return;
+    }
+
+    pthread_mutex_lock(&py_options_cache_lock);
+
+    // the service has changed: its options may have changed too
+    py_options_entry_t **pentry = py_options_cache_find(host, port, service);
+    if(*pentry != NULL && strncmp((*pentry)->opts.istag, istag, ICAP_ISTAG_SIZE - 1) != 0)
+    {
+	py_options_cache_remove(pentry);
+    }
+
+    pthread_mutex_unlock(&py_options_cache_lock);
+}
+
+void
+py_options_cache_clear(void)
+{
+    pthread_mutex_lock(&py_options_cache_lock);
+
+    while(py_options_cache != NULL)
+    {
+	py_options_cache_remove(&py_options_cache);
+    }
+
+    pthread_mutex_unlock(&py_options_cache_lock);
+}
@@ -0,0 +1,60 @@
+/* -*- Mode: C; c-basic-offset: 4 -*- */
+/*
+ * Copyright 2015 Vincent Rasneur <vrasneur@free.fr>
+ * All Rights Reserved.
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation, version 3.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ *   NON INFRINGEMENT.  See the GNU General Public License for
+ *   more details.
+ */
+
+#ifndef PY_ICAP_OPTIONS_CACHE_H
+#define PY_ICAP_OPTIONS_CACHE_H
+
+#include <time.h>
+
+#include "cicap_compat.h"
+
+// the ISTag value is at most 32 characters long, plus the quotes
+#define ICAP_ISTAG_SIZE 64
+
+// the Transfer-* lists, shared by the cache entry and its copies
+typedef struct
+{
+    int refs;
+    char *preview;
+    char *ignore;
+    char *complete;
+} py_options_transfer_t;
+
+// the server values sent back in an OPTIONS response
+typedef struct
+{
+    int preview;
+    int allow204;
+    int allow206;
+    int keepalive;
+    char istag[ICAP_ISTAG_SIZE];
+    // NULL without any Transfer-* header
+    py_options_transfer_t *transfer;
+    // monotonic time in seconds, 0 if the options never expire
+    time_t expires;
+} py_options_t;
+
+void py_options_fill(py_options_t *opts, ci_request_t const *req);
+void py_options_apply(py_options_t const *opts, ci_request_t *req);
+void py_options_free(py_options_t *opts);
+
+// the cache functions can be called without holding the GIL
+int py_options_cache_get(char const *host, int port, char const *service, py_options_t *opts);
+void py_options_cache_put(char const *host, int port, char const *service, py_options_t const *opts);
+void py_options_cache_check_istag(char const *host, int port, char const *service, char const *istag);
+void py_options_cache_clear(void);
+
+#endif // PY_ICAP_OPTIONS_CACHE_H
@@ -0,0 +1,265 @@
+/* -*- Mode: C; c-basic-offset: 4 -*- */
+/*
+ * Copyright 2015 Vincent Rasneur <vrasneur@free.fr>
+ * All Rights Reserved.
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation, version 3.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ *   NON INFRINGEMENT.  See the GNU General Public License for
+ *   more details.
+ */
+
+#include "py_compat.h"
+
+#include <limits.h>
+#include <string.h>
+
+static int
+py_args_count(char const *const *kwlist)
+{
+    int count = 0;
+
+    while(kwlist[count] != NULL)
+    {
+	count++;
+    }
+
+    return count;
+}
+
+// the position of a keyword argument, -1 if unknown
+static int
+py_args_index(char const *const *kwlist, int count, PyObject *key)
+{
+    for(int idx = 0; idx < count; idx++)
+    {
+#if PY_MAJOR_VERSION >= 3
+	if(PyUnicode_Check(key) && PyUnicode_CompareWithASCIIString(key, kwlist[idx]) == 0)
+#else
+	if(PyString_Check(key) && strcmp(PyString_AS_STRING(key), kwlist[idx]) == 0)
+#endif
+	{
+	    return idx;
+	}
+    }
+
+    return -1;
+}
+
+static int
+py_args_set_keyword(char const *fname, char const *const *kwlist, int count, PyObject **values,
+		    PyObject *key, PyObject *value)
+{
+    int idx = py_args_index(kwlist, count, key);
+    if(idx < 0)
+    {
+#if PY_MAJOR_VERSION >= 3
+	PyErr_Format(PyExc_TypeError, "%s() got an unexpected keyword argument %R", fname, key);
+#else
+	PyErr_Format(PyExc_TypeError, "%s() got an unexpected keyword argument '%s'", fname,
+		     PyString_Check(key) ? PyString_AS_STRING(key) : "?");
+#endif
+
+	return -1;
+    }
+
+    if(values[idx] != NULL)
+    {
+	PyErr_Format(PyExc_TypeError, "%s() got multiple values for argument '%s'", fname, kwlist[idx]);
+
+	return -1;
+    }
+
+    values[idx] = value;
+
+    return 0;
+}
+
+static int
+py_args_check(char const *fname, char const *const *kwlist, int nrequired, PyObject **values)
+{
+    for(int idx = 0; idx < nrequired; idx++)
+    {
+	if(values[idx] == NULL)
+	{
+	    PyErr_Format(PyExc_TypeError, "%s() missing required argument '%s'", fname, kwlist[idx]);
+
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+int
+py_args_parse_vector(char const *fname, char const *const *kwlist, int nrequired, PyObject **values,
+		     PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    int count = py_args_count(kwlist);
+
+    memset(values, 0, count * sizeof(*values));
+
+    if(nargs > count)
+    {
+	PyErr_Format(PyExc_TypeError, "%s() takes at most %d arguments (%zd given)", fname, count, nargs);
+
+	return -1;
+    }
+
+    for(Py_ssize_t idx = 0; idx < nargs; idx++)
+    {
+	values[idx] = args[idx];
+    }
+
+    // the keyword values follow the positional ones
+    Py_ssize_t nkwargs = (kwnames != NULL) ? PyTuple_GET_SIZE(kwnames) : 0;
+
+    for(Py_ssize_t idx = 0; idx < nkwargs; idx++)
+    {
+	if(py_args_set_keyword(fname, kwlist, count, values,
+			       PyTuple_GET_ITEM(kwnames, idx), args[nargs + idx]) != 0)
+	{
+	    return -1;
+	}
+    }
+
+    return py_args_check(fname, kwlist, nrequired, values);
+}
+
+int
+py_args_parse_tuple(char const *fname, char const *const *kwlist, int nrequired, PyObject **values,
+		    PyObject *args, PyObject *kwds)
+{
+    int count = py_args_count(kwlist);
+    Py_ssize_t nargs = PyTuple_GET_SIZE(args);
+
+    memset(values, 0, count * sizeof(*values));
+
+    if(nargs > count)
+    {
+	PyErr_Format(PyExc_TypeError, "%s() takes at most %d arguments (%zd given)", fname, count, nargs);
+
+	return -1;
+    }
+
+    for(Py_ssize_t idx = 0; idx < nargs; idx++)
+    {
+	values[idx] = PyTuple_GET_ITEM(args, idx);
+    }
+
+    if(kwds != NULL)
+    {
+	PyObject *key = NULL;
+	PyObject *value = NULL;
+	Py_ssize_t pos = 0;
+
+	while(PyDict_Next(kwds, &pos, &key, &value))
+	{
+	    if(py_args_set_keyword(fname, kwlist, count, values, key, value) != 0)
+	    {
+		return -1;
+	    }
+	}
+    }
+
+    return py_args_check(fname, kwlist, nrequired, values);
+}
+
+int
+py_args_string(PyObject *value, char const *name, char const **result)
+{
+    if(value == NULL || value == Py_None)
+    {
+	return 0;
+    }
+
+    if(PyBytes_Check(value))
+    {
+	if(strlen(PyBytes_AS_STRING(value)) != (size_t)PyBytes_GET_SIZE(value))
+	{
+	    PyErr_Format(PyExc_ValueError, "%s must not contain null bytes", name);
+
+	    return -1;
+	}
+
+	*result = PyBytes_AS_STRING(value);
+
+	return 0;
+    }
+
+    if(PyUnicode_Check(value))
+    {
+#if PY_MAJOR_VERSION >= 3
+	// cached in the object, like the "s" format does
+	Py_ssize_t size = 0;
+
+	*result = PyUnicode_AsUTF8AndSize(value, &size);
+	if(*result == NULL)
+	{
+	    return -1;
+	}
+
+	if(strlen(*result) != (size_t)size)
+	{
+	    PyErr_Format(PyExc_ValueError, "%s must not contain null bytes", name);
+
+	    return -1;
+	}
+
+	return 0;
+#else
+	char *str = NULL;
+
+	if(!PyArg_Parse(value, "s", &str))
+	{
+	    return -1;
+	}
+
+	*result = str;
+
+	return 0;
+#endif
+    }
+
+    PyErr_Format(PyExc_TypeError, "%s must be a string", name);
+
+    return -1;
+}
+
+int
+py_args_int(PyObject *value, char const *name, int *result)
+{
+    if(value == NULL || value == Py_None)
+    {
+	return 0;
+    }
+
+    if(!PyInt_Check(value) && !PyLong_Check(value))
+    {
+	PyErr_Format(PyExc_TypeError, "%s must be an integer", name);
+
+	return -1;
+    }
+
+    long number = PyInt_AsLong(value);
+    if(number == -1 && PyErr_Occurred())
+    {
+	return -1;
+    }
+
+    if(number < INT_MIN || number > INT_MAX)
+    {
+	PyErr_Format(PyExc_OverflowError, "%s is out of range", name);
+
+	return -1;
+    }
+
+    *result = number;
+
+    return 0;
+}
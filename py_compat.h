@@ -0,0 +1,69 @@
+/* -*- Mode: C; c-basic-offset: 4 -*- */
+/*
+ * Copyright 2015 Vincent Rasneur <vrasneur@free.fr>
+ * All Rights Reserved.
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation, version 3.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ *   NON INFRINGEMENT.  See the GNU General Public License for
+ *   more details.
+ */
+
+#ifndef PY_ICAP_PY_COMPAT_H
+#define PY_ICAP_PY_COMPAT_H
+
+// the "#" formats take Py_ssize_t lengths
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#if PY_MAJOR_VERSION >= 3
+// the raw header bytes stay bytes, like the str of Python 2
+#define PyString_Check PyBytes_Check
+#define PyString_AS_STRING PyBytes_AS_STRING
+#define PyString_FromString PyBytes_FromString
+#define PyString_FromStringAndSize PyBytes_FromStringAndSize
+#define PyInt_Check PyLong_Check
+#define PyInt_FromLong PyLong_FromLong
+#define PyInt_AsLong PyLong_AsLong
+
+// the Py_BuildValue format of the raw bytes
+#define PY_BYTES_FORMAT "y"
+// filenames and host names are text
+#define PY_TEXT_CHECK(obj) PyUnicode_Check(obj)
+#else
+#define PY_BYTES_FORMAT "s"
+#define PY_TEXT_CHECK(obj) (PyString_Check(obj) || PyUnicode_Check(obj))
+#endif
+
+// the methods called for each scan get their arguments without any tuple or dict
+#if PY_VERSION_HEX >= 0x03070000
+#define PY_METH_FAST (METH_FASTCALL | METH_KEYWORDS)
+#define PY_FAST_ARGS PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames
+#define PY_FAST_PASS args, nargs, kwnames
+#define py_args_parse(fname, kwlist, nrequired, values) \
+    py_args_parse_vector((fname), (kwlist), (nrequired), (values), args, nargs, kwnames)
+#else
+#define PY_METH_FAST (METH_VARARGS | METH_KEYWORDS)
+#define PY_FAST_ARGS PyObject *args, PyObject *kwds
+#define PY_FAST_PASS args, kwds
+#define py_args_parse(fname, kwlist, nrequired, values) \
+    py_args_parse_tuple((fname), (kwlist), (nrequired), (values), args, kwds)
+#endif
+
+// store the arguments in values, in the kwlist order, NULL when not given
+// the references are borrowed from the caller
+int py_args_parse_vector(char const *fname, char const *const *kwlist, int nrequired, PyObject **values,
+			 PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames);
+int py_args_parse_tuple(char const *fname, char const *const *kwlist, int nrequired, PyObject **values,
+			PyObject *args, PyObject *kwds);
+
+// the converters keep the default value when the argument is missing or None
+int py_args_string(PyObject *value, char const *name, char const **result);
+int py_args_int(PyObject *value, char const *name, int *result);
+
+#endif // PY_ICAP_PY_COMPAT_H
@@ -0,0 +1,570 @@
+/* -*- Mode: C; c-basic-offset: 4 -*- */
+/*
+ * Copyright 2015 Vincent Rasneur <vrasneur@free.fr>
+ * All Rights Reserved.
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation, version 3.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ *   NON INFRINGEMENT.  See the GNU General Public License for
+ *   more details.
+ */
+
+#include "resolver.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <net_io.h>
+
+#include "timeutil.h"
+
+// the delay before trying the next address, in milliseconds (RFC 8305)
+#define RESOLVER_ATTEMPT_DELAY 250
+// the most addresses tried for a name
+#define RESOLVER_MAX_ADDRS 16
+// in seconds
+#define RESOLVER_DEFAULT_TTL 60
+
+typedef struct
+{
+    struct sockaddr_storage addr;
+    socklen_t len;
+} py_resolver_addr_t;
+
+typedef struct py_resolver_entry
+{
+    struct py_resolver_entry *next;
+    char *host;
+    int port;
+    int proto;
+    int naddrs;
+    py_resolver_addr_t addrs[RESOLVER_MAX_ADDRS];
+    // monotonic time in seconds
+    time_t expires;
+} py_resolver_entry_t;
+
+// the addresses are tried one after the other: an event loop only watches one socket
+struct py_resolver_attempt
+{
+    py_resolver_entry_t result;
+    int cached;
+    // the next address to try, and the one being tried
+    int next;
+    int idx;
+    int fd;
+};
+
+static py_resolver_entry_t *py_resolver_cache = NULL;
+static int py_resolver_ttl = RESOLVER_DEFAULT_TTL;
+static pthread_mutex_t py_resolver_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// must be called with the cache lock held
+static py_resolver_entry_t **
+py_resolver_find(char const *host, int port, int proto)
+{
+    py_resolver_entry_t **pentry = &py_resolver_cache;
+
+    for(; *pentry != NULL; pentry = &(*pentry)->next)
+    {
+	py_resolver_entry_t *entry = *pentry;
+
+	if(entry->port == port && entry->proto == proto && strcmp(entry->host, host) == 0)
+	{
+	    break;
+	}
+    }
+
+    return pentry;
+}
+
+// must be called with the cache lock held
+static void
+py_resolver_remove(py_resolver_entry_t **pentry)
+{
+    py_resolver_entry_t *entry = *pentry;
+
+    *pentry = entry->next;
+    free(entry->host);
+    free(entry);
+}
+
+static int
+py_resolver_cache_get(py_resolver_entry_t *result)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&py_resolver_lock);
+
+    py_resolver_entry_t **pentry = py_resolver_find(result->host, result->port, result->proto);
+    if(*pentry != NULL)
+    {
+	if((*pentry)->expires <= py_time_now())
+	{
+	    py_resolver_remove(pentry);
+	}
+	else
+	{
+	    result->naddrs = (*pentry)->naddrs;
+	    memcpy(result->addrs, (*pentry)->addrs, sizeof(result->addrs));
+	    found = 1;
+	}
+    }
+
+    pthread_mutex_unlock(&py_resolver_lock);
+
+    return found;
+}
+
+static void
+py_resolver_cache_put(py_resolver_entry_t const *result)
+{
+    pthread_mutex_lock(&py_resolver_lock);
+
+    py_resolver_entry_t **pentry = py_resolver_find(result->host, result->port, result->proto);
+    if(*pentry != NULL)
+    {
+	py_resolver_remove(pentry);
+    }
+
+    if(py_resolver_ttl > 0)
+    {
+	py_resolver_entry_t *entry = malloc(sizeof(*entry));
+	if(entry != NULL)
+	{
+	    *entry = *result;
+	    entry->host = strdup(result->host);
+	    entry->expires = py_time_now() + py_resolver_ttl;
+
+	    if(entry->host == NULL)
+	    {
+		free(entry);
+	    }
+	    else
+	    {
+		entry->next = py_resolver_cache;
+		py_resolver_cache = entry;
+	    }
+	}
+    }
+
+    pthread_mutex_unlock(&py_resolver_lock);
+}
+
+// the addresses may have changed when none of them answers
+static void
+py_resolver_cache_invalidate(char const *host, int port, int proto)
+{
+    pthread_mutex_lock(&py_resolver_lock);
+
+    py_resolver_entry_t **pentry = py_resolver_find(host, port, proto);
+    if(*pentry != NULL)
+    {
+	py_resolver_remove(pentry);
+    }
+
+    pthread_mutex_unlock(&py_resolver_lock);
+}
+
+// resolve all the A/AAAA records, alternating the address families
+static int
+py_resolver_resolve(py_resolver_entry_t *result)
+{
+    struct addrinfo hints;
+    struct addrinfo *res = NULL;
+    char service[16];
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = result->proto;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+
+    snprintf(service, sizeof(service), "%d", result->port);
+
+    if(getaddrinfo(result->host, service, &hints, &res) != 0)
+    {
+	return -1;
+    }
+
+    // the first family is the one preferred by the system
+    int families[2] = { res->ai_family, (res->ai_family == AF_INET6) ? AF_INET : AF_INET6 };
+    struct addrinfo *next[2] = { res, res };
+
+    result->naddrs = 0;
+
+    for(int turn = 0; result->naddrs < RESOLVER_MAX_ADDRS; turn = !turn)
+    {
+	struct addrinfo *ai = next[turn];
+
+	while(ai != NULL && ai->ai_family != families[turn])
+	{
+	    ai = ai->ai_next;
+	}
+
+	if(ai == NULL)
+	{
+	    // this family is exhausted, is the other one too?
+	    if(next[!turn] == NULL)
+	    {
+		break;
+	    }
+
+	    next[turn] = NULL;
+
+	    continue;
+	}
+
+	next[turn] = ai->ai_next;
+
+	// the library may be built without IPv6 support
+	if(ai->ai_addrlen <= sizeof(((ci_sockaddr_t *)NULL)->sockaddr))
+	{
+	    py_resolver_addr_t *addr = &result->addrs[result->naddrs++];
+
+	    memcpy(&addr->addr, ai->ai_addr, ai->ai_addrlen);
+	    addr->len = ai->ai_addrlen;
+	}
+    }
+
+    freeaddrinfo(res);
+
+    return (result->naddrs > 0) ? 0 : -1;
+}
+
+static int
+py_resolver_start(py_resolver_addr_t const *addr)
+{
+    int fd = socket(addr->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+    {
+	return -1;
+    }
+
+    if(connect(fd, (struct sockaddr const *)&addr->addr, addr->len) != 0 && errno != EINPROGRESS)
+    {
+	close(fd);
+
+	return -1;
+    }
+
+    return fd;
+}
+
+// start a connection attempt every RESOLVER_ATTEMPT_DELAY milliseconds
+// until one of them succeeds, returns the index of the winning address
+static int
+py_resolver_race(py_resolver_addr_t const *addrs, int naddrs, int timeout, int *fd)
+{
+    struct pollfd fds[RESOLVER_MAX_ADDRS];
+    int indexes[RESOLVER_MAX_ADDRS];
+    int pending = 0;
+    int next = 0;
+    int winner = -1;
+    // without a timeout, only the system connect timeout applies, like in the library
+    int64_t deadline = (timeout > 0) ? py_time_now_ns() + (int64_t)timeout * 1000000000 : INT64_MAX;
+    int64_t next_attempt = 0;
+
+    while(winner < 0)
+    {
+	int64_t now = py_time_now_ns();
+
+	if(now >= deadline)
+	{
+	    break;
+	}
+
+	// start the next attempt when the pending ones are too slow, or all failed
+	if(next < naddrs && (now >= next_attempt || pending == 0))
+	{
+	    int sock = py_resolver_start(&addrs[next]);
+	    if(sock >= 0)
+	    {
+		fds[pending].fd = sock;
+		fds[pending].events = POLLOUT;
+		fds[pending].revents = 0;
+		indexes[pending] = next;
+		pending++;
+	    }
+
+	    next++;
+	    next_attempt = now + (int64_t)RESOLVER_ATTEMPT_DELAY * 1000000;
+
+	    continue;
+	}
+
+	if(pending == 0)
+	{
+	    break;
+	}
+
+	int64_t wait = deadline - now;
+	if(next < naddrs && next_attempt - now < wait)
+	{
+	    wait = next_attempt - now;
+	}
+
+	// -1 waits as long as the pending attempts need
+	int wait_ms = (wait / 1000000 >= INT_MAX) ? -1 : (int)((wait + 999999) / 1000000);
+
+	int ret = poll(fds, pending, wait_ms);
+	if(ret < 0 && errno != EINTR)
+	{
+	    break;
+	}
+
+	for(int idx = 0; ret > 0 && idx < pending; idx++)
+	{
+	    if(fds[idx].revents == 0)
+	    {
+		continue;
+	    }
+
+	    int error = 0;
+	    socklen_t len = sizeof(error);
+
+	    if(getsockopt(fds[idx].fd, SOL_SOCKET, SO_ERROR, &error, &len) == 0 && error == 0)
+	    {
+		winner = indexes[idx];
+		*fd = fds[idx].fd;
+		fds[idx].fd = -1;
+
+		break;
+	    }
+
+	    // this address failed, forget it
+	    close(fds[idx].fd);
+	    pending--;
+	    fds[idx] = fds[pending];
+	    indexes[idx] = indexes[pending];
+	    idx--;
+	}
+    }
+
+    // the slower attempts lost the race
+    for(int idx = 0; idx < pending; idx++)
+    {
+	if(fds[idx].fd >= 0)
+	{
+	    close(fds[idx].fd);
+	}
+    }
+
+    return winner;
+}
+
+// the same fields as ci_client_connect_to, the other ones stay zeroed
+static ci_connection_t *
+py_resolver_connection(int fd, py_resolver_addr_t const *addr)
+{
+    ci_connection_t *conn = calloc(1, sizeof(*conn));
+    if(conn == NULL)
+    {
+	close(fd);
+
+	return NULL;
+    }
+
+    socklen_t len = sizeof(conn->claddr.sockaddr);
+
+    conn->fd = fd;
+    memcpy(&conn->srvaddr.sockaddr, &addr->addr, addr->len);
+    getsockname(fd, (struct sockaddr *)&conn->claddr.sockaddr, &len);
+    ci_fill_sockaddr(&conn->claddr);
+    ci_fill_sockaddr(&conn->srvaddr);
+    ci_netio_init(fd);
+
+    return conn;
+}
+
+ci_connection_t *
+py_resolver_connect(char const *host, int port, int proto, int timeout)
+{
+    py_resolver_entry_t result;
+    int cached = 0;
+    int fd = -1;
+
+    memset(&result, 0, sizeof(result));
+    result.host = (char *)host;
+    result.port = port;
+    result.proto = proto;
+
+    cached = py_resolver_cache_get(&result);
+    if(!cached && py_resolver_resolve(&result) != 0)
+    {
+	return NULL;
+    }
+
+    int idx = py_resolver_race(result.addrs, result.naddrs, timeout, &fd);
+    if(idx < 0)
+    {
+	if(cached)
+	{
+	    py_resolver_cache_invalidate(host, port, proto);
+	}
+
+	return NULL;
+    }
+
+    if(!cached)
+    {
+	py_resolver_cache_put(&result);
+    }
+
+    return py_resolver_connection(fd, &result.addrs[idx]);
+}
+
+py_resolver_attempt_t *
+py_resolver_begin(char const *host, int port, int proto)
+{
+    py_resolver_attempt_t *attempt = calloc(1, sizeof(*attempt));
+    if(attempt == NULL)
+    {
+	return NULL;
+    }
+
+    attempt->result.host = (char *)host;
+    attempt->result.port = port;
+    attempt->result.proto = proto;
+    attempt->fd = -1;
+
+    attempt->cached = py_resolver_cache_get(&attempt->result);
+    if(!attempt->cached && py_resolver_resolve(&attempt->result) != 0)
+    {
+	free(attempt);
+
+	return NULL;
+    }
+
+    return attempt;
+}
+
+int
+py_resolver_step(py_resolver_attempt_t *attempt, ci_connection_t **conn)
+{
+    py_resolver_entry_t *result = &attempt->result;
+
+    for(;;)
+    {
+	if(attempt->fd < 0)
+	{
+	    if(attempt->next >= result->naddrs)
+	    {
+		if(attempt->cached)
+		{
+		    py_resolver_cache_invalidate(result->host, result->port, result->proto);
+		}
+
+		return -1;
+	    }
+
+	    attempt->idx = attempt->next++;
+	    attempt->fd = py_resolver_start(&result->addrs[attempt->idx]);
+
+	    continue;
+	}
+
+	struct pollfd pfd = { .fd = attempt->fd, .events = POLLOUT, .revents = 0 };
+
+	int ret = poll(&pfd, 1, 0);
+	if(ret == 0 || (ret < 0 && errno == EINTR))
+	{
+	    return 1;
+	}
+
+	int error = 0;
+	socklen_t len = sizeof(error);
+
+	if(ret > 0 && getsockopt(attempt->fd, SOL_SOCKET, SO_ERROR, &error, &len) == 0 && error == 0)
+	{
+	    int fd = attempt->fd;
+
+	    attempt->fd = -1;
+
+	    if(!attempt->cached)
+	    {
+		py_resolver_cache_put(result);
+	    }
+
+	    *conn = py_resolver_connection(fd, &result->addrs[attempt->idx]);
+
+	    return (*conn != NULL) ? 0 : -1;
+	}
+
+	// this address failed, try the next one
+	close(attempt->fd), attempt->fd = -1;
+    }
+}
+
+int
+py_resolver_attempt_fd(py_resolver_attempt_t const *attempt)
+{
+    return attempt->fd;
+}
+
+void
+py_resolver_attempt_free(py_resolver_attempt_t *attempt)
+{
+    if(attempt->fd >= 0)
+    {
+	close(attempt->fd), attempt->fd = -1;
+    }
+
+    free(attempt);
+}
+
+int
+py_resolver_peer(ci_connection_t const *conn, char *host, size_t len, int *port)
+{
+    struct sockaddr const *addr = (struct sockaddr const *)&conn->srvaddr.sockaddr;
+    socklen_t addrlen = (addr->sa_family == AF_INET6) ?
+	sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+    char service[16];
+
+    if(getnameinfo(addr, addrlen, host, len, service, sizeof(service),
+		   NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+    {
+	return -1;
+    }
+
+    *port = atoi(service);
+
+    return 0;
+}
+
+void
+py_resolver_set_ttl(int ttl)
+{
+    pthread_mutex_lock(&py_resolver_lock);
+    py_resolver_ttl = ttl;
+    pthread_mutex_unlock(&py_resolver_lock);
+
+    if(ttl == 0)
+    {
+	py_resolver_cache_clear();
+    }
+}
+
+void
+py_resolver_cache_clear(void)
+{
+    pthread_mutex_lock(&py_resolver_lock);
+
+    while(py_resolver_cache != NULL)
+    {
+	py_resolver_remove(&py_resolver_cache);
+    }
+
+    pthread_mutex_unlock(&py_resolver_lock);
+}
@@ -0,0 +1,46 @@
+/* -*- Mode: C; c-basic-offset: 4 -*- */
+/*
+ * Copyright 2015 Vincent Rasneur <vrasneur@free.fr>
+ * All Rights Reserved.
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation, version 3.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ *   NON INFRINGEMENT.  See the GNU General Public License for
+ *   more details.
+ */
+
+#ifndef PY_ICAP_RESOLVER_H
+#define PY_ICAP_RESOLVER_H
+
+#include <sys/socket.h>
+
+#include "cicap_compat.h"
+
+// all the functions can be called without holding the GIL
+
+// resolve the server name, then connect to the first address that answers
+ci_connection_t *py_resolver_connect(char const *host, int port, int proto, int timeout);
+
+// a connection established without blocking, the host must outlive it
+typedef struct py_resolver_attempt py_resolver_attempt_t;
+
+// resolve the server name, which may block unless the addresses are cached
+py_resolver_attempt_t *py_resolver_begin(char const *host, int port, int proto);
+// returns 0 once connected, 1 while the socket is not writable yet, or -1 when all the addresses failed
+int py_resolver_step(py_resolver_attempt_t *attempt, ci_connection_t **conn);
+// the socket being connected, -1 between two addresses
+int py_resolver_attempt_fd(py_resolver_attempt_t const *attempt);
+void py_resolver_attempt_free(py_resolver_attempt_t *attempt);
+
+// format the server address of a connection, returns -1 if unknown
+int py_resolver_peer(ci_connection_t const *conn, char *host, size_t len, int *port);
+
+void py_resolver_set_ttl(int ttl);
+void py_resolver_cache_clear(void);
+
+#endif // PY_ICAP_RESOLVER_H
@@ -1,11 +1,17 @@
 #!/usr/bin/env python
 # -*- mode: python; coding: utf-8 -*-
 
-from commands import getoutput
 from os.path import join as path_join
 
-from distutils.core import setup, Extension
-from distutils.spawn import find_executable
+try:
+    from setuptools import setup, Extension
+except ImportError:
+    from distutils.core import setup, Extension
+
+try:
+    from shutil import which as find_executable
+except ImportError:
+    from distutils.spawn import find_executable
 
 from subprocess import check_output
 
@@ -15,11 +21,17 @@ if not find_executable(api_config):
     raise OSError('Cannot find the "%s" command' % api_config)
 
 extra_compile_args = ['-std=gnu99', '-Wextra']
-extra_compile_args.extend(check_output([api_config, '--cflags']).split())
+extra_compile_args.extend(check_output([api_config, '--cflags']).decode().split())
 
-extra_link_args = check_output([api_config, '--libs']).split()
+extra_link_args = check_output([api_config, '--libs']).decode().split()
+extra_link_args.append('-lpthread')
 
-ext = Extension(name='icapclient', sources=['icapclient.c', 'ICAPConnection.c', 'ICAPResponse.c', 'cicap_compat.c'],
+ext = Extension(name='icapclient', sources=['icapclient.c', 'ICAPConnection.c', 'ICAPResponse.c', 'cicap_compat.c',
+                                                'options_cache.c', 'ICAPConnectionPool.c', 'ICAPContent.c',
+                                                'ICAPScanner.c', 'sha256.c', 'verdict_cache.c',
+                                                'ICAPHeaders.c', 'HTTPHeaders.c', 'metrics.c', 'resolver.c',
+                                                'ICAPCluster.c', 'native_client.c', 'py_compat.c',
+                                                'ICAPExchange.c'],
                 extra_compile_args=extra_compile_args,
                 extra_link_args=extra_link_args)
 
@@ -0,0 +1,158 @@
+/* -*- Mode: C; c-basic-offset: 4 -*- */
+/*
+ * Copyright 2015 Vincent Rasneur <vrasneur@free.fr>
+ * All Rights Reserved.
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation, version 3.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ *   NON INFRINGEMENT.  See the GNU General Public License for
+ *   more details.
+ */
+
+// SHA-256, as specified in FIPS 180-4
+
+#include "sha256.h"
+
+#include <string.h>
+
+static uint32_t const sha256_k[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void
+sha256_transform(sha256_ctx_t *ctx, unsigned char const *block)
+{
+    uint32_t w[64];
+    uint32_t s[8];
+
+    for(int idx = 0; idx < 16; idx++)
+    {
+	w[idx] = ((uint32_t)block[idx * 4] << 24) | ((uint32_t)block[idx * 4 + 1] << 16) |
+	    ((uint32_t)block[idx * 4 + 2] << 8) | (uint32_t)block[idx * 4 + 3];
+    }
+
+    for(int idx = 16; idx < 64; idx++)
+    {
+	uint32_t s0 = ROTR(w[idx - 15], 7) ^ ROTR(w[idx - 15], 18) ^ (w[idx - 15] >> 3);
+	uint32_t s1 = ROTR(w[idx - 2], 17) ^ ROTR(w[idx - 2], 19) ^ (w[idx - 2] >> 10);
+
+	w[idx] = w[idx - 16] + s0 + w[idx - 7] + s1;
+    }
+
+    memcpy(s, ctx->state, sizeof(s));
+
+    for(int idx = 0; idx < 64; idx++)
+    {
+	uint32_t S1 = ROTR(s[4], 6) ^ ROTR(s[4], 11) ^ ROTR(s[4], 25);
+	uint32_t ch = (s[4] & s[5]) ^ (~s[4] & s[6]);
+	uint32_t t1 = s[7] + S1 + ch + sha256_k[idx] + w[idx];
+	uint32_t S0 = ROTR(s[0], 2) ^ ROTR(s[0], 13) ^ ROTR(s[0], 22);
+	uint32_t maj = (s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]);
+	uint32_t t2 = S0 + maj;
+
+	s[7] = s[6];
+	s[6] = s[5];
+	s[5] = s[4];
+	s[4] = s[3] + t1;
+	s[3] = s[2];
+	s[2] = s[1];
+	s[1] = s[0];
+	s[0] = t1 + t2;
+    }
+
+    for(int idx = 0; idx < 8; idx++)
+    {
+	ctx->state[idx] += s[idx];
+    }
+}
+
+void
+sha256_init(sha256_ctx_t *ctx)
+{
+    static uint32_t const init[8] =
+    {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(ctx->state, init, sizeof(init));
+    ctx->len = 0;
+    ctx->used = 0;
+}
+
+void
+sha256_update(sha256_ctx_t *ctx, void const *data, size_t len)
+{
+    unsigned char const *bytes = data;
+
+    ctx->len += len;
+
+    if(ctx->used > 0)
+    {
+	size_t count = sizeof(ctx->block) - ctx->used;
+	if(count > len)
+	{
+	    count = len;
+	}
+
+	memcpy(ctx->block + ctx->used, bytes, count);
+	ctx->used += count;
+	bytes += count;
+	len -= count;
+
+	if(ctx->used < sizeof(ctx->block))
+	{
+	    return;
+	}
+
+	sha256_transform(ctx, ctx->block);
+	ctx->used = 0;
+    }
+
+    // hash the full blocks in place
+    for(; len >= sizeof(ctx->block); bytes += sizeof(ctx->block), len -= sizeof(ctx->block))
+    {
+	sha256_transform(ctx, bytes);
+    }
+
+    memcpy(ctx->block, bytes, len);
+    ctx->used = len;
+}
+
+void
+sha256_final(sha256_ctx_t *ctx, unsigned char digest[SHA256_DIGEST_SIZE])
+{
+    uint64_t bits = ctx->len * 8;
+    unsigned char pad[sizeof(ctx->block) + 8] = { 0x80 };
+    size_t padlen = (ctx->used < 56) ? (56 - ctx->used) : (120 - ctx->used);
+
+    for(int idx = 0; idx < 8; idx++)
+    {
+	pad[padlen + idx] = (unsigned char)(bits >> (56 - idx * 8));
+    }
+
+    sha256_update(ctx, pad, padlen + 8);
+
+    for(int idx = 0; idx < 8; idx++)
+    {
+	digest[idx * 4] = (unsigned char)(ctx->state[idx] >> 24);
+	digest[idx * 4 + 1] = (unsigned char)(ctx->state[idx] >> 16);
+	digest[idx * 4 + 2] = (unsigned char)(ctx->state[idx] >> 8);
+	digest[idx * 4 + 3] = (unsigned char)ctx->state[idx];
+    }
+}
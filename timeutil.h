@@ -0,0 +1,79 @@
+/* -*- Mode: C; c-basic-offset: 4 -*- */
+/*
+ * Copyright 2015 Vincent Rasneur <vrasneur@free.fr>
+ * All Rights Reserved.
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation, version 3.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ *   NON INFRINGEMENT.  See the GNU General Public License for
+ *   more details.
+ */
+
+#ifndef TIMEUTIL_H
+#define TIMEUTIL_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+// monotonic time in seconds
+static inline time_t
+py_time_now(void)
+{
+    struct timespec ts = { 0 };
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec;
+}
+
+// monotonic time in nanoseconds, served by the vDSO without a syscall
+static inline int64_t
+py_time_now_ns(void)
+{
+    struct timespec ts = { 0 };
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// a monotonic deadline, delay seconds from now
+static inline void
+py_time_deadline(struct timespec *ts, double delay)
+{
+    clock_gettime(CLOCK_MONOTONIC, ts);
+
+    if(delay > 0)
+    {
+	time_t secs = (time_t)delay;
+	long nsecs = (long)((delay - secs) * 1e9);
+
+	ts->tv_sec += secs;
+	ts->tv_nsec += nsecs;
+	if(ts->tv_nsec >= 1000000000L)
+	{
+	    ts->tv_sec++;
+	    ts->tv_nsec -= 1000000000L;
+	}
+    }
+}
+
+// a condition variable that waits with monotonic deadlines
+static inline void
+py_time_cond_init(pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+#endif // TIMEUTIL_H
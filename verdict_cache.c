@@ -0,0 +1,498 @@
+/* -*- Mode: C; c-basic-offset: 4 -*- */
+/*
+ * Copyright 2015 Vincent Rasneur <vrasneur@free.fr>
+ * All Rights Reserved.
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation, version 3.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ *   NON INFRINGEMENT.  See the GNU General Public License for
+ *   more details.
+ */
+
+#include "verdict_cache.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "options_cache.h"
+#include "timeutil.h"
+#include "HTTPHeaders.h"
+#include "ICAPResponse.h"
+#include "metrics.h"
+
+// the size of the blocks read to hash a file
+#define VERDICT_READ_BLOCK_SIZE 65536
+
+// a cached response, in a LRU list
+typedef struct py_verdict_entry
+{
+    struct py_verdict_entry *prev;
+    struct py_verdict_entry *next;
+    PyObject *key;
+    PyObject *resp;
+    // monotonic time in seconds
+    time_t expires;
+    char *service_id;
+} py_verdict_entry_t;
+
+// the last ISTag seen for a service
+typedef struct py_verdict_istag
+{
+    struct py_verdict_istag *next;
+    char *service_id;
+    char istag[ICAP_ISTAG_SIZE];
+} py_verdict_istag_t;
+
+// the whole state is protected by the GIL
+static Py_ssize_t py_verdict_max_entries = 0;
+static int py_verdict_ttl = 0;
+// the bigger contents are not hashed, 0 for no limit
+static Py_ssize_t py_verdict_max_size = 0;
+// maps a key to its entry address
+static PyObject *py_verdict_index = NULL;
+// the most recently used entry first
+static py_verdict_entry_t *py_verdict_head = NULL;
+static py_verdict_entry_t *py_verdict_tail = NULL;
+static py_verdict_istag_t *py_verdict_istags = NULL;
+
+// hashing a content costs about as much as reading it once more: the big ones
+// are better scanned again than hashed for a hit that may never come
+int
+py_verdict_digest(py_conn_input_t const *input, Py_ssize_t max_size,
+		  unsigned char digest[SHA256_DIGEST_SIZE])
+{
+    sha256_ctx_t ctx;
+
+    sha256_init(&ctx);
+
+    // a stream is only read once, while it is sent
+    if(input->stream != NULL)
+    {
+	return -1;
+    }
+
+    if(input->fd < 0)
+    {
+	if(max_size > 0 && input->len > max_size)
+	{
+	    return -1;
+	}
+
+	sha256_update(&ctx, input->data, input->len);
+	sha256_final(&ctx, digest);
+
+	return 0;
+    }
+
+    // only a regular file is read again when sending the request
+    struct stat st;
+    if(input->start < 0 || fstat(input->fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+	return -1;
+    }
+
+    if(max_size > 0 && st.st_size - input->start > max_size)
+    {
+	return -1;
+    }
+
+    char *block = malloc(VERDICT_READ_BLOCK_SIZE);
+    if(block == NULL)
+    {
+	return -1;
+    }
+
+    off_t offset = input->start;
+    ssize_t len = 0;
+
+    // pread does not move the file offset used by the request
+    while((len = pread(input->fd, block, VERDICT_READ_BLOCK_SIZE, offset)) > 0)
+    {
+	sha256_update(&ctx, block, len);
+	offset += len;
+    }
+
+    free(block), block = NULL;
+
+    if(len < 0)
+    {
+	return -1;
+    }
+
+    sha256_final(&ctx, digest);
+
+    return 0;
+}
+
+int
+py_verdict_cache_enabled(void)
+{
+    return py_verdict_max_entries > 0;
+}
+
+Py_ssize_t
+py_verdict_cache_max_size(void)
+{
+    return py_verdict_max_size;
+}
+
+static char *
+py_verdict_service_id(py_conn_job_t const *job)
+{
+    char *service_id = NULL;
+
+    if(asprintf(&service_id, "%s:%d/%s", job->host, job->port, job->service) < 0)
+    {
+	return NULL;
+    }
+
+    return service_id;
+}
+
+// the key covers everything the server verdict depends on
+static PyObject *
+py_verdict_key(py_conn_job_t const *job, char const *service_id,
+	       unsigned char const *digest, char const *istag)
+{
+    unsigned char key[SHA256_DIGEST_SIZE];
+    // a discarded body makes the server answer 204 or 206 without the content
+    unsigned char flags[5] = { job->type, job->output.read_content != 0,
+			       job->req_headers != NULL, job->resp_headers != NULL,
+			       job->output.discard != 0 };
+    sha256_ctx_t ctx;
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, digest, SHA256_DIGEST_SIZE);
+    sha256_update(&ctx, flags, sizeof(flags));
+    // the strings are hashed with their trailing NUL as a separator
+    sha256_update(&ctx, job->url, strlen(job->url) + 1);
+    sha256_update(&ctx, service_id, strlen(service_id) + 1);
+    sha256_update(&ctx, istag, strlen(istag) + 1);
+
+    // the server may decide from the encapsulated headers
+    if(job->req_headers != NULL)
+    {
+	sha256_update(&ctx, ((PyHTTPHeaders *)job->req_headers)->digest, SHA256_DIGEST_SIZE);
+    }
+
+    if(job->resp_headers != NULL)
+    {
+	sha256_update(&ctx, ((PyHTTPHeaders *)job->resp_headers)->digest, SHA256_DIGEST_SIZE);
+    }
+
+    sha256_final(&ctx, key);
+
+    return PyString_FromStringAndSize((char const *)key, sizeof(key));
+}
+
+static void
+py_verdict_unlink(py_verdict_entry_t *entry)
+{
+    if(entry->prev != NULL)
+    {
+	entry->prev->next = entry->next;
+    }
+    else
+    {
+	py_verdict_head = entry->next;
+    }
+
+    if(entry->next != NULL)
+    {
+	entry->next->prev = entry->prev;
+    }
+    else
+    {
+	py_verdict_tail = entry->prev;
+    }
+
+    entry->prev = entry->next = NULL;
+}
+
+static void
+py_verdict_push_front(py_verdict_entry_t *entry)
+{
+    entry->prev = NULL;
+    entry->next = py_verdict_head;
+
+    if(py_verdict_head != NULL)
+    {
+	py_verdict_head->prev = entry;
+    }
+    else
+    {
+	py_verdict_tail = entry;
+    }
+
+    py_verdict_head = entry;
+}
+
+static void
+py_verdict_remove(py_verdict_entry_t *entry)
+{
+    py_verdict_unlink(entry);
+
+    if(PyDict_DelItem(py_verdict_index, entry->key) != 0)
+    {
+	PyErr_Clear();
+    }
+
+    Py_DECREF(entry->key);
+    Py_DECREF(entry->resp);
+    free(entry->service_id);
+    free(entry);
+}
+
+// forget the verdicts of a service when its ISTag changes
+static void
+py_verdict_check_istag(char const *service_id, char const *istag)
+{
+    py_verdict_istag_t *seen = py_verdict_istags;
+
+    for(; seen != NULL; seen = seen->next)
+    {
+	if(strcmp(seen->service_id, service_id) == 0)
+	{
+	    break;
+	}
+    }
+
+    if(seen == NULL)
+    {
+	seen = calloc(1, sizeof(*seen));
+	if(seen == NULL)
+	{
+	    return;
+	}
+
+	seen->service_id = strdup(service_id);
+	if(seen->service_id == NULL)
+	{
+	    free(seen);
+
+	    return;
+	}
+
+	seen->next = py_verdict_istags;
+	py_verdict_istags = seen;
+    }
+    else if(strncmp(seen->istag, istag, ICAP_ISTAG_SIZE - 1) == 0)
+    {
+	return;
+    }
+
+    snprintf(seen->istag, sizeof(seen->istag), "%s", istag);
+
+    py_verdict_entry_t *entry = py_verdict_head;
+    while(entry != NULL)
+    {
+	py_verdict_entry_t *next = entry->next;
+
+	if(strcmp(entry->service_id, service_id) == 0)
+	{
+	    py_verdict_remove(entry);
+	}
+
+	entry = next;
+    }
+}
+
+PyObject *
+py_verdict_cache_get(py_conn_job_t const *job, unsigned char const *digest)
+{
+    py_options_t opts;
+    PyObject *resp = NULL;
+
+    if(py_verdict_index == NULL)
+    {
+	return NULL;
+    }
+
+    if(!py_options_cache_get(job->host, job->port, job->service, &opts))
+    {
+	py_metrics_record_verdict(0);
+
+	return NULL;
+    }
+
+    // the verdicts are only valid for a known service state
+    char *service_id = NULL;
+    if(opts.istag[0] == '\0' || (service_id = py_verdict_service_id(job)) == NULL)
+    {
+	goto py_verdict_cache_get_error;
+    }
+
+    py_verdict_check_istag(service_id, opts.istag);
+
+    PyObject *key = py_verdict_key(job, service_id, digest, opts.istag);
+    if(key == NULL)
+    {
+	PyErr_Clear();
+
+	goto py_verdict_cache_get_error;
+    }
+
+    PyObject *addr = PyDict_GetItem(py_verdict_index, key);
+    Py_DECREF(key);
+
+    if(addr != NULL)
+    {
+	py_verdict_entry_t *entry = PyLong_AsVoidPtr(addr);
+
+	if(entry->expires <= py_time_now())
+	{
+	    py_verdict_remove(entry);
+	}
+	else
+	{
+	    py_verdict_unlink(entry);
+	    py_verdict_push_front(entry);
+
+	    // the saved response keeps the stats of the exchange that built it
+	    resp = py_resp_copy(entry->resp);
+	    if(resp == NULL)
+	    {
+		// the content is sent to the server instead
+		PyErr_Clear();
+	    }
+	}
+    }
+
+py_verdict_cache_get_error:
+
+    free(service_id);
+    py_options_free(&opts);
+
+    py_metrics_record_verdict(resp != NULL);
+
+    return resp;
+}
+
+void
+py_verdict_cache_put(py_conn_job_t const *job, unsigned char const *digest,
+		     char const *istag, PyObject *resp)
+{
+    if(py_verdict_index == NULL || istag == NULL || istag[0] == '\0')
+    {
+	return;
+    }
+
+    py_verdict_entry_t *entry = calloc(1, sizeof(*entry));
+    if(entry == NULL)
+    {
+	return;
+    }
+
+    entry->service_id = py_verdict_service_id(job);
+    if(entry->service_id == NULL)
+    {
+	goto py_verdict_cache_put_error;
+    }
+
+    // the response may come from an updated service
+    py_verdict_check_istag(entry->service_id, istag);
+
+    entry->key = py_verdict_key(job, entry->service_id, digest, istag);
+    if(entry->key == NULL)
+    {
+	goto py_verdict_cache_put_error;
+    }
+
+    PyObject *addr = PyDict_GetItem(py_verdict_index, entry->key);
+    if(addr != NULL)
+    {
+	py_verdict_remove(PyLong_AsVoidPtr(addr));
+    }
+
+    addr = PyLong_FromVoidPtr(entry);
+    if(addr == NULL)
+    {
+	goto py_verdict_cache_put_error;
+    }
+
+    int ret = PyDict_SetItem(py_verdict_index, entry->key, addr);
+    Py_DECREF(addr);
+
+    if(ret != 0)
+    {
+	goto py_verdict_cache_put_error;
+    }
+
+    Py_INCREF(resp);
+    entry->resp = resp;
+    entry->expires = py_time_now() + py_verdict_ttl;
+    py_verdict_push_front(entry);
+
+    // evict the least recently used verdicts
+    while(PyDict_Size(py_verdict_index) > py_verdict_max_entries)
+    {
+	py_verdict_remove(py_verdict_tail);
+    }
+
+    return;
+
+py_verdict_cache_put_error:
+
+    // the cache is best effort
+    PyErr_Clear();
+
+    Py_XDECREF(entry->key);
+    free(entry->service_id);
+    free(entry);
+}
+
+void
+py_verdict_cache_configure(Py_ssize_t max_entries, int ttl, Py_ssize_t max_size)
+{
+    py_verdict_max_entries = max_entries;
+    py_verdict_ttl = ttl;
+    py_verdict_max_size = max_size;
+
+    if(max_entries == 0)
+    {
+	py_verdict_cache_clear();
+	Py_CLEAR(py_verdict_index);
+
+	return;
+    }
+
+    if(py_verdict_index == NULL)
+    {
+	py_verdict_index = PyDict_New();
+	if(py_verdict_index == NULL)
+	{
+	    PyErr_Clear();
+	    py_verdict_max_entries = 0;
+
+	    return;
+	}
+    }
+
+    while(py_verdict_tail != NULL && PyDict_Size(py_verdict_index) > max_entries)
+    {
+	py_verdict_remove(py_verdict_tail);
+    }
+}
+
+void
+py_verdict_cache_clear(void)
+{
+    while(py_verdict_tail != NULL)
+    {
+	py_verdict_remove(py_verdict_tail);
+    }
+
+    while(py_verdict_istags != NULL)
+    {
+	py_verdict_istag_t *seen = py_verdict_istags;
+
+	py_verdict_istags = seen->next;
+	free(seen->service_id);
+	free(seen);
+    }
+}
@@ -0,0 +1,42 @@
+/* -*- Mode: C; c-basic-offset: 4 -*- */
+/*
+ * Copyright 2015 Vincent Rasneur <vrasneur@free.fr>
+ * All Rights Reserved.
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation, version 3.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ *   NON INFRINGEMENT.  See the GNU General Public License for
+ *   more details.
+ */
+
+#ifndef PY_ICAP_VERDICT_CACHE_H
+#define PY_ICAP_VERDICT_CACHE_H
+
+#include "py_compat.h"
+
+#include "ICAPConnection.h"
+#include "sha256.h"
+
+// the biggest content hashed by default, the others are always sent
+#define ICAP_VERDICT_DEFAULT_MAX_SIZE (16 * 1024 * 1024)
+
+// must be called without holding the GIL, fails if the input cannot be hashed
+// or is bigger than max_size bytes (0 for no limit)
+int py_verdict_digest(py_conn_input_t const *input, Py_ssize_t max_size,
+		      unsigned char digest[SHA256_DIGEST_SIZE]);
+
+// the cache functions must be called with the GIL held
+int py_verdict_cache_enabled(void);
+Py_ssize_t py_verdict_cache_max_size(void);
+void py_verdict_cache_configure(Py_ssize_t max_entries, int ttl, Py_ssize_t max_size);
+PyObject *py_verdict_cache_get(py_conn_job_t const *job, unsigned char const *digest);
+void py_verdict_cache_put(py_conn_job_t const *job, unsigned char const *digest,
+			  char const *istag, PyObject *resp);
+void py_verdict_cache_clear(void);
+
+#endif // PY_ICAP_VERDICT_CACHE_H